@@ -23,10 +23,14 @@
 #include "BufferedSerial.h"
 #include "mbed.h"
 #include <stdarg.h>
+#include "xprintf.h"
 
 BufferedSerial::BufferedSerial(PinName tx, PinName rx, uint32_t buf_size, uint32_t tx_multiple, const char* name, int sample_rate)
-    : RawSerial(tx, rx, sample_rate) , _rxbuf(buf_size), _txbuf((uint32_t)(tx_multiple*buf_size))
+    : RawSerial(tx, rx, sample_rate) , _rxbuf(buf_size), _txbuf((uint32_t)(tx_multiple*buf_size)),
+      _overflow_policy(OVERFLOW_DROP_NEWEST), _overflow_timeout_ms(0)
 {
+    reset_stats();
+
     RawSerial::attach(callback(this, &BufferedSerial::rxIrq), RawSerial::RxIrq);
 
     this->_buf_size = buf_size;
@@ -43,6 +47,84 @@ BufferedSerial::~BufferedSerial(void)
     return;
 }
 
+void BufferedSerial::set_overflow_policy(OverflowPolicy policy, uint32_t timeout_ms)
+{
+    _overflow_policy = policy;
+    _overflow_timeout_ms = timeout_ms;
+}
+
+void BufferedSerial::get_stats(Stats *stats)
+{
+    core_util_critical_section_enter();
+    stats->tx_dropped = _stats.tx_dropped;
+    stats->rx_overrun = _stats.rx_overrun;
+    stats->tx_high_watermark = _stats.tx_high_watermark;
+    stats->rx_high_watermark = _stats.rx_high_watermark;
+    core_util_critical_section_exit();
+}
+
+void BufferedSerial::reset_stats(void)
+{
+    core_util_critical_section_enter();
+    _stats.tx_dropped = 0;
+    _stats.rx_overrun = 0;
+    _stats.tx_high_watermark = 0;
+    _stats.rx_high_watermark = 0;
+    core_util_critical_section_exit();
+}
+
+int BufferedSerial::txPut(const uint8_t *data, int len)
+{
+    int dropped = 0;
+    int n = 0;
+
+    if (_txbuf.available() < len) {
+        if (_overflow_policy == OVERFLOW_BLOCK && __get_IPSR() == 0) {
+            // queue what fits and keep the UART draining until the rest fits
+            Timer timer;
+            timer.start();
+            n = _txbuf.put(data, len);
+            while (n < len && (uint32_t)timer.read_ms() < _overflow_timeout_ms) {
+                BufferedSerial::prime();
+                wait_ms(1);
+                n += _txbuf.put(data + n, len - n);
+            }
+        } else if (_overflow_policy == OVERFLOW_DROP_OLDEST) {
+            // only the newest capacity() bytes can survive
+            if (len > _txbuf.capacity()) {
+                dropped += len - _txbuf.capacity();
+                data += len - _txbuf.capacity();
+                len = _txbuf.capacity();
+            }
+            // txIrq is the consumer, keep it out while the oldest bytes go
+            core_util_critical_section_enter();
+            int excess = len - _txbuf.available();
+            if (excess > 0) {
+                _txbuf.consume(excess);
+                dropped += excess;
+            }
+            core_util_critical_section_exit();
+        }
+    }
+
+    n += _txbuf.put(data + n, len - n);
+    dropped += len - n;
+
+    uint32_t used = _txbuf.use();
+    core_util_critical_section_enter();
+    _stats.tx_dropped += dropped;
+    if (used > _stats.tx_high_watermark) {
+        _stats.tx_high_watermark = used;
+    }
+    core_util_critical_section_exit();
+    return n;
+}
+
+size_t BufferedSerial::txSink(void *context, const char *data, size_t len)
+{
+    return ((BufferedSerial*)context)->write(data, len);
+}
+
 int BufferedSerial::readable(void)
 {
     return _rxbuf.use();
@@ -55,7 +137,10 @@ int BufferedSerial::writable(void)
 
 void BufferedSerial::flush(void)
 {
+    // dropping queued tx bytes moves the read index, which belongs to txIrq
+    core_util_critical_section_enter();
     _txbuf.clear();
+    core_util_critical_section_exit();
     _rxbuf.clear();
 }
 
@@ -69,27 +154,30 @@ int BufferedSerial::getc(void)
     return _rxbuf.getc();
 }
 
+ssize_t BufferedSerial::read(void *buffer, size_t length)
+{
+    return _rxbuf.get((uint8_t*)buffer, length);
+}
+
 int BufferedSerial::putc(int c)
 {
-    _txbuf.putc(c);
+    uint8_t data = c;
+    int n = BufferedSerial::txPut(&data, 1);
     BufferedSerial::prime();
 
-    return c;
+    return n == 1 ? c : -1;
 }
 
 int BufferedSerial::puts(const uint8_t *s)
 {
     if (s != NULL) {
-        const uint8_t* ptr = s;
-    
-        while(*(ptr) != 0) {
-            _txbuf.putc(*(ptr++)); 
-        }
+        int len = strlen((const char*)s);
 
-        _txbuf.putc('\n');      // done per puts definition
+        int n = BufferedSerial::txPut(s, len);
+        n += BufferedSerial::txPut((const uint8_t*)"\n", 1);      // done per puts definition
         BufferedSerial::prime();
     
-        return (ptr - s) + 1;
+        return n;
     }
 
     return 0;
@@ -98,48 +186,60 @@ int BufferedSerial::puts(const uint8_t *s)
 ssize_t BufferedSerial::write(const void *s, size_t length)
 {
     if (s != NULL && length > 0) {
-        const char* ptr = (const char*)s;
-        const char* end = ptr + length;
-    
-        while (ptr != end) {
-            _txbuf.putc(*(ptr++));
-        }
+        int n = BufferedSerial::txPut((const uint8_t*)s, length);
         BufferedSerial::prime();
     
-        return ptr - (const char*)s;
+        return n;
     }
     return 0;
 }
 
 int BufferedSerial::printf(const char* format, ...)
 {
-    char *buffer = (char*)malloc(this->_buf_size);
-    memset(buffer,0,this->_buf_size);
-    uint32_t r = 0;
- 
+    uint8_t *span;
+    int free_len = _txbuf.reserve(&span);
+    int r;
+
+    // format straight into the tx buffer when the output fits in one span
     va_list arg;
     va_start(arg, format);
-    r = vsprintf(buffer, format, arg);
-    // this may not hit the heap but should alert the user anyways
-    if(r > this->_buf_size) {
-        error("%s %d buffer overwrite (max_buf_size: %d exceeded: %d)!\r\n", __FILE__, __LINE__,this->_buf_size,r);
-        va_end(arg);
-        free(buffer);
+    r = vsnprintf((char*)span, free_len, format, arg);
+    va_end(arg);
+    if (r < 0) {
         return 0;
     }
+    if (r < free_len) {
+        _txbuf.commit(r);
+        uint32_t used = _txbuf.use();
+        core_util_critical_section_enter();
+        if (used > _stats.tx_high_watermark) {
+            _stats.tx_high_watermark = used;
+        }
+        core_util_critical_section_exit();
+        BufferedSerial::prime();
+        return r;
+    }
 
+    // the span wrapped or is full, format again in chunks through write()
+    va_start(arg, format);
+    r = xvprintf(BufferedSerial::txSink, this, format, arg);
     va_end(arg);
-    r = BufferedSerial::write(buffer, r);
-    free(buffer);
     return r;
 }
 
 void BufferedSerial::rxIrq(void)
 {
-    // read from the peripheral and make sure something is available
-    if(serial_readable(&_serial)) {
-       uint8_t data = serial_getc(&_serial); // if so load them into a buffer
-       _rxbuf.putc(data);
+    // drain everything the peripheral holds in this one interrupt
+    while(serial_readable(&_serial)) {
+        uint8_t data = serial_getc(&_serial);
+        if (_rxbuf.putc(data) < 0) {
+            _stats.rx_overrun++;
+        }
+    }
+
+    uint32_t used = _rxbuf.use();
+    if (used > _stats.rx_high_watermark) {
+        _stats.rx_high_watermark = used;
     }
 
     return;
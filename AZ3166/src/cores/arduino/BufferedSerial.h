@@ -39,12 +39,35 @@
  */  
 class BufferedSerial : public RawSerial 
 {
+public:
+    /** What to do with output that does not fit in the tx buffer
+     */
+    enum OverflowPolicy {
+        OVERFLOW_DROP_NEWEST,   ///< discard the bytes that do not fit (default)
+        OVERFLOW_DROP_OLDEST,   ///< discard the oldest queued bytes to make room
+        OVERFLOW_BLOCK,         ///< wait for room, up to the configured timeout
+    };
+
+    /** Per-port overflow and usage counters
+     */
+    typedef struct {
+        uint32_t tx_dropped;            ///< tx bytes discarded by the overflow policy
+        uint32_t rx_overrun;            ///< received bytes lost because the rx buffer was full
+        uint32_t tx_high_watermark;     ///< most bytes ever queued in the tx buffer
+        uint32_t rx_high_watermark;     ///< most bytes ever queued in the rx buffer
+    } Stats;
+
 private:
     RingBuffer _rxbuf;
     RingBuffer _txbuf;
     uint32_t _buf_size;
     uint32_t _tx_multiple;
+    OverflowPolicy _overflow_policy;
+    uint32_t _overflow_timeout_ms;
+    volatile Stats _stats;
  
+    int txPut(const uint8_t *data, int len);
+    static size_t txSink(void *context, const char *data, size_t len);
     void rxIrq(void);
     void txIrq(void);
     void prime(void);
@@ -80,6 +103,13 @@ public:
      *  @return A byte that came in on the Serial Port
      */
     virtual int getc(void);
+
+    /** Read whatever is in the rx buffer, up to length bytes, without waiting
+     *  @param buffer Where the bytes are copied to
+     *  @param length Size of buffer
+     *  @return The number of bytes copied
+     */
+    virtual ssize_t read(void *buffer, std::size_t length);
     
     /** Write a single byte to the BufferedSerial Port.
      *  @param c The byte to write to the Serial Port
@@ -106,6 +136,22 @@ public:
      */
     virtual ssize_t write(const void *s, std::size_t length);
 
+    /** Select what happens when the tx buffer is full
+     *  @param policy One of OverflowPolicy
+     *  @param timeout_ms How long OVERFLOW_BLOCK waits for room before dropping the rest
+     *  @note OVERFLOW_BLOCK never waits in interrupt context.
+     */
+    void set_overflow_policy(OverflowPolicy policy, uint32_t timeout_ms = 0);
+
+    /** Read the overflow and usage counters
+     *  @param stats Receives a snapshot of the counters
+     */
+    void get_stats(Stats *stats);
+
+    /** Reset the overflow and usage counters to zero
+     */
+    void reset_stats(void);
+
     virtual void flush(void);
 };
 
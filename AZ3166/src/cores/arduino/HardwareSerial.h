@@ -30,6 +30,7 @@ class HardwareSerial : public Stream
     virtual int available(void) = 0;
     virtual int peek(void) = 0;
     virtual int read(void) = 0;
+    using Stream::read; // pull in read(buf, size) from Stream
     virtual void flush(void) = 0;
     virtual size_t write(unsigned char) = 0;
     using Print::write; // pull in write(str) and write(buf, size) from Print
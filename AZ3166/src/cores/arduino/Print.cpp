@@ -28,6 +28,7 @@
 #include <Arduino.h>
 
 #include "Print.h"
+#include "xprintf.h"
 
 // Public Methods //////////////////////////////////////////////////////////////
 
@@ -40,62 +41,29 @@ size_t Print::write(const uint8_t *buffer, size_t size) {
     return n;
 }
 
+static size_t print_sink(void *context, const char *data, size_t len) {
+    return ((Print*) context)->write((const uint8_t*) data, len);
+}
+
 size_t Print::printf(const char *format, ...) {
     va_list arg;
     va_start(arg, format);
-    char temp[64];
-    char* buffer = temp;
-    size_t len = vsnprintf(temp, sizeof(temp), format, arg);
+    size_t len = xvprintf(print_sink, this, format, arg);
     va_end(arg);
-    if (len > sizeof(temp) - 1) {
-        buffer = new char[len + 1];
-        if (!buffer) {
-            return 0;
-        }
-        va_start(arg, format);
-        vsnprintf(buffer, len + 1, format, arg);
-        va_end(arg);
-    }
-    len = write((const uint8_t*) buffer, len);
-    if (buffer != temp) {
-        delete[] buffer;
-    }
     return len;
 }
 
 size_t Print::printf_P(PGM_P format, ...) {
     va_list arg;
     va_start(arg, format);
-    char temp[64];
-    char* buffer = temp;
-    size_t len = vsnprintf_P(temp, sizeof(temp), format, arg);
+    size_t len = xvprintf(print_sink, this, format, arg);
     va_end(arg);
-    if (len > sizeof(temp) - 1) {
-        buffer = new char[len + 1];
-        if (!buffer) {
-            return 0;
-        }
-        va_start(arg, format);
-        vsnprintf_P(buffer, len + 1, format, arg);
-        va_end(arg);
-    }
-    len = write((const uint8_t*) buffer, len);
-    if (buffer != temp) {
-        delete[] buffer;
-    }
     return len;
 }
 
 size_t Print::print(const __FlashStringHelper *ifsh) {
-    PGM_P p = reinterpret_cast<PGM_P>(ifsh);
-
-    size_t n = 0;
-    while (1) {
-        uint8_t c = pgm_read_byte(p++);
-        if (c == 0) break;
-        n += write(c);
-    }
-    return n;
+    // flash is memory mapped on this target, hand the whole string over at once
+    return write(reinterpret_cast<PGM_P>(ifsh));
 }
 
 size_t Print::print(const String &s) {
@@ -159,7 +127,7 @@ size_t Print::print(const Printable& x) {
 }
 
 size_t Print::println(void) {
-    return print("\r\n");
+    return write("\r\n", 2);
 }
 
 size_t Print::println(const String &s) {
@@ -245,7 +213,9 @@ size_t Print::printNumber(unsigned long n, uint8_t base) {
 }
 
 size_t Print::printFloat(double number, uint8_t digits) {
-    size_t n = 0;
+    // sign, 10 integer digits, point and up to 20 decimals, written in one go
+    char buf[32];
+    size_t len = 0;
 
     if(isnan(number))
         return print("nan");
@@ -255,10 +225,12 @@ size_t Print::printFloat(double number, uint8_t digits) {
         return print("ovf");  // constant determined empirically
     if(number < -4294967040.0)
         return print("ovf");  // constant determined empirically
+    if(digits > 20)
+        digits = 20;
 
     // Handle negative numbers
     if(number < 0.0) {
-        n += print('-');
+        buf[len++] = '-';
         number = -number;
     }
 
@@ -272,20 +244,28 @@ size_t Print::printFloat(double number, uint8_t digits) {
     // Extract the integer part of the number and print it
     unsigned long int_part = (unsigned long) number;
     double remainder = number - (double) int_part;
-    n += print(int_part);
+    char digitsBuf[10];
+    size_t count = 0;
+    do {
+        digitsBuf[count++] = '0' + int_part % 10;
+        int_part /= 10;
+    } while(int_part);
+    while(count > 0) {
+        buf[len++] = digitsBuf[--count];
+    }
 
     // Print the decimal point, but only if there are digits beyond
     if(digits > 0) {
-        n += print(".");
+        buf[len++] = '.';
     }
 
     // Extract digits from the remainder one at a time
     while(digits-- > 0) {
         remainder *= 10.0;
         int toPrint = int(remainder);
-        n += print(toPrint);
+        buf[len++] = '0' + toPrint;
         remainder -= toPrint;
     }
 
-    return n;
+    return write(buf, len);
 }
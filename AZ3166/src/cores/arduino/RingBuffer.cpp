@@ -7,12 +7,17 @@
 /** @file RingBuffer.cpp
  * @brief Ring Buffer
  */
- 
+
 #include "RingBuffer.h"
 
+// Ordering between the data bytes and the index that publishes them. On the
+// single-core Cortex-M4 a DMB is enough for both acquire and release.
+#define RING_ACQUIRE()  __DMB()
+#define RING_RELEASE()  __DMB()
+
 RingBuffer::RingBuffer (int p_size)
 {
-    size = p_size + 1;
+    size = p_size;
     buf = new uint8_t[size];
     addr_w = 0;
     addr_r = 0;
@@ -25,94 +30,131 @@ RingBuffer::~RingBuffer ()
 
 int RingBuffer::putc(uint8_t data)
 {
-    int next;
+    uint32_t w = addr_w;
 
-    next = (addr_w + 1) % size;
-    if (next == addr_r) {
+    if (used(w, addr_r) >= size) {
         return -1;
     }
-    buf[addr_w] = data;
-    addr_w = next;
-    return -1;
+    RING_ACQUIRE();
+    buf[offset(w)] = data;
+    RING_RELEASE();
+    addr_w = advance(w, 1);
+    return data;
 }
 
-int RingBuffer::put(uint8_t *data, int len)
+int RingBuffer::put(const uint8_t *data, int len)
 {
-    len = len < available() ? len : available();
-    if (addr_w + len < size) {
-        memcpy(buf + addr_w, data, len);
-        addr_w += len;
-    }
-    else
-    {
-        int remaining = size - addr_w;
-        memcpy(buf + addr_w, data, remaining);
-        memcpy(buf, data + remaining, len - remaining);
-        addr_w = len - remaining;
+    uint8_t *span;
+    int total = 0;
+
+    while (total < len) {
+        int n = reserve(&span);
+        if (n == 0) {
+            break;
+        }
+        n = n < (len - total) ? n : (len - total);
+        memcpy(span, data + total, n);
+        commit(n);
+        total += n;
     }
-    return len;
+    return total;
+}
+
+int RingBuffer::reserve(uint8_t **span)
+{
+    uint32_t w = addr_w;
+    uint32_t free = size - used(w, addr_r);
+    uint32_t to_end = size - offset(w);
+
+    RING_ACQUIRE();
+    *span = buf + offset(w);
+    return free < to_end ? free : to_end;
+}
+
+void RingBuffer::commit(int len)
+{
+    RING_RELEASE();
+    addr_w = advance(addr_w, len);
 }
 
 int RingBuffer::peek()
 {
-    if (addr_r == addr_w) {
+    uint32_t r = addr_r;
+
+    if (r == addr_w) {
         return -1;
     }
-
-    return buf[addr_r];
+    RING_ACQUIRE();
+    return buf[offset(r)];
 }
 
 int RingBuffer::getc()
 {
-    if (addr_r == addr_w) {
+    uint32_t r = addr_r;
+
+    if (r == addr_w) {
         return -1;
     }
-
-    uint8_t data = buf[addr_r];
-    addr_r = (addr_r + 1) % size;
+    RING_ACQUIRE();
+    uint8_t data = buf[offset(r)];
+    RING_RELEASE();
+    addr_r = advance(r, 1);
 
     return data;
 }
 
 int RingBuffer::get(uint8_t *data, int len)
 {
-    len = len < use() ? len : use();
-    if (addr_r + len < size) {
-        memcpy(data, buf + addr_r, len);
-        addr_r += len;
+    const uint8_t *span;
+    int total = 0;
+
+    while (total < len) {
+        int n = peekSpan(&span);
+        if (n == 0) {
+            break;
+        }
+        n = n < (len - total) ? n : (len - total);
+        memcpy(data + total, span, n);
+        consume(n);
+        total += n;
     }
-    else
-    {
-        int remaining = size - addr_r;
-        memcpy(data, buf + addr_r, remaining);
-        memcpy(data + remaining, buf, len - remaining);
-        addr_r = len - remaining;
-    }
-    return len;
+    return total;
+}
+
+int RingBuffer::peekSpan(const uint8_t **span)
+{
+    uint32_t r = addr_r;
+    uint32_t count = used(addr_w, r);
+    uint32_t to_end = size - offset(r);
+
+    RING_ACQUIRE();
+    *span = buf + offset(r);
+    return count < to_end ? count : to_end;
+}
+
+void RingBuffer::consume(int len)
+{
+    RING_RELEASE();
+    addr_r = advance(addr_r, len);
 }
 
 int RingBuffer::available()
 {
-    if (addr_w < addr_r) {
-        return addr_r - addr_w - 1;
-    } else {
-        return (size - addr_w) + addr_r - 1;
-    }
+    return size - used(addr_w, addr_r);
 }
 
 int RingBuffer::use()
 {
-    if (addr_w < addr_r) {
-        return size - (addr_r - addr_w);
-    } else {
-        return addr_w - addr_r;
-    }
+    return used(addr_w, addr_r);
+}
 
-    //return size - available() - 1;
+int RingBuffer::capacity()
+{
+    return size;
 }
 
 void RingBuffer::clear()
 {
-    addr_w = 0;
-    addr_r = 0;
+    addr_r = addr_w;
 }
+
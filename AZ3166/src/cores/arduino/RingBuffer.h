@@ -6,6 +6,11 @@
 
 /** @file RingBuffer.h
  * @brief Ring Buffer
+ *
+ * Single-producer / single-consumer byte ring. One context (thread or ISR)
+ * may call the put side (putc, put, reserve, commit) while another context
+ * calls the get side (peek, getc, get, peekSpan, consume, clear) without
+ * locking. Indices wrap with a compare instead of a division.
  */
 
 #ifndef RingBuffer_H
@@ -26,6 +31,10 @@ public:
     int available();
     int use();
 
+    /** Get the number of bytes the buffer can hold.
+     */
+    int capacity();
+
     /** put to ring buffer
      * @param dat data
      * @return data / -1:error
@@ -37,10 +46,21 @@ public:
      * @param len length
      * @return put length
      */
-    int put(uint8_t *data, int len);
+    int put(const uint8_t *data, int len);
+
+    /** reserve a contiguous free window for writing (producer side)
+     * @param span receives the start of the window
+     * @return number of bytes that may be written at *span, 0 if full
+     */
+    int reserve(uint8_t **span);
+
+    /** publish bytes written into the window returned by reserve()
+     * @param len number of bytes written, must not exceed the reserved length
+     */
+    void commit(int len);
 
     int peek();
-    
+
     /** get from ring buffer
      * @param dat data
      * @retval 0:ok / -1:error
@@ -55,12 +75,32 @@ public:
 
     int get(uint8_t *data, int len);
 
+    /** get a contiguous readable window without removing it (consumer side)
+     * @param span receives the start of the window
+     * @return number of bytes readable at *span, 0 if empty
+     */
+    int peekSpan(const uint8_t **span);
+
+    /** release bytes read through the window returned by peekSpan()
+     * @param len number of bytes consumed, must not exceed the peeked length
+     */
+    void consume(int len);
+
+    /** drop everything in the buffer (consumer side)
+     */
     void clear();
 
 private:
     uint8_t *buf;
-    int size;
-    volatile int addr_w, addr_r;
+    uint32_t size;
+    // Indices run over twice the size, so a full buffer is told apart from an
+    // empty one without a spare byte. addr_w is only written by the producer
+    // and addr_r only by the consumer.
+    volatile uint32_t addr_w, addr_r;
+
+    uint32_t used(uint32_t w, uint32_t r) { return (w >= r) ? w - r : w + 2 * size - r; }
+    uint32_t offset(uint32_t index) { return (index < size) ? index : index - size; }
+    uint32_t advance(uint32_t index, uint32_t len) { index += len; return (index < 2 * size) ? index : index - 2 * size; }
 };
 
 #endif
@@ -211,12 +211,31 @@ float Stream::parseFloat(char skipChar) {
 //
 size_t Stream::readBytes(char *buffer, size_t length) {
     size_t count = 0;
+    Timer timer;
+    timer.start();
     while(count < length) {
-        int c = timedRead();
+        int n = read((uint8_t *) buffer + count, length - count);
+        if(n > 0) {
+            count += n;
+            timer.reset();  // the timeout applies between chunks, as it did between chars
+        } else if((unsigned long)timer.read_ms() >= _timeout) {
+            break;
+        } else {
+            Thread::yield();
+        }
+    }
+    return count;
+}
+
+// default implementation: may be overridden by streams that can hand over
+// a whole buffer at once
+int Stream::read(uint8_t *buffer, size_t length) {
+    size_t count = 0;
+    while(count < length && available() > 0) {
+        int c = read();
         if(c < 0)
             break;
-        *buffer++ = (char) c;
-        count++;
+        buffer[count++] = (uint8_t) c;
     }
     return count;
 }
@@ -46,6 +46,7 @@ class Stream: public Print {
     public:
         virtual int available() = 0;
         virtual int read() = 0;
+        virtual int read(uint8_t *buffer, size_t length); // read what is available without waiting
         virtual int peek() = 0;
         virtual void flush() = 0;
 
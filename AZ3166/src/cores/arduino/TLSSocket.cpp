@@ -2,65 +2,133 @@
 // Licensed under the MIT license. 
 
 #include "TLSSocket.h"
+#include "mbed_critical.h"
 
 #define TLS_CUNSTOM "Arduino TLS Socket"
+#define TLS_SESSION_HOST_LEN 64
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
-// SSL callback
+// Session cache
+// Sessions (session id or ticket) of recently connected servers, keyed by the
+// trusted CA, host and port so a session is only offered back to the server
+// that was verified against the same CA. They survive socket close.
+typedef struct
+{
+    bool used;
+    const char *ssl_ca_pem;
+    uint16_t port;
+    uint32_t last_used;
+    char host[TLS_SESSION_HOST_LEN];
+    mbedtls_ssl_session session;
+} TLS_SESSION_ENTRY;
+
+#if TLS_SESSION_CACHE_SIZE > 0
+static TLS_SESSION_ENTRY session_cache[TLS_SESSION_CACHE_SIZE];
+#endif
+static uint32_t session_clock = 0;
+static Mutex session_mutex;
+static TLS_HANDSHAKE_STATS handshake_stats;
+
+static TLS_SESSION_ENTRY* find_session(const char *ssl_ca_pem, const char *host, uint16_t port)
+{
+#if TLS_SESSION_CACHE_SIZE > 0
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+    {
+        TLS_SESSION_ENTRY *entry = &session_cache[i];
+        if (entry->used && entry->ssl_ca_pem == ssl_ca_pem && entry->port == port && strcmp(entry->host, host) == 0)
+        {
+            return entry;
+        }
+    }
+#endif
+    return NULL;
+}
+
 /**
- * Receive callback for mbed TLS
+ * Offer the cached session for this server, if any, to the next handshake.
  */
-static int ssl_recv(void *ctx, unsigned char *buf, size_t len) 
+static bool load_session(mbedtls_ssl_context *ssl, const char *ssl_ca_pem, const char *host, uint16_t port)
 {
-    int recv = -1;
-    TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    for (int i = 0; i < 5; ++i)
+    bool offered = false;
+    session_mutex.lock();
+    TLS_SESSION_ENTRY *entry = find_session(ssl_ca_pem, host, port);
+    if (entry != NULL && mbedtls_ssl_set_session(ssl, &entry->session) == 0)
     {
-        recv = socket->recv(buf, len);
-        if (recv != 0) break;
-        wait_ms(500);
+        entry->last_used = ++session_clock;
+        offered = true;
     }
+    session_mutex.unlock();
+    return offered;
+}
 
-    if (NSAPI_ERROR_WOULD_BLOCK == recv)
+static void save_session(mbedtls_ssl_context *ssl, const char *ssl_ca_pem, const char *host, uint16_t port)
+{
+#if TLS_SESSION_CACHE_SIZE > 0
+    if (strlen(host) >= TLS_SESSION_HOST_LEN)
     {
-        return MBEDTLS_ERR_SSL_WANT_READ;
+        return;
     }
-    else if (recv <= 0)
+
+    session_mutex.lock();
+    TLS_SESSION_ENTRY *entry = find_session(ssl_ca_pem, host, port);
+    if (entry == NULL)
     {
-        return -1;
+        // Take a free entry or the least recently used one
+        entry = &session_cache[0];
+        for (int i = 0; i < TLS_SESSION_CACHE_SIZE && entry->used; i++)
+        {
+            if (!session_cache[i].used || session_cache[i].last_used < entry->last_used)
+            {
+                entry = &session_cache[i];
+            }
+        }
+    }
+    if (entry->used)
+    {
+        mbedtls_ssl_session_free(&entry->session);
+    }
+    mbedtls_ssl_session_init(&entry->session);
+    if (mbedtls_ssl_get_session(ssl, &entry->session) == 0)
+    {
+        entry->used = true;
+        entry->ssl_ca_pem = ssl_ca_pem;
+        entry->port = port;
+        entry->last_used = ++session_clock;
+        strcpy(entry->host, host);
     }
     else
     {
-        return recv;
+        mbedtls_ssl_session_free(&entry->session);
+        entry->used = false;
     }
+    session_mutex.unlock();
+#endif
 }
 
-/**
- * Send callback for mbed TLS
- */
-static int ssl_send(void *ctx, const unsigned char *buf, size_t len)
+static void drop_session(const char *ssl_ca_pem, const char *host, uint16_t port)
 {
-   int size = -1;
-    TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    for (int i = 0; i < 5; ++i)
+    session_mutex.lock();
+    TLS_SESSION_ENTRY *entry = find_session(ssl_ca_pem, host, port);
+    if (entry != NULL)
     {
-        size = socket->send(buf, len);
-        if (size != 0) break;
-        wait_ms(500);
+        mbedtls_ssl_session_free(&entry->session);
+        entry->used = false;
     }
+    session_mutex.unlock();
+}
 
-    if(NSAPI_ERROR_WOULD_BLOCK == size)
-    {
-        return len;
-    }
-    else if (size <= 0)
-    {
-        return -1;
-    }
-    else
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Socket waits
+static TLS_WAIT_STATS wait_stats;
+
+static void record_wait(uint32_t *histogram, int ms)
+{
+    int bucket = 0;
+    for (int limit = 10; bucket < TLS_WAIT_BUCKETS - 1 && ms >= limit; limit *= 10)
     {
-        return size;
+        bucket++;
     }
+    core_util_atomic_incr_u32(&histogram[bucket], 1);
 }
 
 #if DEBUG_LEVEL > 0
@@ -113,15 +181,242 @@ static int my_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *fla
 }
 #endif
 
+/**
+ * Certificate verify callback, only called during a full handshake
+ */
+static int on_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
+{
+    *static_cast<bool *>(data) = true;
+#if DEBUG_LEVEL > 0
+    return my_verify(NULL, crt, depth, flags);
+#else
+    return 0;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// Shared CA chains
+// Each CA PEM string (they are constants like the Baltimore root) is parsed
+// once and the chain is shared read-only by every socket using it. Unused
+// chains stay parsed until their entry is needed for another PEM string.
+// An entry is found by the address, length and hash of the PEM, so a buffer
+// rewritten with another certificate is parsed again.
+typedef struct
+{
+    const char *ssl_ca_pem;
+    size_t length;
+    uint32_t hash;
+    int refs;
+    mbedtls_x509_crt chain;
+} TLS_CA_ENTRY;
+
+static TLS_CA_ENTRY ca_cache[TLS_CA_CACHE_SIZE];
+static Mutex ca_mutex;
+
+// FNV-1a, a few microseconds for a root certificate against a handshake's seconds
+static uint32_t hash_ca_pem(const char *ssl_ca_pem, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (uint8_t)ssl_ca_pem[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int parse_ca_chain(mbedtls_x509_crt *chain, const char *ssl_ca_pem, size_t length)
+{
+    mbedtls_x509_crt_init(chain);
+    int ret = mbedtls_x509_crt_parse(chain, (const unsigned char *)ssl_ca_pem, length + 1);
+    if (ret != 0)
+    {
+        mbedtls_x509_crt_free(chain);
+    }
+
+    session_mutex.lock();
+    handshake_stats.ca_chain_parses++;
+    session_mutex.unlock();
+    return ret;
+}
+
+/**
+ * Get the parsed chain of ssl_ca_pem from the cache, parsing it if needed.
+ * When every entry is in use by another PEM string the chain is parsed into
+ * the caller's own fallback instead.
+ */
+static mbedtls_x509_crt* acquire_ca_chain(const char *ssl_ca_pem, mbedtls_x509_crt *fallback)
+{
+    mbedtls_x509_crt *chain = NULL;
+    TLS_CA_ENTRY *free_entry = NULL;
+    size_t length = strlen(ssl_ca_pem);
+    uint32_t hash = hash_ca_pem(ssl_ca_pem, length);
+
+    ca_mutex.lock();
+    for (int i = 0; i < TLS_CA_CACHE_SIZE; i++)
+    {
+        TLS_CA_ENTRY *entry = &ca_cache[i];
+        if (entry->ssl_ca_pem == ssl_ca_pem && entry->length == length && entry->hash == hash)
+        {
+            entry->refs++;
+            chain = &entry->chain;
+            break;
+        }
+        if (entry->refs == 0 && (free_entry == NULL || free_entry->ssl_ca_pem != NULL))
+        {
+            free_entry = entry;
+        }
+    }
+    if (chain == NULL && free_entry != NULL)
+    {
+        if (free_entry->ssl_ca_pem != NULL)
+        {
+            mbedtls_x509_crt_free(&free_entry->chain);
+            free_entry->ssl_ca_pem = NULL;
+        }
+        if (parse_ca_chain(&free_entry->chain, ssl_ca_pem, length) == 0)
+        {
+            free_entry->ssl_ca_pem = ssl_ca_pem;
+            free_entry->length = length;
+            free_entry->hash = hash;
+            free_entry->refs = 1;
+            chain = &free_entry->chain;
+        }
+        ca_mutex.unlock();
+        return chain;
+    }
+    ca_mutex.unlock();
+
+    if (chain == NULL && parse_ca_chain(fallback, ssl_ca_pem, length) == 0)
+    {
+        chain = fallback;
+    }
+    return chain;
+}
+
+static void release_ca_chain(mbedtls_x509_crt *chain, mbedtls_x509_crt *fallback)
+{
+    if (chain == fallback)
+    {
+        mbedtls_x509_crt_free(fallback);
+        return;
+    }
+
+    ca_mutex.lock();
+    for (int i = 0; i < TLS_CA_CACHE_SIZE; i++)
+    {
+        if (&ca_cache[i].chain == chain)
+        {
+            ca_cache[i].refs--;
+            break;
+        }
+    }
+    ca_mutex.unlock();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+// SSL callback
+/**
+ * Receive callback for mbed TLS, the socket is non-blocking so it never waits.
+ * "No data yet" is NSAPI_ERROR_WOULD_BLOCK, a 0 byte read means the peer
+ * closed the connection (as in WiFiClient::read()) and is passed on as 0:
+ * end of stream on the plain path, MBEDTLS_ERR_SSL_CONN_EOF from mbed TLS.
+ */
+int TLSSocket::ssl_recv(void *ctx, unsigned char *buf, size_t len) 
+{
+    TLSSocket *tls = static_cast<TLSSocket *>(ctx);
+    int recv = tls->_tcp_socket->recv(buf, len);
+
+    if (recv > 0)
+    {
+        return recv;
+    }
+    else if (recv == 0)
+    {
+        return 0;
+    }
+    else if (recv == NSAPI_ERROR_WOULD_BLOCK)
+    {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    else
+    {
+        return -1;
+    }
+}
+
+/**
+ * Send callback for mbed TLS, a 0 byte write is taken for a closed socket
+ */
+int TLSSocket::ssl_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    TLSSocket *tls = static_cast<TLSSocket *>(ctx);
+    int size = tls->_tcp_socket->send(buf, len);
+
+    if (size > 0)
+    {
+        return size;
+    }
+    else if (size == NSAPI_ERROR_WOULD_BLOCK)
+    {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+    else
+    {
+        return -1;
+    }
+}
+
+void TLSSocket::on_socket_event()
+{
+    // May run in interrupt context
+    _event.release();
+}
+
+/**
+ * Handle the result of a non-blocking operation. When it would block, wait
+ * until the socket is ready and return true so the caller retries, otherwise
+ * leave the final result in ret.
+ */
+bool TLSSocket::wait_ready(Timer &timer, int &ret)
+{
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        return false;
+    }
+
+    int now = timer.read_ms();
+    int wait = TLS_SOCKET_POLL_MS;
+    if (_timeout >= 0)
+    {
+        if (now >= _timeout)
+        {
+            core_util_atomic_incr_u32(&wait_stats.timeouts, 1);
+            ret = NSAPI_ERROR_WOULD_BLOCK;
+            return false;
+        }
+        if (_timeout - now < wait)
+        {
+            wait = _timeout - now;
+        }
+    }
+    _event.wait(wait);
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 // Class
 TLSSocket::TLSSocket(const char *ssl_ca_pem, NetworkInterface* net_iface)
 {
     _ssl_ca_pem = ssl_ca_pem;
+    _session_resumed = false;
+    _peer_verified = false;
+    _ca_chain = NULL;
+    _timeout = TLS_SOCKET_TIMEOUT_MS;
     
     if (net_iface)
     {
         _tcp_socket = new TCPSocket(net_iface);
+        _tcp_socket->sigio(callback(this, &TLSSocket::on_socket_event));
     }
     else
     {
@@ -133,7 +428,6 @@ TLSSocket::TLSSocket(const char *ssl_ca_pem, NetworkInterface* net_iface)
         // SSL
         mbedtls_entropy_init(&_entropy);
         mbedtls_ctr_drbg_init(&_ctr_drbg);
-        mbedtls_x509_crt_init(&_cacert);
         mbedtls_ssl_init(&_ssl);
         mbedtls_ssl_config_init(&_ssl_conf);
     }
@@ -145,7 +439,10 @@ TLSSocket::~TLSSocket()
     {
         mbedtls_entropy_free(&_entropy);
         mbedtls_ctr_drbg_free(&_ctr_drbg);
-        mbedtls_x509_crt_free(&_cacert);
+        if (_ca_chain != NULL)
+        {
+            release_ca_chain(_ca_chain, &_cacert);
+        }
         mbedtls_ssl_free(&_ssl);
         mbedtls_ssl_config_free(&_ssl_conf);
     }
@@ -167,7 +464,12 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
     if (_ssl_ca_pem == NULL)
     {
         // No SSL
-        return _tcp_socket->connect(host, port);
+        nsapi_error_t ret = _tcp_socket->connect(host, port);
+        if (ret == NSAPI_ERROR_OK)
+        {
+            _tcp_socket->set_blocking(false);
+        }
+        return ret;
     }
     
     // Initialize TLS-related stuf.
@@ -179,8 +481,7 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
         return -1;
     }
 
-    if ((ret = mbedtls_x509_crt_parse(&_cacert, (const unsigned char *)_ssl_ca_pem,
-                       strlen(_ssl_ca_pem) + 1)) != 0)
+    if (_ca_chain == NULL && (_ca_chain = acquire_ca_chain(_ssl_ca_pem, &_cacert)) == NULL)
     {
         return -1;
     }
@@ -193,7 +494,7 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
         return -1;
     }
 
-    mbedtls_ssl_conf_ca_chain(&_ssl_conf, &_cacert, NULL);
+    mbedtls_ssl_conf_ca_chain(&_ssl_conf, _ca_chain, NULL);
     mbedtls_ssl_conf_rng(&_ssl_conf, mbedtls_ctr_drbg_random, &_ctr_drbg);
 
     /* It is possible to disable authentication by passing
@@ -201,8 +502,10 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
      */
     mbedtls_ssl_conf_authmode(&_ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
 
+    _peer_verified = false;
+    mbedtls_ssl_conf_verify(&_ssl_conf, on_verify, &_peer_verified);
+
 #if DEBUG_LEVEL > 0
-    mbedtls_ssl_conf_verify(&_ssl_conf, my_verify, NULL);
     mbedtls_ssl_conf_dbg(&_ssl_conf, my_debug, NULL);
     mbedtls_debug_set_threshold(DEBUG_LEVEL);
 #endif
@@ -214,7 +517,9 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
     
     mbedtls_ssl_set_hostname(&_ssl, host);
     
-    mbedtls_ssl_set_bio(&_ssl, static_cast<void *>(_tcp_socket), ssl_send, ssl_recv, NULL );
+    mbedtls_ssl_set_bio(&_ssl, static_cast<void *>(this), ssl_send, ssl_recv, NULL );
+
+    bool offered = load_session(&_ssl, _ssl_ca_pem, host, port);
     
     /* Connect to the server */
     ret = _tcp_socket->connect(host, port);
@@ -222,23 +527,100 @@ nsapi_error_t TLSSocket::connect(const char *host, uint16_t port)
     {
         return ret;
     }
+    _tcp_socket->set_blocking(false);
 
    /* Start the handshake */
-    ret = mbedtls_ssl_handshake(&_ssl);
+    Timer timer;
+    timer.start();
+    do
+    {
+        ret = mbedtls_ssl_handshake(&_ssl);
+    } while (wait_ready(timer, ret));
+    uint32_t elapsed = timer.read_ms();
     if (ret < 0) 
     {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
-            ret != MBEDTLS_ERR_SSL_WANT_WRITE) 
+        if (offered)
+        {
+            drop_session(_ssl_ca_pem, host, port);
+        }
+        if (ret != NSAPI_ERROR_WOULD_BLOCK) 
         {
             ret = -1;
         }
         
         return ret;
     }
+
+    // A resumed handshake has no certificate exchange, so nothing was verified
+    _session_resumed = offered && !_peer_verified;
+    session_mutex.lock();
+    if (_session_resumed)
+    {
+        handshake_stats.resumed_handshakes++;
+        handshake_stats.resumed_handshake_ms += elapsed;
+    }
+    else
+    {
+        handshake_stats.full_handshakes++;
+        handshake_stats.full_handshake_ms += elapsed;
+    }
+    handshake_stats.last_handshake_ms = elapsed;
+    session_mutex.unlock();
+
+    // Saved after a resumption too, the server may have issued a new ticket
+    save_session(&_ssl, _ssl_ca_pem, host, port);
     
     return NSAPI_ERROR_OK;
 }
 
+bool TLSSocket::is_session_resumed()
+{
+    return _session_resumed;
+}
+
+void TLSSocket::get_handshake_stats(TLS_HANDSHAKE_STATS *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    session_mutex.lock();
+    *stats = handshake_stats;
+    session_mutex.unlock();
+}
+
+void TLSSocket::get_wait_stats(TLS_WAIT_STATS *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    core_util_critical_section_enter();
+    *stats = wait_stats;
+    core_util_critical_section_exit();
+}
+
+void TLSSocket::set_timeout(int timeout_ms)
+{
+    _timeout = timeout_ms;
+}
+
+void TLSSocket::clear_session_cache()
+{
+#if TLS_SESSION_CACHE_SIZE > 0
+    session_mutex.lock();
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++)
+    {
+        if (session_cache[i].used)
+        {
+            mbedtls_ssl_session_free(&session_cache[i].session);
+            session_cache[i].used = false;
+        }
+    }
+    session_mutex.unlock();
+#endif
+}
+
 nsapi_error_t TLSSocket::close()
 {
     if (_tcp_socket == NULL)
@@ -255,21 +637,44 @@ nsapi_size_or_error_t TLSSocket::send(const void *data, nsapi_size_t size)
         return NSAPI_ERROR_NO_SOCKET;
     }
     
-    if (_ssl_ca_pem == NULL)
+    const unsigned char *ptr = (const unsigned char *)data;
+    nsapi_size_t sent = 0;
+    bool waited = false;
+    Timer timer;
+    timer.start();
+    while (sent < size)
     {
-        // No SSL
-        const unsigned char *ptr = (const unsigned char *)data;
-        int result, data_size = size;
-        while((result = ssl_send(_tcp_socket, ptr, data_size)) > 0)
+        int ret;
+        if (_ssl_ca_pem == NULL)
         {
-            ptr += result;
-            data_size -= result;
-            if (data_size == 0) return size;
+            // No SSL
+            ret = ssl_send(this, ptr + sent, size - sent);
+        }
+        else
+        {
+            ret = mbedtls_ssl_write(&_ssl, ptr + sent, size - sent);
         }
-        return result;
-    }
 
-    return mbedtls_ssl_write(&_ssl, (const unsigned char*)data, size);
+        if (ret > 0)
+        {
+            // The deadline is for a stall, not for the whole buffer
+            sent += ret;
+            timer.reset();
+        }
+        else if (wait_ready(timer, ret))
+        {
+            waited = true;
+        }
+        else
+        {
+            return ret;
+        }
+    }
+    if (waited)
+    {
+        record_wait(wait_stats.send_wait, timer.read_ms());
+    }
+    return size;
 }
 
 nsapi_size_or_error_t TLSSocket::recv(void *data, nsapi_size_t size)
@@ -279,11 +684,33 @@ nsapi_size_or_error_t TLSSocket::recv(void *data, nsapi_size_t size)
         return NSAPI_ERROR_NO_SOCKET;
     }
     
-    if (_ssl_ca_pem == NULL)
+    int ret;
+    bool waited = false;
+    Timer timer;
+    timer.start();
+    while (true)
     {
-        // No SSL
-        return _tcp_socket->recv(data, size);
-    }
+        if (_ssl_ca_pem == NULL)
+        {
+            // No SSL
+            ret = ssl_recv(this, (unsigned char*)data, size);
+        }
+        else
+        {
+            ret = mbedtls_ssl_read(&_ssl, (unsigned char*)data, size);
+        }
 
-    return mbedtls_ssl_read(&_ssl, (unsigned char*)data, size);
+        if (!wait_ready(timer, ret))
+        {
+            break;
+        }
+        waited = true;
+    }
+    if (waited)
+    {
+        record_wait(wait_stats.recv_wait, timer.read_ms());
+    }
+    // The peer closed the connection cleanly, a close without close_notify
+    // stays MBEDTLS_ERR_SSL_CONN_EOF
+    return (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) ? 0 : ret;
 }
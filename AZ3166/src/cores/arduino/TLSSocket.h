@@ -16,6 +16,45 @@
 #include "mbedtls/debug.h"
 #endif
 
+// Number of servers whose TLS session is kept for resumption, 0 disables it
+#ifndef TLS_SESSION_CACHE_SIZE
+#define TLS_SESSION_CACHE_SIZE  2
+#endif
+
+// Number of distinct CA PEM strings kept parsed and shared between sockets
+#ifndef TLS_CA_CACHE_SIZE
+#define TLS_CA_CACHE_SIZE       2
+#endif
+
+// Default time a send, recv or handshake may go without progress
+#ifndef TLS_SOCKET_TIMEOUT_MS
+#define TLS_SOCKET_TIMEOUT_MS   10000
+#endif
+
+// Longest wait for a socket event before polling the socket again, in case
+// the network driver does not report one
+#define TLS_SOCKET_POLL_MS      20
+
+// Wait time histogram buckets: <10ms, <100ms, <1s, <10s, >=10s
+#define TLS_WAIT_BUCKETS        5
+
+typedef struct
+{
+    uint32_t full_handshakes;
+    uint32_t resumed_handshakes;
+    uint32_t full_handshake_ms;     // total time spent in full handshakes
+    uint32_t resumed_handshake_ms;  // total time spent in resumed handshakes
+    uint32_t last_handshake_ms;
+    uint32_t ca_chain_parses;       // times a CA PEM string had to be parsed
+} TLS_HANDSHAKE_STATS;
+
+typedef struct
+{
+    uint32_t recv_wait[TLS_WAIT_BUCKETS];   // time recv calls waited for data
+    uint32_t send_wait[TLS_WAIT_BUCKETS];   // time send calls waited for room
+    uint32_t timeouts;                      // calls that hit the deadline
+} TLS_WAIT_STATS;
+
 class TLSSocket
 {
 public:
@@ -27,15 +66,41 @@ public:
     nsapi_size_or_error_t send(const void *data, nsapi_size_t size);
     nsapi_size_or_error_t recv(void *data, nsapi_size_t size);
 
+    /**
+     * Set how long send, recv and the handshake may wait without progress
+     * before failing with NSAPI_ERROR_WOULD_BLOCK, negative waits forever.
+     */
+    void set_timeout(int timeout_ms);
+
+    // Whether the last connect() resumed a cached session instead of a full handshake
+    bool is_session_resumed();
+
+    static void get_handshake_stats(TLS_HANDSHAKE_STATS *stats);
+
+    static void get_wait_stats(TLS_WAIT_STATS *stats);
+
+    // Forget every cached session, e.g. when the server credentials change
+    static void clear_session_cache();
+
 private:
     mbedtls_entropy_context _entropy;
     mbedtls_ctr_drbg_context _ctr_drbg;
-    mbedtls_x509_crt _cacert;
+    mbedtls_x509_crt _cacert;       // used only when the shared CA cache is full
+    mbedtls_x509_crt *_ca_chain;
     mbedtls_ssl_context _ssl;
     mbedtls_ssl_config _ssl_conf;
     
     const char *_ssl_ca_pem;
     TCPSocket *_tcp_socket;
+    bool _session_resumed;
+    bool _peer_verified;
+    int _timeout;
+    Semaphore _event;
+
+    static int ssl_recv(void *ctx, unsigned char *buf, size_t len);
+    static int ssl_send(void *ctx, const unsigned char *buf, size_t len);
+    void on_socket_event();
+    bool wait_ready(Timer &timer, int &ret);
     bool check_mbedtls_ssl_write(int ret);
 };
 
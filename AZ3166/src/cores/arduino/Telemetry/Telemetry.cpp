@@ -2,6 +2,7 @@
 // Licensed under the MIT license. 
 
 #include "Arduino.h"
+#include "FileSpool.h"
 #include "Telemetry.h"
 #include "TelemetryClient.h"
 
@@ -15,6 +16,7 @@ static const char *AI_ENDPOINT = "https://dc.services.visualstudio.com/v2/track"
 static const char *AI_IKEY = "63d78aab-86a7-49b9-855f-3bdcff5d39d7";
 
 static TelemetryClient *telemetry = NULL;
+static FileSpool *spool = NULL;
 
 #ifdef __cplusplus
 extern "C"{
@@ -25,6 +27,12 @@ void telemetry_init()
     if (telemetry == NULL && ENABLETRACE)
     {
         telemetry = new TelemetryClient(AI_ENDPOINT, AI_IKEY);
+        telemetry->SetSpool(spool);
+    }
+    else if (telemetry)
+    {
+        // Wi-Fi is connected again, send what was kept meanwhile
+        telemetry->WakeUp();
     }
 }
 
@@ -52,6 +60,43 @@ void send_telemetry_data_sync(const char *iothub, const char *event, const char
     }
 }
 
+void telemetry_set_batch_delay(int delay_ms)
+{
+    if (telemetry)
+    {
+        telemetry->SetBatchDelay(delay_ms);
+    }
+}
+
+void telemetry_set_spool(const char *path)
+{
+    if (spool != NULL || path == NULL)
+    {
+        return;
+    }
+    spool = new FileSpool(path);
+    if (telemetry)
+    {
+        telemetry->SetSpool(spool);
+    }
+}
+
+void telemetry_get_stats(TELEMETRY_STATS *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    if (telemetry)
+    {
+        telemetry->GetStats(stats);
+    }
+    else
+    {
+        memset(stats, 0, sizeof(TELEMETRY_STATS));
+    }
+}
+
 #ifdef __cplusplus
 }
 #endif  // __cplusplus
\ No newline at end of file
@@ -4,10 +4,23 @@
 #ifndef __SYSTEM_TELEMERTY_H__
 #define __SYSTEM_TELEMERTY_H__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"{
 #endif  // __cplusplus
 
+    typedef struct
+    {
+        uint32_t queued;            // async events accepted
+        uint32_t dropped;           // async events lost because the buffer was full
+        uint32_t sent;              // async events delivered
+        uint32_t failed;            // async events lost because the request failed
+        uint32_t spooled;           // async events kept in the spool file while offline
+        uint32_t latency_p50_ms;    // median time from Send() to delivery, over recent events
+        uint32_t latency_p99_ms;    // 99th percentile of the same
+    } TELEMETRY_STATS;
+
     // Initialize the system telemetry
     void telemetry_init();
     
@@ -20,6 +33,16 @@ extern "C"{
     // Send an telemetry data to AI synchronously
     void send_telemetry_data_sync(const char *iothub, const char *event, const char *message);
 
+    // Set the longest time an async telemetry data waits to be batched with others
+    void telemetry_set_batch_delay(int delay_ms);
+
+    // Keep the async telemetry data in files under path while Wi-Fi is down (see FileSpool.h),
+    // the file system must be mounted
+    void telemetry_set_spool(const char *path);
+
+    // Get the counters of the async telemetry data
+    void telemetry_get_stats(TELEMETRY_STATS *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,11 @@
 
 #define CORRELATION_ID_LENGTH   64
 #define CHECK_INTERVAL_MS       5000
+#define TELEMETRY_SIGNAL        0x1
+
+#define BATCH_SENT              0
+#define BATCH_REJECTED          1
+#define BATCH_UNSENT            -1
 
 static const char *EVENT = "AIEVENT";
 static const char *BODY_TEMPLATE = 
@@ -48,9 +53,18 @@ TelemetryClient::TelemetryClient(const char *ai_endoint, const char *ai_ikey)
 {
     m_ai_endoint = ai_endoint;
     m_ai_ikey = ai_ikey;
+    m_arena_used = 0;
+    m_event_count = 0;
+    m_batch_delay_ms = TELEMETRY_BATCH_DELAY_MS;
+    m_latency_count = 0;
+    m_spool = NULL;
+    m_batch_data = NULL;
+    m_batch_length = 0;
+    m_batch_sent = 0;
 
     memset(m_hash_mac, 0, sizeof(m_hash_mac));
     memset(m_hash_iothub_name, 0, sizeof(m_hash_iothub_name));
+    memset(&m_stats, 0, sizeof(m_stats));
     m_base_size = strlen(BODY_TEMPLATE) + sizeof(BOARD_NAME) + strlen(getDevkitVersion()) + sizeof(BOARD_MCU) + strlen(EVENT) + strlen(m_ai_ikey) - 20 + sizeof(m_hash_mac) + CORRELATION_ID_LENGTH + sizeof(m_hash_iothub_name);
 
     m_telemetry_thread.start(callback(this, &TelemetryClient::telemetry_worker));
@@ -61,6 +75,51 @@ void TelemetryClient::Send(const char *event, const char *message, const char *i
     do_trace_telemetry(iothub ? iothub : "", event ? event : "", message ? message : "", async);
 }
 
+void TelemetryClient::SetBatchDelay(int delay_ms)
+{
+    m_batch_delay_ms = delay_ms < 0 ? 0 : delay_ms;
+    WakeUp();
+}
+
+void TelemetryClient::SetSpool(FileSpool *spool)
+{
+    m_spool = spool;
+    WakeUp();
+}
+
+void TelemetryClient::WakeUp(void)
+{
+    m_telemetry_thread.signal_set(TELEMETRY_SIGNAL);
+}
+
+void TelemetryClient::GetStats(TELEMETRY_STATS *stats)
+{
+    uint32_t sorted[TELEMETRY_LATENCY_SAMPLES];
+
+    m_arena_mutex.lock();
+    *stats = m_stats;
+    int count = m_latency_count < TELEMETRY_LATENCY_SAMPLES ? m_latency_count : TELEMETRY_LATENCY_SAMPLES;
+    memcpy(sorted, m_latency_ms, count * sizeof(uint32_t));
+    m_arena_mutex.unlock();
+
+    // Insertion sort, there are only a few samples
+    for (int i = 1; i < count; i++)
+    {
+        uint32_t value = sorted[i];
+        int j = i - 1;
+        for (; j >= 0 && sorted[j] > value; j--)
+        {
+            sorted[j + 1] = sorted[j];
+        }
+        sorted[j + 1] = value;
+    }
+    if (count > 0)
+    {
+        stats->latency_p50_ms = sorted[(count - 1) * 50 / 100];
+        stats->latency_p99_ms = sorted[(count - 1) * 99 / 100];
+    }
+}
+
 void TelemetryClient::hash(char *result, const char *input)
 {
     static const char HEX_STR[] = "0123456789abcdef";
@@ -77,24 +136,33 @@ void TelemetryClient::hash(char *result, const char *input)
     result[i * 2] = 0;
 }
 
-void TelemetryClient::send_data_to_ai(const char* data, int size)
+static bool check_response(const Http_Response *response)
 {
-    HTTPClient client(HTTP_POST, m_ai_endoint);
-    client.set_header("mem","good");
-    const Http_Response *response = client.send(data, size);
     if (response != NULL)
     {
         if(response->status_code >= 400)
         {
             Serial.printf(">>> Failed to send telemetry data: %d.\r\n", response->status_code);
+            return false;
         }
+        return true;
     }
     else
     {
         Serial.printf(">>> Failed to send telemetry data: Http fault.\r\n");
+        return false;
     }
 }
 
+bool TelemetryClient::send_data_to_ai(const char* data, int size)
+{
+    HTTPClient client(HTTP_POST, m_ai_endoint);
+    client.set_header("mem","good");
+    // Only the status is used
+    client.set_header_filter(NULL, 0);
+    return check_response(client.send(data, size));
+}
+
 void TelemetryClient::do_trace_telemetry(const char *iothub, const char *event, const char *message, bool async)
 {
     // Prepare the hash data
@@ -117,65 +185,254 @@ void TelemetryClient::do_trace_telemetry(const char *iothub, const char *event,
     // Calculate the size of the event (json) string
     int size = m_base_size + strlen(message) + strlen(event) + tlen + 1;
     
-    // Send
-    char* data = new char[size];
-    sprintf(data, BODY_TEMPLATE, BOARD_NAME, getDevkitVersion(), BOARD_MCU, message, m_hash_mac, m_hash_iothub_name, CORRELATIONID, event, _ctime, EVENT, m_ai_ikey);
-
     if (async)
     {
-       if (!push_msg(data))
-       {
-            // Buffer is full, throw away this message
-            delete [] data;
-       }
+        // If the arena is full, throw away this message
+        push_msg(event, message, _ctime, size);
     }
     else
     {
+        char* data = new char[size];
+        sprintf(data, BODY_TEMPLATE, BOARD_NAME, getDevkitVersion(), BOARD_MCU, message, m_hash_mac, m_hash_iothub_name, CORRELATIONID, event, _ctime, EVENT, m_ai_ikey);
         send_data_to_ai(data, strlen(data));
         delete [] data;
     }
 }
 
-bool TelemetryClient::push_msg(char* message)
+bool TelemetryClient::push_msg(const char *event, const char *message, const char *time, int size)
 {
-    if (!m_pool.full()) // Not perfect but the easiest way
+    bool pushed = false;
+    bool wake = false;
+
+    m_arena_mutex.lock();
+    int room = TELEMETRY_ARENA_SIZE - m_arena_used;
+    if (size <= room && m_event_count < TELEMETRY_MAX_EVENTS)
     {
-        m_pool.push(message);
-        return true;
+        // Format straight into the arena
+        int len = snprintf(m_arena + m_arena_used, room, BODY_TEMPLATE, BOARD_NAME, getDevkitVersion(), BOARD_MCU, message, m_hash_mac, m_hash_iothub_name, CORRELATIONID, event, time, EVENT, m_ai_ikey);
+        if (len > 0 && len < room)
+        {
+            m_arena[m_arena_used + len] = ',';
+            // The worker only needs to look again when the batch starts or fills up
+            wake = (m_arena_used == 0 || m_batch_delay_ms == 0 || (m_arena_used < TELEMETRY_BATCH_BYTES && m_arena_used + len + 1 >= TELEMETRY_BATCH_BYTES));
+            m_arena_used += len + 1;
+            m_enqueue_ms[m_event_count++] = millis();
+            pushed = true;
+        }
+    }
+    if (pushed)
+    {
+        m_stats.queued++;
+    }
+    else
+    {
+        m_stats.dropped++;
+    }
+    m_arena_mutex.unlock();
+
+    if (wake)
+    {
+        WakeUp();
     }
-    return false;
+    return pushed;
 }
 
-char* TelemetryClient::pop_msg(void)
+/**
+ * Post events stored like in the arena (each followed by a ',') as one JSON
+ * array.
+ * @return BATCH_SENT, BATCH_REJECTED by the server or BATCH_UNSENT.
+ */
+int TelemetryClient::post_batch(const char *data, int length)
 {
-    char* result;
-    if (m_pool.pop(result))
+    // '[' and ']' take the place of the last ','
+    m_batch_data = data;
+    m_batch_length = length + 1;
+    m_batch_sent = 0;
+
+    HTTPClient client(HTTP_POST, m_ai_endoint);
+    client.set_header("mem","good");
+    // Only the status is used
+    client.set_header_filter(NULL, 0);
+    // The request is streamed, its connection is never handed to the pool
+    client.set_keep_alive(false);
+    const Http_Response *response = client.send_stream(callback(this, &TelemetryClient::batch_producer), m_batch_length);
+    if (check_response(response))
     {
-        return result;
+        return BATCH_SENT;
     }
-    return NULL;
+    return (response == NULL) ? BATCH_UNSENT : BATCH_REJECTED;
+}
+
+/**
+ * Remove the first length bytes and events of the arena, the ones pushed
+ * meanwhile move to the front.
+ */
+void TelemetryClient::drop_pending(int length, int events)
+{
+    m_arena_used -= length;
+    memmove(m_arena, m_arena + length, m_arena_used);
+    m_event_count -= events;
+    memmove(m_enqueue_ms, m_enqueue_ms + events, m_event_count * sizeof(uint32_t));
+}
+
+/**
+ * Post every event pending in the arena. Events pushed meanwhile are appended
+ * after the batch, so the bytes being sent don't move until the batch is done.
+ */
+void TelemetryClient::send_batch(void)
+{
+    m_arena_mutex.lock();
+    int length = m_arena_used;
+    int events = m_event_count;
+    m_arena_mutex.unlock();
+
+    int result = post_batch(m_arena, length);
+    uint32_t now = millis();
+    // Only a batch that didn't get through is kept, like a single event a
+    // rejected one is not retried
+    bool spooled = (result == BATCH_UNSENT && m_spool != NULL && m_spool->append(m_arena, length) == 0);
+
+    m_arena_mutex.lock();
+    if (result == BATCH_SENT)
+    {
+        m_stats.sent += events;
+        for (int i = 0; i < events; i++)
+        {
+            m_latency_ms[m_latency_count++ % TELEMETRY_LATENCY_SAMPLES] = now - m_enqueue_ms[i];
+        }
+    }
+    else if (spooled)
+    {
+        m_stats.spooled += events;
+    }
+    else
+    {
+        m_stats.failed += events;
+    }
+    drop_pending(length, events);
+    m_arena_mutex.unlock();
+}
+
+/**
+ * Move the pending events to the spool as one record.
+ */
+void TelemetryClient::spool_pending(void)
+{
+    m_arena_mutex.lock();
+    int length = m_arena_used;
+    int events = m_event_count;
+    m_arena_mutex.unlock();
+
+    if (m_spool->append(m_arena, length) != 0)
+    {
+        // Spool full, keep them in the arena
+        return;
+    }
+
+    m_arena_mutex.lock();
+    m_stats.spooled += events;
+    drop_pending(length, events);
+    m_arena_mutex.unlock();
+}
+
+/**
+ * Post the oldest record of the spool.
+ * @return false if it could not be sent or read.
+ */
+bool TelemetryClient::replay_spool(void)
+{
+    int size = m_spool->peek(NULL, 0);
+    if (size <= 0)
+    {
+        return false;
+    }
+    char *data = (char *)malloc(size);
+    if (data == NULL)
+    {
+        return false;
+    }
+
+    int result = BATCH_UNSENT;
+    if (m_spool->peek(data, size) == size)
+    {
+        result = post_batch(data, size);
+        if (result != BATCH_UNSENT)
+        {
+            m_spool->pop();
+        }
+    }
+    free(data);
+    return (result != BATCH_UNSENT);
+}
+
+int TelemetryClient::batch_producer(char *buffer, size_t size)
+{
+    int count = 0;
+    while (count < (int)size && m_batch_sent < m_batch_length)
+    {
+        if (m_batch_sent == 0)
+        {
+            buffer[count++] = '[';
+            m_batch_sent++;
+        }
+        else if (m_batch_sent == m_batch_length - 1)
+        {
+            buffer[count++] = ']';
+            m_batch_sent++;
+        }
+        else
+        {
+            int len = m_batch_length - 1 - m_batch_sent;
+            if (len > (int)size - count)
+            {
+                len = (int)size - count;
+            }
+            memcpy(buffer + count, m_batch_data + m_batch_sent - 1, len);
+            count += len;
+            m_batch_sent += len;
+        }
+    }
+    return count;
 }
 
 void TelemetryClient::telemetry_worker(void)
 {
     while (true)
     {
-        if (SystemWiFiRSSI() == 0)
+        m_arena_mutex.lock();
+        int used = m_arena_used;
+        int waited = (m_event_count > 0) ? (int)(millis() - m_enqueue_ms[0]) : 0;
+        m_arena_mutex.unlock();
+
+        bool due = (used >= TELEMETRY_BATCH_BYTES || (used > 0 && waited >= m_batch_delay_ms));
+        bool spooled = (m_spool != NULL && !m_spool->empty());
+
+        if (!due && !spooled)
+        {
+            // Sleep until an event is pushed or the batch delay is over
+            Thread::signal_wait(TELEMETRY_SIGNAL, (used == 0) ? osWaitForever : m_batch_delay_ms - waited);
+        }
+        else if (SystemWiFiRSSI() == 0)
         {
-            // Cache telemetry data until it's restored
-            wait_ms(CHECK_INTERVAL_MS);
-            continue;
+            if (used >= TELEMETRY_BATCH_BYTES && m_spool != NULL)
+            {
+                // Write the flash only in batch sized records, the arena gets room again
+                spool_pending();
+            }
+            // Cache telemetry data until it's restored, a reconnect wakes the worker up
+            Thread::signal_wait(TELEMETRY_SIGNAL, CHECK_INTERVAL_MS);
         }
-        
-        char* msg = pop_msg();
-        if (msg != NULL)
+        else if (spooled)
         {
-            send_data_to_ai(msg, strlen(msg));
-            delete [] msg;
+            // Older events first
+            if (!replay_spool())
+            {
+                Thread::signal_wait(TELEMETRY_SIGNAL, CHECK_INTERVAL_MS);
+            }
         }
         else
         {
-            wait_ms(CHECK_INTERVAL_MS);
+            send_batch();
         }
     }
 }
@@ -5,9 +5,31 @@
 #define __TELEMERTY_H__
 
 #include "mbed.h"
-#include "CircularBuffer.h"
+#include "FileSpool.h"
+#include "Telemetry.h"
 
-#define MESSAGE_QUEUE_SIZE  5
+// Bytes of formatted events that can wait to be sent
+#ifndef TELEMETRY_ARENA_SIZE
+#define TELEMETRY_ARENA_SIZE        4096
+#endif
+
+// Send the pending events once this many bytes are waiting
+#ifndef TELEMETRY_BATCH_BYTES
+#define TELEMETRY_BATCH_BYTES       2048
+#endif
+
+// Send the pending events once the oldest has waited this long
+#ifndef TELEMETRY_BATCH_DELAY_MS
+#define TELEMETRY_BATCH_DELAY_MS    2000
+#endif
+
+// Most async events that can wait to be sent
+#ifndef TELEMETRY_MAX_EVENTS
+#define TELEMETRY_MAX_EVENTS        16
+#endif
+
+// Number of recent events the latency percentiles are computed over
+#define TELEMETRY_LATENCY_SAMPLES   64
 
 /** Client to collect device telemetry data and send to Azure Application Insights 
 *
@@ -30,15 +52,43 @@ public:
     */
     void Send(const char *event, const char *message = NULL, const char *iothub = NULL, bool async = true);
 
+    /**
+    Set the longest time an async event waits for others to be sent with it.
+    @param delay_ms the delay in milliseconds, 0 to send every event as soon as possible.
+    */
+    void SetBatchDelay(int delay_ms);
+
+    /**
+    Wake the worker up to send the pending events, e.g. after Wi-Fi reconnected.
+    */
+    void WakeUp(void);
+
+    /**
+    Keep the pending events in a spool while Wi-Fi is down, they are sent
+    before newer events once it's back, even after a reboot.
+    @param spool the spool, NULL to drop the events when the buffer is full.
+    */
+    void SetSpool(FileSpool *spool);
+
+    /**
+    Get the counters of the async events.
+    */
+    void GetStats(TELEMETRY_STATS *stats);
+
 private:
     void telemetry_worker(void);
 
     void hash(char *result, const char *input);
-    void send_data_to_ai(const char* data, int size);
+    bool send_data_to_ai(const char* data, int size);
     void do_trace_telemetry(const char *iothub, const char *event, const char *message, bool async);
 
-    bool push_msg(char* message);
-    char* pop_msg(void);
+    bool push_msg(const char *event, const char *message, const char *time, int size);
+    int post_batch(const char *data, int length);
+    void send_batch(void);
+    void spool_pending(void);
+    bool replay_spool(void);
+    void drop_pending(int length, int events);
+    int batch_producer(char *buffer, size_t size);
 
 private:
     const char* m_ai_endoint;
@@ -48,8 +98,28 @@ private:
     char m_hash_iothub_name[36];
     int m_base_size;
 
-    CircularBuffer<char*, MESSAGE_QUEUE_SIZE> m_pool;
-        
+    // Events are stored back to back, each followed by a ',', so the pending
+    // bytes are the content of a JSON array
+    char m_arena[TELEMETRY_ARENA_SIZE];
+    int m_arena_used;
+    Mutex m_arena_mutex;
+
+    // Time each pending event was pushed, oldest first
+    uint32_t m_enqueue_ms[TELEMETRY_MAX_EVENTS];
+    int m_event_count;
+    int m_batch_delay_ms;
+
+    TELEMETRY_STATS m_stats;
+    uint32_t m_latency_ms[TELEMETRY_LATENCY_SAMPLES];
+    uint32_t m_latency_count;
+
+    FileSpool *m_spool;
+
+    // Batch being sent and its position, in bytes of body
+    const char *m_batch_data;
+    int m_batch_length;
+    int m_batch_sent;
+
     Thread m_telemetry_thread;
 };
 
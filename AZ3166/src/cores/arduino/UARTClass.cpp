@@ -50,8 +50,7 @@ void UARTClass::end(void)
 size_t UARTClass::write(const uint8_t c)
 {
   init();
-  serial->putc(c);
-  return 1;
+  return serial->putc(c) < 0 ? 0 : 1;
 }
 
 size_t UARTClass::write(const uint8_t *buffer, size_t size)
@@ -79,6 +78,12 @@ int  UARTClass::read(void)
   return serial->getc();
 }
 
+int UARTClass::read(uint8_t *buffer, size_t size)
+{
+  init();
+  return serial->read(buffer, size);
+}
+
 int UARTClass::peek( void )
 {
   init();
@@ -91,6 +96,18 @@ void UARTClass::flush( void )
   return serial->flush();
 }
 
+void UARTClass::setOverflowPolicy(BufferedSerial::OverflowPolicy policy, uint32_t timeoutMs)
+{
+  init();
+  serial->set_overflow_policy(policy, timeoutMs);
+}
+
+void UARTClass::getStats(BufferedSerial::Stats *stats)
+{
+  init();
+  serial->get_stats(stats);
+}
+
 void UARTClass::init(void)
 {
   if(serial == NULL)
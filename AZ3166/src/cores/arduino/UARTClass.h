@@ -38,6 +38,7 @@ class UARTClass : public HardwareSerial
     int available(void);
     int availableForWrite(void);
     int read(void);
+    int read(uint8_t *buffer, size_t size);
     int peek(void);
     void flush(void);
 
@@ -46,6 +47,9 @@ class UARTClass : public HardwareSerial
     
     using Print::write; // pull in write(str) and write(buf, size) from Print
 
+    void setOverflowPolicy(BufferedSerial::OverflowPolicy policy, uint32_t timeoutMs = 0);
+    void getStats(BufferedSerial::Stats *stats);
+
     operator bool() { return true; }; // UART always active
 
   protected:
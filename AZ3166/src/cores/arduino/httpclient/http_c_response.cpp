@@ -17,12 +17,43 @@
 
 #include "http_c_response.h"
 
+// Smallest heap allocation for the body, the buffer doubles from here
+#define BODY_MIN_CAPACITY   256
+
+// Smallest allocation for filtered header values
+#define HEADER_VALUES_MIN_CAPACITY  64
+
+// Append length bytes to a NUL terminated heap string (NULL for none)
+static char* append_string(char* str, const char* at, size_t length)
+{
+    size_t str_length = str ? strlen(str) : 0;
+    char* result = (char*)realloc(str, str_length + length + 1);
+    if (result == NULL)
+    {
+        return str;
+    }
+    memcpy(result + str_length, at, length);
+    result[str_length + length] = 0;
+    return result;
+}
+
 HttpResponse::HttpResponse()
 {
     status_code = 0;
     status_message = NULL;
     body = NULL;
+    body_capacity = 0;
+    body_external = false;
+    body_truncated = false;
     headers = NULL;
+    header_filtered = false;
+    header_filter = NULL;
+    header_filter_count = 0;
+    header_match = -1;
+    header_name_length = 0;
+    header_values = NULL;
+    header_values_length = 0;
+    header_values_capacity = 0;
     concat_header_field = false;
     concat_header_value = false;
     is_message_completed = false;
@@ -34,7 +65,7 @@ HttpResponse::~HttpResponse()
     {
         free(status_message);
     }
-    if (body)
+    if (body && !body_external)
     {
         free(body);
     }
@@ -46,6 +77,10 @@ HttpResponse::~HttpResponse()
         free(headers);
         headers = prev;
     }
+    if (header_values)
+    {
+        free(header_values);
+    }
 }
 
 void HttpResponse::set_status(int a_status_code, const char *status_message_at, size_t status_message_length) 
@@ -79,31 +114,31 @@ void HttpResponse::set_header_field(const char* field_at, size_t length)
     {
         return;
     }
-    
-    concat_header_value = false;
-    
-    // headers can be chunked
-    char* key = (char*)malloc(length + 1);
-    memcpy(key, field_at, length);
-    key[length] = 0;
-    if (concat_header_field) 
+
+    if (header_filtered)
     {
-        if (headers->key)
-        {
-            free(headers->key);
-        }
-        headers->key = key;
+        filter_header_field(field_at, length);
+    }
+    else if (concat_header_field && headers != NULL) 
+    {
+        // headers can be chunked
+        headers->key = append_string(headers->key, field_at, length);
     }
     else
     {
         // New
         KEYVALUE* header = (KEYVALUE*)malloc(sizeof(KEYVALUE));
-        header->key = key;
+        if (header == NULL)
+        {
+            return;
+        }
+        header->key = append_string(NULL, field_at, length);
         header->value = NULL;
         header->prev = headers;
         headers = header;
     }
 
+    concat_header_value = false;
     concat_header_field = true;
 }
 
@@ -113,34 +148,167 @@ void HttpResponse::set_header_value(const char* value_at, size_t length)
     {
         return;
     }
-    
-    concat_header_field = false;
 
-    // headers can be chunked
-    char* value = (char*)malloc(length + 1);
-    memcpy(value, value_at, length);
-    value[length] = 0;
-    if (concat_header_value) 
+    if (header_filtered)
     {
-        if (headers->value)
-        {
-            free(headers->value);
-        }
-        headers->value = value;
+        filter_header_value(value_at, length);
+    }
+    else if (concat_header_value && headers != NULL) 
+    {
+        // headers can be chunked
+        headers->value = append_string(headers->value, value_at, length);
+    }
+    else if (headers != NULL && headers->value == NULL)
+    {
+        // Value of the field just parsed
+        headers->value = append_string(NULL, value_at, length);
     }
     else 
     {
         // New
         KEYVALUE* header = (KEYVALUE*)malloc(sizeof(KEYVALUE));
+        if (header == NULL)
+        {
+            return;
+        }
         header->key = NULL;
-        header->value = value;
+        header->value = append_string(NULL, value_at, length);
         header->prev = headers;
         headers = header;
     }
     
+    concat_header_field = false;
     concat_header_value = true;
 }
 
+void HttpResponse::set_header_filter(const char* const* names, int count)
+{
+    if ((names == NULL && count > 0) || count < 0 || headers != NULL)
+    {
+        return;
+    }
+    if (count > HTTP_HEADER_FILTER_MAX)
+    {
+        count = HTTP_HEADER_FILTER_MAX;
+    }
+    header_filtered = true;
+    header_filter = names;
+    header_filter_count = count;
+    for (int i = 0; i < count; i++)
+    {
+        header_offsets[i] = -1;
+    }
+}
+
+void HttpResponse::filter_header_field(const char* field_at, size_t length)
+{
+    if (!concat_header_field)
+    {
+        // A new header, keep the NUL that ends the previous kept value
+        if (header_match >= 0)
+        {
+            header_values_length++;
+        }
+        header_match = -1;
+        header_name_length = 0;
+    }
+
+    // Only the name is kept, just long enough to compare it with the filter
+    if (header_name_length + length < HTTP_HEADER_NAME_MAX)
+    {
+        memcpy(header_name + header_name_length, field_at, length);
+    }
+    header_name_length += length;
+}
+
+void HttpResponse::filter_header_value(const char* value_at, size_t length)
+{
+    if (!concat_header_value)
+    {
+        header_match = -1;
+        if (header_name_length < HTTP_HEADER_NAME_MAX)
+        {
+            for (int i = 0; i < header_filter_count; i++)
+            {
+                if (strlen(header_filter[i]) == header_name_length
+                    && strncasecmp(header_filter[i], header_name, header_name_length) == 0)
+                {
+                    // A repeated header replaces the earlier value
+                    header_match = i;
+                    header_offsets[i] = header_values_length;
+                    break;
+                }
+            }
+        }
+    }
+    if (header_match < 0)
+    {
+        return;
+    }
+
+    size_t needed = header_values_length + length + 1;
+    if (needed > header_values_capacity)
+    {
+        size_t capacity = header_values_capacity ? header_values_capacity * 2 : HEADER_VALUES_MIN_CAPACITY;
+        if (capacity < needed)
+        {
+            capacity = needed;
+        }
+        char* values = (char*)realloc(header_values, capacity);
+        if (values == NULL)
+        {
+            // Out of memory, drop this header rather than keep a partial value
+            header_offsets[header_match] = -1;
+            header_match = -1;
+            return;
+        }
+        header_values = values;
+        header_values_capacity = capacity;
+    }
+    memcpy(header_values + header_values_length, value_at, length);
+    header_values_length += length;
+    header_values[header_values_length] = 0;
+}
+
+const char* HttpResponse::get_header(const char* name)
+{
+    if (name == NULL)
+    {
+        return NULL;
+    }
+
+    if (header_filtered)
+    {
+        for (int i = 0; i < header_filter_count; i++)
+        {
+            if (strcasecmp(header_filter[i], name) == 0)
+            {
+                return get_header(i);
+            }
+        }
+        return NULL;
+    }
+
+    // Newest first, so a repeated header returns its last value
+    for (KEYVALUE* header = headers; header != NULL; header = header->prev)
+    {
+        if (header->key != NULL && strcasecmp(header->key, name) == 0)
+        {
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+const char* HttpResponse::get_header(int index)
+{
+    if (index < 0 || index >= header_filter_count || header_offsets[index] < 0)
+    {
+        return NULL;
+    }
+    return header_values + header_offsets[index];
+}
+
 const KEYVALUE* HttpResponse::get_headers()
 {
     return headers;
@@ -153,23 +321,73 @@ void HttpResponse::set_body(const char* at, size_t length)
         return;
     }
     
-    if(body != NULL)
+    // Keep room for the NUL terminator
+    size_t needed = body_length + length + 1;
+    if (needed > body_capacity)
+    {
+        size_t size = body_capacity * 2;
+        if (size < BODY_MIN_CAPACITY)
+        {
+            size = BODY_MIN_CAPACITY;
+        }
+        if (size < needed)
+        {
+            size = needed;
+        }
+        if (!grow_body(size) && !grow_body(needed))
+        {
+            body_truncated = true;
+            if (body_capacity == 0)
+            {
+                return;
+            }
+            length = body_capacity - body_length - 1;
+        }
+    }
+
+    memcpy(&body[body_length], at, length);
+    body_length += length;
+    body[body_length] = 0;
+}
+
+void HttpResponse::reserve_body(size_t size)
+{
+    if (size + 1 > body_capacity)
+    {
+        grow_body(size + 1);
+    }
+}
+
+void HttpResponse::set_body_buffer(char* buffer, size_t size)
+{
+    if (buffer == NULL || size == 0 || body_length > 0)
+    {
+        return;
+    }
+    if (body && !body_external)
     {
-        char* bd = (char*)malloc(body_length + length + 1);
-        memcpy(bd, body, body_length);
-        memcpy(&bd[body_length], at, length);
-        bd[body_length + length] = 0;
         free(body);
-        body = bd;
-        body_length += length;
     }
-    else
+    body = buffer;
+    body[0] = 0;
+    body_capacity = size;
+    body_external = true;
+}
+
+bool HttpResponse::grow_body(size_t size)
+{
+    if (body_external)
+    {
+        return false;
+    }
+    char* bd = (char*)realloc(body, size);
+    if (bd == NULL)
     {
-        body = (char*)malloc(length + 1);
-        memcpy(body, at, length);
-        body[length] = 0;
-        body_length = length;
+        return false;
     }
+    body = bd;
+    body_capacity = size;
+    return true;
 }
 
 const char* HttpResponse::get_body()
@@ -182,6 +400,11 @@ int HttpResponse::get_body_length()
     return body_length;
 }
 
+bool HttpResponse::is_body_truncated()
+{
+    return body_truncated;
+}
+
 void HttpResponse::set_message_complete() {
     is_message_completed = true;
 }
@@ -37,13 +37,52 @@ public:
     void set_header_value(const char* value_at, size_t length);
     
     const KEYVALUE* get_headers();
+
+    /**
+     * Keep only the listed response headers. Everything else is skipped
+     * without allocating and get_headers() returns NULL; the kept values are
+     * stored back to back in one buffer. Must be called before the headers
+     * are received.
+     *
+     * @param names Header names (case insensitive), must stay valid for the
+     *              life of the response, at most HTTP_HEADER_FILTER_MAX
+     * @param count Number of names, 0 to skip every header
+     */
+    void set_header_filter(const char* const* names, int count);
+
+    /**
+     * Get a response header value by name, NULL if it was not received (or
+     * filtered out).
+     */
+    const char* get_header(const char* name);
+
+    /**
+     * Get the value of the index-th header registered with
+     * set_header_filter, NULL if it was not received.
+     */
+    const char* get_header(int index);
     
     void set_body(const char* at, size_t length);
 
+    /**
+     * Make room for at least size bytes of body up front, e.g. when the
+     * Content-Length is known, so set_body does not have to grow the buffer.
+     */
+    void reserve_body(size_t size);
+
+    /**
+     * Store the body in a caller owned buffer instead of the heap. The body is
+     * NUL terminated and truncated to size - 1 bytes, see is_body_truncated().
+     * Must be called before any body is received.
+     */
+    void set_body_buffer(char* buffer, size_t size);
+
     const char* get_body();
 
     int get_body_length();
 
+    bool is_body_truncated();
+
     void set_message_complete();
 
     bool is_message_complete();
@@ -53,12 +92,31 @@ private:
     char* status_message;
     
     KEYVALUE *headers;
+
+    void filter_header_field(const char* field_at, size_t length);
+    void filter_header_value(const char* value_at, size_t length);
+
+    bool header_filtered;
+    const char* const* header_filter;
+    int header_filter_count;
+    int header_offsets[HTTP_HEADER_FILTER_MAX];     // value offset in header_values, -1 if absent
+    int header_match;                               // filter index of the header being parsed
+    char header_name[HTTP_HEADER_NAME_MAX];
+    size_t header_name_length;
+    char* header_values;
+    size_t header_values_length;
+    size_t header_values_capacity;
         
     bool concat_header_field;
     bool concat_header_value;
     bool is_message_completed;
 
+    bool grow_body(size_t size);
+
     char* body;
     int body_length = 0;
+    size_t body_capacity;
+    bool body_external;
+    bool body_truncated;
 };
 #endif  // __HTTP_C_RESPONSE_2017_4_29__
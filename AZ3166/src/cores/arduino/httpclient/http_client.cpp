@@ -54,21 +54,37 @@ const Http_Response* HTTPClient::send(const void* body, int body_size)
 {
     if (_https_request != NULL)
     {
-        HttpResponse *response = _https_request->send(body, body_size);
-        if (response != NULL)
-        {
-            _response->status_code = response->get_status_code();
-            _response->status_message = response->get_status_message();
-            _response->body = response->get_body();
-            _response->headers = response->get_headers();
-            _response->body_length = response -> get_body_length();
-            return _response;
-        }
+        return fill_response(_https_request->send(body, body_size));
     }
     
     return NULL;
 }
 
+const Http_Response* HTTPClient::send_stream(Callback<int(char *buffer, size_t size)> body_producer, int body_size)
+{
+    if (_https_request != NULL)
+    {
+        return fill_response(_https_request->send_stream(body_producer, body_size));
+    }
+    
+    return NULL;
+}
+
+const Http_Response* HTTPClient::fill_response(HttpResponse *response)
+{
+    _https_response = response;
+    if (response == NULL)
+    {
+        return NULL;
+    }
+    _response->status_code = response->get_status_code();
+    _response->status_message = response->get_status_message();
+    _response->body = response->get_body();
+    _response->headers = response->get_headers();
+    _response->body_length = response -> get_body_length();
+    return _response;
+}
+
 void HTTPClient::set_header(const char* key, const char* value)
 {
     if (_https_request != NULL)
@@ -77,6 +93,39 @@ void HTTPClient::set_header(const char* key, const char* value)
     }
 }
 
+void HTTPClient::set_body_buffer(char* buffer, size_t size)
+{
+    if (_https_request != NULL)
+    {
+        _https_request->set_body_buffer(buffer, size);
+    }
+}
+
+void HTTPClient::set_keep_alive(bool keep_alive)
+{
+    if (_https_request != NULL)
+    {
+        _https_request->set_keep_alive(keep_alive);
+    }
+}
+
+void HTTPClient::set_header_filter(const char* const* names, int count)
+{
+    if (_https_request != NULL)
+    {
+        _https_request->set_header_filter(names, count);
+    }
+}
+
+const char* HTTPClient::get_response_header(const char* name)
+{
+    if (_https_response != NULL)
+    {
+        return _https_response->get_header(name);
+    }
+    return NULL;
+}
+
 nsapi_error_t HTTPClient::get_error()
 {
     if (_https_request != NULL)
@@ -89,6 +138,7 @@ nsapi_error_t HTTPClient::get_error()
 void HTTPClient::init(const char* ssl_ca_pem, http_method method, const char* url, Callback<void(const char *at, size_t length)> body_callback)
 {
     _https_request = NULL;
+    _https_response = NULL;
     _response = new Http_Response;
     if (strlen(url) >= 5 && (strncmp("http:", url, 5) == 0))
     {
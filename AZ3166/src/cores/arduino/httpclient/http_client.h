@@ -36,13 +36,20 @@ public:
     virtual ~HTTPClient(void);
     
     const Http_Response* send(const void* body = NULL, int body_size = 0);
+    const Http_Response* send_stream(Callback<int(char *buffer, size_t size)> body_producer, int body_size = -1);
     void set_header(const char* key, const char* value);
+    void set_body_buffer(char* buffer, size_t size);
+    void set_keep_alive(bool keep_alive);
+    void set_header_filter(const char* const* names, int count);
+    const char* get_response_header(const char* name);
     nsapi_error_t get_error();
     
 private:
     void init(const char* ssl_ca_pem, http_method method, const char* url, Callback<void(const char *at, size_t length)> body_callback);
+    const Http_Response* fill_response(HttpResponse *response);
     
     HttpsRequest *_https_request;
+    HttpResponse *_https_response;
     Http_Response *_response;
 };
 
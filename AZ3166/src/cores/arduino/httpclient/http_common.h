@@ -32,18 +32,34 @@ typedef struct _tagKeyValue
 #include "http_parser.h"
 
 #if DEBUG_LEVEL > 0
-#define ERROR(x) do { printf("ERROR: "); printf(x); printf("\r\n"); } while(0);
+#include "DeferredLog.h"
+#define ERROR(x) do { deferred_log_at(DEFERRED_LOG_ERROR, __FILE__, __LINE__, "%s", x); } while(0);
 #else
 #define ERROR(x) do {  } while(0);
 #endif
 
 #if DEBUG_LEVEL > 1
-#define INFO(x) do { printf(x); printf("\r\n"); } while(0);
+#define INFO(x) do { deferred_log(DEFERRED_LOG_INFO, "%s", x); } while(0);
 #else
 #define INFO(x) do {  } while(0);
 #endif
 
 #define HTTP_RECEIVE_BUFFER_SIZE 2048
 
+// Request header buffer, small bodies are sent in it along with the header
+#define HTTP_SEND_BUFFER_SIZE 1024
+
+// Body size meaning "unknown, send with Transfer-Encoding: chunked"
+#define HTTP_CHUNKED_BODY_SIZE ((size_t)-1)
+
+// Most response headers that can be registered with set_header_filter
+#define HTTP_HEADER_FILTER_MAX 8
+
+// Longer response header names never match the header filter
+#define HTTP_HEADER_NAME_MAX 64
+
+// Largest Content-Length the response body is allocated for up front
+#define HTTP_BODY_PREALLOCATE_LIMIT (64 * 1024)
+
 
 #endif // __HTTPS_COMMON_H__
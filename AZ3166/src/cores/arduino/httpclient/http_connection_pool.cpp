@@ -0,0 +1,136 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Arduino.h"
+#include "http_connection_pool.h"
+#include "mbed_critical.h"
+
+typedef struct
+{
+    TLSSocket* socket;
+    const char* ssl_ca_pem;
+    uint16_t port;
+    unsigned long last_used;
+    char host[HTTP_POOL_MAX_HOST_LEN];
+} POOLED_CONNECTION;
+
+static POOLED_CONNECTION connections[HTTP_POOL_MAX_CONNECTIONS];
+
+/**
+ * Take the connections idle for longer than HTTP_POOL_IDLE_TIMEOUT_MS out of
+ * the pool, must be called in the critical section.
+ */
+static int take_expired(unsigned long now, TLSSocket** expired)
+{
+    int expired_count = 0;
+    for (int i = 0; i < HTTP_POOL_MAX_CONNECTIONS; i++)
+    {
+        POOLED_CONNECTION* connection = &connections[i];
+        if (connection->socket != NULL && now - connection->last_used >= HTTP_POOL_IDLE_TIMEOUT_MS)
+        {
+            expired[expired_count++] = connection->socket;
+            connection->socket = NULL;
+        }
+    }
+    return expired_count;
+}
+
+// Close outside the critical section, the destructor talks to the network
+static void close_all(TLSSocket** sockets, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        delete sockets[i];
+    }
+}
+
+TLSSocket* HttpConnectionPool::acquire(const char* ssl_ca_pem, const char* host, uint16_t port)
+{
+    TLSSocket* found = NULL;
+    TLSSocket* expired[HTTP_POOL_MAX_CONNECTIONS];
+    unsigned long now = millis();
+
+    core_util_critical_section_enter();
+    int expired_count = take_expired(now, expired);
+    for (int i = 0; i < HTTP_POOL_MAX_CONNECTIONS; i++)
+    {
+        POOLED_CONNECTION* connection = &connections[i];
+        if (connection->socket != NULL && connection->ssl_ca_pem == ssl_ca_pem && connection->port == port
+            && strcmp(connection->host, host) == 0)
+        {
+            found = connection->socket;
+            connection->socket = NULL;
+            break;
+        }
+    }
+    core_util_critical_section_exit();
+
+    close_all(expired, expired_count);
+    return found;
+}
+
+void HttpConnectionPool::release(TLSSocket* socket, const char* ssl_ca_pem, const char* host, uint16_t port)
+{
+    if (socket == NULL)
+    {
+        return;
+    }
+    if (HTTP_POOL_MAX_CONNECTIONS == 0 || strlen(host) >= HTTP_POOL_MAX_HOST_LEN)
+    {
+        delete socket;
+        return;
+    }
+
+    unsigned long now = millis();
+    POOLED_CONNECTION* slot = NULL;
+    // Room for the expired connections and the evicted one
+    TLSSocket* closed[HTTP_POOL_MAX_CONNECTIONS + 1];
+
+    core_util_critical_section_enter();
+    int closed_count = take_expired(now, closed);
+    for (int i = 0; i < HTTP_POOL_MAX_CONNECTIONS; i++)
+    {
+        POOLED_CONNECTION* connection = &connections[i];
+        if (connection->socket == NULL)
+        {
+            slot = connection;
+            break;
+        }
+        // Pool is full, evict the connection idle for the longest time
+        if (slot == NULL || now - connection->last_used > now - slot->last_used)
+        {
+            slot = connection;
+        }
+    }
+    if (slot->socket != NULL)
+    {
+        closed[closed_count++] = slot->socket;
+    }
+    slot->socket = socket;
+    slot->ssl_ca_pem = ssl_ca_pem;
+    slot->port = port;
+    slot->last_used = now;
+    strcpy(slot->host, host);
+    core_util_critical_section_exit();
+
+    close_all(closed, closed_count);
+}
+
+void HttpConnectionPool::clear()
+{
+    TLSSocket* idle[HTTP_POOL_MAX_CONNECTIONS];
+    int idle_count = 0;
+
+    core_util_critical_section_enter();
+    for (int i = 0; i < HTTP_POOL_MAX_CONNECTIONS; i++)
+    {
+        if (connections[i].socket != NULL)
+        {
+            idle[idle_count++] = connections[i].socket;
+            connections[i].socket = NULL;
+        }
+    }
+    core_util_critical_section_exit();
+
+    close_all(idle, idle_count);
+}
@@ -0,0 +1,57 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __HTTP_CONNECTION_POOL_H__
+#define __HTTP_CONNECTION_POOL_H__
+
+#include "http_common.h"
+#include "TLSSocket.h"
+
+// Idle connections kept open, each TLS connection holds its record buffers
+#ifndef HTTP_POOL_MAX_CONNECTIONS
+#define HTTP_POOL_MAX_CONNECTIONS   1
+#endif
+
+// Idle connections older than this are closed instead of reused, checked
+// whenever a connection is taken from or given back to the pool
+#ifndef HTTP_POOL_IDLE_TIMEOUT_MS
+#define HTTP_POOL_IDLE_TIMEOUT_MS   10000
+#endif
+
+// Connections to longer host names are not pooled
+#define HTTP_POOL_MAX_HOST_LEN      64
+
+/**
+ * Process wide pool of idle HTTP/1.1 keep-alive connections, keyed by the
+ * trusted CA, host and port they were opened with. Only requests that opted
+ * in with HTTPClient::set_keep_alive(true) use it, and a parked connection
+ * lives until the next pool access after its idle timeout, so keep-alive is
+ * for apps that talk to the same server again soon.
+ */
+class HttpConnectionPool
+{
+public:
+    /**
+     * Take an idle connection out of the pool.
+     *
+     * @param[in] ssl_ca_pem CA the connection was opened with, NULL for plain HTTP
+     * @param[in] host Server host name
+     * @param[in] port Server port
+     * @return A connected socket owned by the caller, or NULL if none is pooled.
+     */
+    static TLSSocket* acquire(const char* ssl_ca_pem, const char* host, uint16_t port);
+
+    /**
+     * Give a connection back after a response that allows keep-alive. The
+     * pool owns the socket from now on and may close it right away.
+     */
+    static void release(TLSSocket* socket, const char* ssl_ca_pem, const char* host, uint16_t port);
+
+    /**
+     * Close every idle connection, e.g. before the network goes down.
+     * WiFiClass::disconnect() calls it.
+     */
+    static void clear();
+};
+
+#endif // __HTTP_CONNECTION_POOL_H__
@@ -16,25 +16,24 @@
  */
 #include "http_header_builder.h"
 
-#define KEV_PAIR_LEN(x) strlen(x->key) + 1 + 1 + strlen(x->value) + 2;      // KEY: VALUE\r\n
+// Initial size of the header line arena, it doubles when full
+#define HEADERS_MIN_CAPACITY    128
 
 HttpHeaderBuilder::HttpHeaderBuilder(http_method method, ParsedUrl* parsed_url)
 {
     _method = method;
     _parsed_url = parsed_url;
-    headers = NULL;
+    _headers = NULL;
+    _headers_length = 0;
+    _headers_capacity = 0;
     set_header("Host", _parsed_url->host());
 }
 
 HttpHeaderBuilder::~HttpHeaderBuilder()
 {
-    while (headers != NULL)
+    if (_headers)
     {
-        KEYVALUE* prev = headers->prev;
-        free(headers->key);
-        free(headers->value);
-        free(headers);
-        headers = prev;
+        free(_headers);
     }
 }
 
@@ -48,94 +47,110 @@ void HttpHeaderBuilder::set_header(const char* key, const char* value)
     {
         return;
     }
-    
-    KEYVALUE* header = headers;
-    
-    while (header != NULL)
+
+    size_t key_length = strlen(key);
+    size_t value_length = strlen(value);
+
+    // Same key, drop the old line and append the new value
+    remove_header(key);
+
+    // line is KEY: VALUE\r\n
+    size_t line_length = key_length + 2 + value_length + 2;
+    if (_headers_length + line_length > _headers_capacity)
     {
-        if (strcmp(header->key, key) == 0)
+        size_t capacity = _headers_capacity ? _headers_capacity * 2 : HEADERS_MIN_CAPACITY;
+        if (capacity < _headers_length + line_length)
         {
-            // Same key, replace the value
-            free(header->value);
-            header->value = strdup(value);
+            capacity = _headers_length + line_length;
+        }
+        char* headers = (char*)realloc(_headers, capacity);
+        if (headers == NULL)
+        {
+            ERROR("realloc failed");
             return;
         }
-        header = header->prev;
+        _headers = headers;
+        _headers_capacity = capacity;
     }
-    
-    // New
-    header = (KEYVALUE*)malloc(sizeof(KEYVALUE));
-    header->key = strdup(key);
-    header->value = strdup(value);
-    header->prev = headers;
-    headers = header;
+
+    char* p = _headers + _headers_length;
+    memcpy(p, key, key_length);
+    p += key_length;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, value_length);
+    p += value_length;
+    *p++ = '\r';
+    *p++ = '\n';
+    _headers_length += line_length;
 }
 
-char* HttpHeaderBuilder::build(size_t body_size, size_t &size)
+char* HttpHeaderBuilder::find_header(const char* key, size_t key_length)
 {
-    const char* method_str = http_method_str(_method);
-
-    if (_method == HTTP_POST || _method == HTTP_PUT) 
+    char* end = _headers + _headers_length;
+    char* line = _headers;
+    while (line != NULL && line < end)
     {
-        char buffer[10];
-        snprintf(buffer, 10, "%d", body_size);
-        set_header("Content-Length", buffer);
+        if ((size_t)(end - line) > key_length && memcmp(line, key, key_length) == 0 && line[key_length] == ':')
+        {
+            return line;
+        }
+        line = (char*)memchr(line, '\n', end - line);
+        if (line != NULL)
+        {
+            line++;
+        }
     }
+    return NULL;
+}
 
-    // first line is METHOD PATH+QUERY HTTP/1.1\r\n
-    int len_first_line = strlen(method_str) + 1 + strlen(_parsed_url->path()) + (strlen(_parsed_url->query()) ? strlen(_parsed_url->query()) + 1 : 0) + 1 + 8 + 2;
-    size += len_first_line;
-
-    // after that we'll do the headers
-    KEYVALUE* header = headers;
-    while (header != NULL)
+void HttpHeaderBuilder::remove_header(const char* key)
+{
+    char* line = find_header(key, strlen(key));
+    if (line != NULL)
     {
-        // line is KEY: VALUE\r\n
-        size += KEV_PAIR_LEN(header);
-        header = header->prev;
+        char* next = (char*)memchr(line, '\n', _headers + _headers_length - line) + 1;
+        memmove(line, next, _headers + _headers_length - next);
+        _headers_length -= next - line;
     }
-    
-    // then the body, first an extra newline
-    size += 2;
+}
 
-    // Now let's print it
-    char* req = (char*)calloc(size + 1, 1);
-    if (req == NULL) 
+size_t HttpHeaderBuilder::build(size_t body_size, char* buffer, size_t buffer_size)
+{
+    if (body_size == HTTP_CHUNKED_BODY_SIZE)
     {
-        ERROR("calloc failed");
+        remove_header("Content-Length");
+        set_header("Transfer-Encoding", "chunked");
     }
-    char* originalReq = req;
-
-    if (strlen(_parsed_url->query())) 
-    {
-        sprintf(req, "%s %s?%s HTTP/1.1\r\n", method_str, _parsed_url->path(), _parsed_url->query());
-    } else 
+    else if (_method == HTTP_POST || _method == HTTP_PUT) 
     {
-        sprintf(req, "%s %s%s HTTP/1.1\r\n", method_str, _parsed_url->path(), _parsed_url->query());
+        remove_header("Transfer-Encoding");
+        char length[11];
+        snprintf(length, sizeof(length), "%u", (unsigned int)body_size);
+        set_header("Content-Length", length);
     }
-    req += len_first_line;
 
-    header = headers;
-    while (header != NULL)
+    // first line is METHOD PATH+QUERY HTTP/1.1\r\n
+    const char* query = _parsed_url->query();
+    int first_line_length = snprintf(buffer, buffer_size, "%s %s%s%s HTTP/1.1\r\n",
+                                     http_method_str(_method), _parsed_url->path(), query[0] ? "?" : "", query);
+    if (first_line_length < 0)
     {
-        // line is KEY: VALUE\r\n
-        sprintf(req, "%s: %s\r\n", header->key, header->value);
-        req += KEV_PAIR_LEN(header);
-        
-        header = header->prev;
+        return 0;
     }
-    
-    req[0] = '\r';
-    req[1] = '\n';
-    sprintf(req, "\r\n");
-    req += 2;
-    
-    INFO(originalReq);
-    
-    return originalReq;
-}
 
-void HttpHeaderBuilder::free_headers(char* data)
-{
-    free(data);
+    // then the header lines and an empty line
+    size_t size = first_line_length + _headers_length + 2;
+    if (size < buffer_size)
+    {
+        char* p = buffer + first_line_length;
+        memcpy(p, _headers, _headers_length);
+        p += _headers_length;
+        *p++ = '\r';
+        *p++ = '\n';
+        *p = 0;
+
+        INFO(buffer);
+    }
+    return size;
 }
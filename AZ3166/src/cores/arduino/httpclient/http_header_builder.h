@@ -29,15 +29,29 @@ public:
     
     void set_header(const char* key, const char* value);
 
-    char* build(size_t body_size, size_t &size);
-
-    void free_headers(char* data);
+    /**
+     * Write the request line and the headers, including the empty line that
+     * ends them, into buffer in one pass. Like snprintf the output is only
+     * complete (and NUL terminated) when the returned size is less than
+     * buffer_size.
+     *
+     * @param[in] body_size Size of the request body for Content-Length, or
+     *                      HTTP_CHUNKED_BODY_SIZE for a chunked body
+     * @return Size of the complete request header
+     */
+    size_t build(size_t body_size, char* buffer, size_t buffer_size);
 
 private:
+    char* find_header(const char* key, size_t key_length);
+    void remove_header(const char* key);
+
     http_method _method;
     ParsedUrl* _parsed_url;
     
-    KEYVALUE *headers;
+    // Header lines "KEY: VALUE\r\n" back to back in a single allocation
+    char* _headers;
+    size_t _headers_length;
+    size_t _headers_capacity;
 };
 
 #endif // _HTTP_HEADER_BUILDER_H_
@@ -116,6 +116,11 @@ void HttpResponseParser::finish()
     http_parser_execute(parser, settings, NULL, 0);
 }
 
+bool HttpResponseParser::should_keep_alive()
+{
+    return http_should_keep_alive(parser) != 0;
+}
+
 int HttpResponseParser::on_message_begin(http_parser* parser)
 {
     return 0;
@@ -146,6 +151,12 @@ int HttpResponseParser::on_header_value(http_parser* parser, const char *at, siz
 
 int HttpResponseParser::on_headers_complete(http_parser* parser)
 {
+    // Size the body once when the server tells how long it is
+    if (!body_callback && !(parser->flags & F_CHUNKED)
+        && parser->content_length > 0 && parser->content_length <= HTTP_BODY_PREALLOCATE_LIMIT)
+    {
+        response->reserve_body((size_t)parser->content_length);
+    }
     return 0;
 }
 
@@ -32,6 +32,12 @@ public:
 
     void finish();
 
+    /**
+     * Whether the connection may carry another request once this response
+     * is complete (HTTP/1.1 keep-alive and a delimited body).
+     */
+    bool should_keep_alive();
+
 public:
     // Member functions
     int on_message_begin(http_parser* parser);
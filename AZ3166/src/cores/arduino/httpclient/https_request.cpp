@@ -16,12 +16,18 @@
  */
 #include "https_request.h"
 #include "http_response_parser.h"
+#include "http_connection_pool.h"
+
+// "XXXXXXXX\r\n" in front of every chunk of a chunked body
+#define CHUNK_HEADER_SIZE   10
+// Least body data worth sending in the same write as the request header
+#define STREAM_MIN_DATA     64
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 // Class
 /**
  * HttpsRequest Constructor
- * Initializes the TCP socket, sets up event handlers and flags.
+ * Sets up event handlers and flags, the connection is opened by send().
  *
  * @param[in] net_iface The network interface
  * @param[in] ssl_ca_pem String containing the trusted CAs
@@ -42,11 +48,24 @@ HttpsRequest::HttpsRequest(NetworkInterface* net_iface,
     _tlssocket = NULL;
     _headerBuilder = NULL;
     _response = NULL;
+    _body_buffer = NULL;
+    _body_buffer_size = 0;
+    _net_iface = net_iface;
+    _ssl_ca_pem = ssl_ca_pem;
+    _keep_alive = false;
+    _send_buffer = NULL;
+    _send_buffer_size = 0;
+    _header_filter = NULL;
+    _header_filter_count = -1;
     _error = NSAPI_ERROR_OK;
 
     _parsed_url = new ParsedUrl(url);
-    _tlssocket = new TLSSocket(ssl_ca_pem, net_iface);
     _headerBuilder = new HttpHeaderBuilder(method, _parsed_url);
+    _send_buffer = (char*)malloc(HTTP_SEND_BUFFER_SIZE);
+    if (_send_buffer != NULL)
+    {
+        _send_buffer_size = HTTP_SEND_BUFFER_SIZE;
+    }
 }
 
     /**
@@ -73,6 +92,11 @@ HttpsRequest::~HttpsRequest()
     {
         delete _headerBuilder;
     }
+
+    if (_send_buffer)
+    {
+        free(_send_buffer);
+    }
 }
 
 /**
@@ -85,53 +109,122 @@ HttpsRequest::~HttpsRequest()
  */
 HttpResponse* HttpsRequest::send(const void* body, size_t body_size) 
 {
-    if (body == NULL)
+    if (body == NULL && !_body_producer)
     {
         body_size = 0;
     }
-	
-	// Connect to the HTTP(S) server
-    _error = _tlssocket->connect(_parsed_url->host(), _parsed_url->port());
-    if (_error != NSAPI_ERROR_OK)
+
+    for (int attempt = 0; attempt < 2; attempt++)
     {
-        ERROR("Failed to connect");
-        return NULL;
+        bool reused = false;
+        // A streamed body cannot be replayed, so it never goes out on a
+        // pooled connection that might turn out to be stale
+        if (_keep_alive && !_body_producer)
+        {
+            _tlssocket = HttpConnectionPool::acquire(_ssl_ca_pem, _parsed_url->host(), _parsed_url->port());
+            reused = (_tlssocket != NULL);
+        }
+        if (!reused)
+        {
+            // Connect to the HTTP(S) server
+            _tlssocket = new TLSSocket(_ssl_ca_pem, _net_iface);
+            _error = _tlssocket->connect(_parsed_url->host(), _parsed_url->port());
+            if (_error != NSAPI_ERROR_OK)
+            {
+                ERROR("Failed to connect");
+                close_socket(false);
+                return NULL;
+            }
+        }
+
+        bool received = false;
+        HttpResponse* response = exchange(body, body_size, received);
+        // The server closed the connection before any byte of a response: end
+        // of stream on a plain socket, an EOF or socket error on a TLS one
+        bool closed = !received && (response != NULL
+            || _error == MBEDTLS_ERR_SSL_CONN_EOF || _error == -1);
+        // Anything else, e.g. a server that is only slow and may still act on
+        // the request, is not sent again
+        if (!reused || !closed)
+        {
+            return response;
+        }
+        // The server closed the pooled connection while it was idle, so try
+        // once more on a new one
+        INFO("Pooled connection is stale, reconnecting");
     }
-    
-    /* Send the HTTP header */
-    size_t request_size = 0;
-    char* request = _headerBuilder->build(body_size, request_size);
-    _error = _tlssocket->send(request, request_size);
-    if ((size_t)_error != request_size)
-    {
-        ERROR("Failed to send the HTTP header");
-        _tlssocket->close();
-        return NULL;
+    return NULL;
+}
+
+HttpResponse* HttpsRequest::exchange(const void* body, size_t body_size, bool &received)
+{
+    /* Build the HTTP header in the send buffer, growing it if it is too small */
+    size_t header_size = _headerBuilder->build(body_size, _send_buffer, _send_buffer_size);
+    if (header_size >= _send_buffer_size)
+    {
+        if (_send_buffer)
+        {
+            free(_send_buffer);
+        }
+        _send_buffer_size = header_size + 1;
+        _send_buffer = (char*)malloc(_send_buffer_size);
+        if (_send_buffer == NULL)
+        {
+            ERROR("malloc failed");
+            _send_buffer_size = 0;
+            _error = NSAPI_ERROR_NO_MEMORY;
+            close_socket(false);
+            return NULL;
+        }
+        _headerBuilder->build(body_size, _send_buffer, _send_buffer_size);
     }
-    _headerBuilder->free_headers(request);
-    
-    /* Send body */
-    char *send_buf = (char *)body;
-    while (body_size > 0) 
+
+    if (_body_producer)
     {
-        size_t send_size = body_size < 4000 ? body_size : 4000; 
-        _error = _tlssocket->send(send_buf, send_size);
-        if (_error < 0)
+        if (!send_streamed_body(header_size, body_size))
         {
             ERROR("Failed to send the HTTP body");
-            _tlssocket->close();
+            if (_error >= 0)
+            {
+                // The producer gave up or misbehaved
+                _error = NSAPI_ERROR_PARAMETER;
+            }
+            close_socket(false);
             return NULL;
         }
-        
-        body_size -= send_size;
-        send_buf += send_size;
     }
-    _error = _tlssocket->send((const unsigned char *)"\r\n", 2);
-    if (_error < 0)
+    else
     {
-        ERROR("Failed to send the ending");
-        _tlssocket->close();
-        return NULL;
+        /* Send the header together with as much of the body as fits, so small
+           requests go out in a single TLS record */
+        size_t coalesced = _send_buffer_size - header_size;
+        if (coalesced > body_size)
+        {
+            coalesced = body_size;
+        }
+        if (coalesced > 0)
+        {
+            memcpy(_send_buffer + header_size, body, coalesced);
+        }
+        _error = _tlssocket->send(_send_buffer, header_size + coalesced);
+        if ((size_t)_error != header_size + coalesced)
+        {
+            ERROR("Failed to send the HTTP header");
+            close_socket(false);
+            return NULL;
+        }
+    
+        /* Send the rest of the body straight from the caller's buffer */
+        if (body_size > coalesced)
+        {
+            _error = _tlssocket->send((const char*)body + coalesced, body_size - coalesced);
+            if (_error < 0)
+            {
+                ERROR("Failed to send the HTTP body");
+                close_socket(false);
+                return NULL;
+            }
+        }
     }
     
     // Create a response object
@@ -140,6 +233,14 @@ HttpResponse* HttpsRequest::send(const void* body, size_t body_size)
         delete _response;
     }
     _response = new HttpResponse();
+    if (_body_buffer != NULL)
+    {
+        _response->set_body_buffer(_body_buffer, _body_buffer_size);
+    }
+    if (_header_filter_count >= 0)
+    {
+        _response->set_header_filter(_header_filter, _header_filter_count);
+    }
     // And a response parser
     HttpResponseParser parser(_response, _body_callback);
 
@@ -150,6 +251,8 @@ HttpResponse* HttpsRequest::send(const void* body, size_t body_size)
     int recved = 0;
     while ((recved = _tlssocket->recv((unsigned char *)recv_buffer, HTTP_RECEIVE_BUFFER_SIZE)) > 0) 
     {
+        received = true;
+
         // Don't know if this is actually needed, but OK
         size_t _bpos = static_cast<size_t>(recved);
         recv_buffer[_bpos] = 0;
@@ -159,7 +262,7 @@ HttpResponse* HttpsRequest::send(const void* body, size_t body_size)
         {
             ERROR("parser_error");
             _error = -2101;
-            _tlssocket->close();
+            close_socket(false);
             delete [] recv_buffer;
             return NULL;
         }
@@ -169,11 +272,12 @@ HttpResponse* HttpsRequest::send(const void* body, size_t body_size)
         }
     }
     parser.finish();
-    _tlssocket->close();
+    close_socket(_response->is_message_complete() && parser.should_keep_alive());
     delete [] recv_buffer;
     
     if (recved < 0) 
     {
+        _error = recved;
         return NULL;
     }
     else
@@ -182,6 +286,125 @@ HttpResponse* HttpsRequest::send(const void* body, size_t body_size)
     }
 }
 
+HttpResponse* HttpsRequest::send_stream(Callback<int(char *buffer, size_t size)> body_producer, int body_size)
+{
+    _body_producer = body_producer;
+    HttpResponse* response = send(NULL, body_size < 0 ? HTTP_CHUNKED_BODY_SIZE : (size_t)body_size);
+    _body_producer = 0;
+    return response;
+}
+
+/**
+ * Pull the body from the producer through the send buffer, starting right
+ * after the used bytes of request header already in it, and send it one
+ * full buffer at a time.
+ */
+bool HttpsRequest::send_streamed_body(size_t used, size_t body_size)
+{
+    bool chunked = (body_size == HTTP_CHUNKED_BODY_SIZE);
+    // Chunk header and trailing "\r\n", plus room for the last chunk
+    size_t overhead = chunked ? CHUNK_HEADER_SIZE + 2 + 5 : 0;
+    bool done = false;
+    while (!done)
+    {
+        if (_send_buffer_size - used < overhead + STREAM_MIN_DATA)
+        {
+            // No useful room left next to the header, send it on its own
+            _error = _tlssocket->send(_send_buffer, used);
+            if ((size_t)_error != used)
+            {
+                return false;
+            }
+            used = 0;
+            if (_send_buffer_size < overhead + STREAM_MIN_DATA)
+            {
+                return false;
+            }
+        }
+
+        size_t start = used + (chunked ? CHUNK_HEADER_SIZE : 0);
+        size_t room = _send_buffer_size - used - overhead;
+        if (!chunked && room > body_size)
+        {
+            room = body_size;
+        }
+
+        // Fill the buffer so small pieces from the producer share a TLS record
+        size_t filled = 0;
+        bool ended = false;
+        while (filled < room)
+        {
+            int produced = _body_producer(_send_buffer + start + filled, room - filled);
+            if (produced < 0 || (size_t)produced > room - filled)
+            {
+                return false;
+            }
+            if (produced == 0)
+            {
+                ended = true;
+                break;
+            }
+            filled += produced;
+        }
+
+        if (chunked)
+        {
+            if (filled > 0)
+            {
+                // Fixed width size so the chunk header fits the space left for it
+                char chunk_header[CHUNK_HEADER_SIZE + 1];
+                snprintf(chunk_header, sizeof(chunk_header), "%08x\r\n", (unsigned int)filled);
+                memcpy(_send_buffer + used, chunk_header, CHUNK_HEADER_SIZE);
+                memcpy(_send_buffer + start + filled, "\r\n", 2);
+                used = start + filled + 2;
+            }
+            if (ended)
+            {
+                // Last chunk and the end of the (empty) trailer
+                memcpy(_send_buffer + used, "0\r\n\r\n", 5);
+                used += 5;
+                done = true;
+            }
+        }
+        else
+        {
+            body_size -= filled;
+            if (ended && body_size > 0)
+            {
+                ERROR("Body producer ended before Content-Length");
+                return false;
+            }
+            used = start + filled;
+            done = (body_size == 0);
+        }
+
+        _error = _tlssocket->send(_send_buffer, used);
+        if ((size_t)_error != used)
+        {
+            return false;
+        }
+        used = 0;
+    }
+    return true;
+}
+
+void HttpsRequest::close_socket(bool keep_alive)
+{
+    if (_tlssocket == NULL)
+    {
+        return;
+    }
+    // A streamed request never takes a pooled connection, so it doesn't give one back either
+    if (keep_alive && _keep_alive && !_body_producer)
+    {
+        HttpConnectionPool::release(_tlssocket, _ssl_ca_pem, _parsed_url->host(), _parsed_url->port());
+    }
+    else
+    {
+        delete _tlssocket;
+    }
+    _tlssocket = NULL;
+}
 
 /**
  * Set a header for the request.
@@ -197,6 +420,43 @@ void HttpsRequest::set_header(const char* key, const char* value)
     _headerBuilder->set_header(key, value);
 }
 
+/**
+ * Allow the connection to be kept open and reused by later requests to the
+ * same server. Off by default, an idle TLS connection holds its record
+ * buffers until it is reused or times out.
+ *
+ * @param[in] keep_alive false to close the connection after every response
+ */
+void HttpsRequest::set_keep_alive(bool keep_alive)
+{
+    _keep_alive = keep_alive;
+    _headerBuilder->set_header("Connection", keep_alive ? "keep-alive" : "close");
+}
+
+/**
+ * Keep only the listed response headers.
+ *
+ * @param[in] names Header names, must stay valid while responses are used
+ * @param[in] count Number of names, 0 to skip every header
+ */
+void HttpsRequest::set_header_filter(const char* const* names, int count)
+{
+    _header_filter = names;
+    _header_filter_count = count;
+}
+
+/**
+ * Receive the response body into a caller owned buffer instead of the heap.
+ *
+ * @param[in] buffer Buffer for the body, must outlive the response
+ * @param[in] size Size of buffer in bytes
+ */
+void HttpsRequest::set_body_buffer(char* buffer, size_t size)
+{
+    _body_buffer = buffer;
+    _body_buffer_size = size;
+}
+
 /**
  * Get the error code.
  *
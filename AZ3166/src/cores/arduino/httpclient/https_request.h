@@ -33,7 +33,7 @@ class HttpsRequest
 public:
     /**
      * HttpsRequest Constructor
-     * Initializes the TCP socket, sets up event handlers and flags.
+     * Sets up event handlers and flags, the connection is opened by send().
      *
      * @param[in] net_iface The network interface
      * @param[in] ssl_ca_pem String containing the trusted CAs
@@ -63,6 +63,19 @@ public:
      *         See get_error() for the error code.
      */
     HttpResponse* send(const void* body = NULL, nsapi_size_t body_size = 0);
+
+    /**
+     * Execute the HTTPS request, pulling the request body from a producer
+     * instead of memory, so uploads of any size run in constant memory.
+     *
+     * @param[in] body_producer Called to fill buffer with up to size bytes of
+     *                          body, returns the bytes written, 0 at the end
+     *                          of the body or a negative value to abort.
+     * @param[in] body_size Size of the body, or -1 if unknown in which case it
+     *                      is sent with chunked transfer encoding
+     * @return An HttpResponse pointer on success, or NULL on failure.
+     */
+    HttpResponse* send_stream(Callback<int(char *buffer, size_t size)> body_producer, int body_size = -1);
     
     /**
      * Set a header for the request.
@@ -75,6 +88,32 @@ public:
      */
     void set_header(const char* key, const char* value);
 
+    /**
+     * Receive the response body into a caller owned buffer instead of the heap.
+     * Bodies longer than size - 1 bytes are truncated, see
+     * HttpResponse::is_body_truncated(). Ignored when a body callback is set.
+     *
+     * @param[in] buffer Buffer for the body, must outlive the response
+     * @param[in] size Size of buffer in bytes
+     */
+    void set_body_buffer(char* buffer, size_t size);
+
+    /**
+     * Allow the connection to be kept open and reused by later requests to
+     * the same server, see HttpConnectionPool. Off by default.
+     *
+     * @param[in] keep_alive false to close the connection after every response
+     */
+    void set_keep_alive(bool keep_alive);
+
+    /**
+     * Keep only the listed response headers, see HttpResponse::set_header_filter().
+     *
+     * @param[in] names Header names, must stay valid while responses are used
+     * @param[in] count Number of names, 0 to skip every header
+     */
+    void set_header_filter(const char* const* names, int count);
+
     /**
      * Get the error code.
      *
@@ -83,12 +122,26 @@ public:
     nsapi_error_t get_error();
     
 private:
+    HttpResponse* exchange(const void* body, nsapi_size_t body_size, bool &received);
+    bool send_streamed_body(size_t used, size_t body_size);
+    void close_socket(bool keep_alive);
+
+    NetworkInterface *_net_iface;
+    const char *_ssl_ca_pem;
+    bool _keep_alive;
+    char *_send_buffer;
+    size_t _send_buffer_size;
+    Callback<int(char *buffer, size_t size)> _body_producer;
+    const char* const* _header_filter;
+    int _header_filter_count;
     ParsedUrl *_parsed_url;
     TLSSocket *_tlssocket;
     HttpHeaderBuilder *_headerBuilder;
     
     Callback<void(const char *at, size_t length)> _body_callback;
     HttpResponse* _response;
+    char* _body_buffer;
+    size_t _body_buffer_size;
     
     nsapi_error_t _error;
 };
@@ -0,0 +1,200 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#include "Arduino.h"
+#include "DeferredLog.h"
+#include "mbed_critical.h"
+#include "SerialLog.h"
+#include "xprintf.h"
+
+#define STACK_SIZE          0xC00
+#define SLOT_MAX_ARGS       8
+#define SLOT_MASK           (DEFERRED_LOG_SLOT_COUNT - 1)
+#define LOG_SIGNAL          0x1
+#define IDLE_WAIT_MS        100
+
+#if (DEFERRED_LOG_SLOT_COUNT & SLOT_MASK) != 0
+#error "DEFERRED_LOG_SLOT_COUNT must be a power of two"
+#endif
+
+// A record is published by storing its ring position + 1 in seq, so the log
+// thread can tell a finished record from one still being filled or from the
+// previous lap.
+typedef struct
+{
+    volatile uint32_t seq;
+    const char *format;
+    const char *file;
+    uint32_t time;
+    uint16_t line;
+    uint8_t level;
+    uint8_t options;
+    int arg_count;
+    XPRINTF_ARG args[SLOT_MAX_ARGS];
+    char strings[DEFERRED_LOG_STRINGS_SIZE];
+} LOG_SLOT;
+
+static LOG_SLOT *slots = NULL;
+static volatile uint32_t claim_pos = 0;     // next slot a producer claims
+static volatile uint32_t drain_pos = 0;     // next slot the log thread formats
+static DEFERRED_LOG_STATS log_stats;
+static Thread *log_thread = NULL;
+
+static size_t serial_sink(void *context, const char *data, size_t len)
+{
+    return Serial.write((const uint8_t *)data, len);
+}
+
+static void write_header(uint8_t level, time_t t, const char *file, int line)
+{
+    struct tm tm_info;
+    char ct[26];
+
+    if (level == DEFERRED_LOG_RAW)
+    {
+        return;
+    }
+    gmtime_r(&t, &tm_info);
+    strftime(ct, sizeof(ct), "%Y-%m-%d %H:%M:%S", &tm_info);
+    if (level == DEFERRED_LOG_INFO)
+    {
+        serial_xlog("%s INFO:  ", ct);
+    }
+    else
+    {
+        serial_xlog("%s ERROR: %s (ln %d): ", ct, file, line);
+    }
+}
+
+static void log_worker(void)
+{
+    while (true)
+    {
+        LOG_SLOT *slot = &slots[drain_pos & SLOT_MASK];
+        if (slot->seq != drain_pos + 1)
+        {
+            Thread::signal_wait(LOG_SIGNAL, IDLE_WAIT_MS);
+            continue;
+        }
+        __DMB();
+
+        write_header(slot->level, (time_t)slot->time, slot->file, slot->line);
+        xaprintf(serial_sink, NULL, slot->format, slot->args, slot->arg_count);
+        if (slot->options & DEFERRED_LOG_LINE)
+        {
+            serial_log("\r\n");
+        }
+
+        __DMB();
+        drain_pos = drain_pos + 1;
+    }
+}
+
+void deferred_log_start(void)
+{
+    if (log_thread != NULL)
+    {
+        return;
+    }
+    // seq of every slot starts at 0, no record published yet
+    slots = (LOG_SLOT *)calloc(DEFERRED_LOG_SLOT_COUNT, sizeof(LOG_SLOT));
+    if (slots == NULL)
+    {
+        return;
+    }
+    Thread *thread = new Thread(osPriorityLow, STACK_SIZE, NULL);
+    thread->start(log_worker);
+    __DMB();
+    log_thread = thread;
+}
+
+void deferred_vlog(DEFERRED_LOG_LEVEL level, const char *file, int line, unsigned int options, const char *format, va_list arg)
+{
+    if (format == NULL)
+    {
+        return;
+    }
+
+    if (log_thread == NULL)
+    {
+        // not started, format on the calling thread
+        write_header(level, time(NULL), file, line);
+        xvprintf(serial_sink, NULL, format, arg);
+        if (options & DEFERRED_LOG_LINE)
+        {
+            serial_log("\r\n");
+        }
+        return;
+    }
+
+    // claim a slot without locking, give up if the ring is full
+    uint32_t pos = claim_pos;
+    do
+    {
+        if (pos - drain_pos >= DEFERRED_LOG_SLOT_COUNT)
+        {
+            core_util_atomic_incr_u32(&log_stats.dropped, 1);
+            return;
+        }
+    } while (!core_util_atomic_cas_u32((uint32_t *)&claim_pos, &pos, pos + 1));
+
+    LOG_SLOT *slot = &slots[pos & SLOT_MASK];
+    slot->format = format;
+    slot->file = file;
+    slot->time = (uint32_t)time(NULL);
+    slot->line = line;
+    slot->level = level;
+    slot->options = options;
+    slot->arg_count = xvcapture(format, arg, slot->args, SLOT_MAX_ARGS, slot->strings, sizeof(slot->strings));
+    __DMB();
+    slot->seq = pos + 1;
+
+    uint32_t pending = pos + 1 - drain_pos;
+    core_util_atomic_incr_u32(&log_stats.logged, 1);
+    if (pending > log_stats.max_pending)
+    {
+        log_stats.max_pending = pending;
+    }
+    log_thread->signal_set(LOG_SIGNAL);
+}
+
+void deferred_log(DEFERRED_LOG_LEVEL level, const char *format, ...)
+{
+    va_list arg;
+    va_start(arg, format);
+    deferred_vlog(level, "", 0, DEFERRED_LOG_LINE, format, arg);
+    va_end(arg);
+}
+
+void deferred_log_at(DEFERRED_LOG_LEVEL level, const char *file, int line, const char *format, ...)
+{
+    va_list arg;
+    va_start(arg, format);
+    deferred_vlog(level, file, line, DEFERRED_LOG_LINE, format, arg);
+    va_end(arg);
+}
+
+void deferred_log_flush(void)
+{
+    if (log_thread == NULL)
+    {
+        return;
+    }
+    uint32_t target = claim_pos;
+    while ((int32_t)(drain_pos - target) < 0)
+    {
+        log_thread->signal_set(LOG_SIGNAL);
+        wait_ms(1);
+    }
+}
+
+void deferred_log_get_stats(DEFERRED_LOG_STATS *stats)
+{
+    if (stats == NULL)
+    {
+        return;
+    }
+    core_util_critical_section_enter();
+    *stats = log_stats;
+    core_util_critical_section_exit();
+}
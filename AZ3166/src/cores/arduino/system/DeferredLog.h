@@ -0,0 +1,81 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __DEFERRED_LOG_H__
+#define __DEFERRED_LOG_H__
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of records the RAM ring can hold, must be a power of two. The ring is
+// allocated by deferred_log_start(), each record takes about 220 bytes
+#ifndef DEFERRED_LOG_SLOT_COUNT
+#define DEFERRED_LOG_SLOT_COUNT 8
+#endif
+
+// Bytes each record keeps for copies of its %s arguments, longer ones are
+// cut and end with "..."
+#ifndef DEFERRED_LOG_STRINGS_SIZE
+#define DEFERRED_LOG_STRINGS_SIZE 128
+#endif
+
+// Terminate the record with "\r\n", same meaning as LOG_LINE in xlogging
+#define DEFERRED_LOG_LINE       0x01
+
+typedef enum
+{
+    DEFERRED_LOG_INFO,
+    DEFERRED_LOG_ERROR,
+    DEFERRED_LOG_RAW        // no timestamp header, e.g. IoT SDK trace output
+} DEFERRED_LOG_LEVEL;
+
+typedef struct
+{
+    uint32_t logged;        // records accepted into the ring
+    uint32_t dropped;       // records lost because the ring was full
+    uint32_t max_pending;   // most records ever waiting to be formatted
+} DEFERRED_LOG_STATS;
+
+/**
+ * Allocate the ring and start the low priority thread that formats recorded
+ * logs to Serial. Until this is called, or if it fails, every log call is
+ * formatted on the calling thread.
+ * DevKitMQTTClient_Init() calls it; other users opt in by calling it once.
+ */
+void deferred_log_start(void);
+
+/**
+ * Record a log entry. Only the format pointer and the raw arguments are
+ * copied (%s strings up to DEFERRED_LOG_STRINGS_SIZE); formatting happens
+ * later on the log thread, or right away if it has not been started.
+ * A record that finds the ring full is dropped and counted in
+ * DEFERRED_LOG_STATS.dropped, so a burst of logs, such as the IoT SDK trace
+ * when logtrace is on, loses lines instead of blocking the caller.
+ * @param level     DEFERRED_LOG_INFO, DEFERRED_LOG_ERROR or DEFERRED_LOG_RAW.
+ * @param file      Source file shown for errors, must be a string literal.
+ * @param line      Source line shown for errors.
+ * @param options   DEFERRED_LOG_LINE or 0.
+ * @param format    printf format, must stay valid (a string literal).
+ */
+void deferred_vlog(DEFERRED_LOG_LEVEL level, const char *file, int line, unsigned int options, const char *format, va_list arg);
+
+void deferred_log(DEFERRED_LOG_LEVEL level, const char *format, ...);
+
+void deferred_log_at(DEFERRED_LOG_LEVEL level, const char *file, int line, const char *format, ...);
+
+/**
+ * Wait until everything recorded so far has been written out.
+ */
+void deferred_log_flush(void);
+
+void deferred_log_get_stats(DEFERRED_LOG_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __DEFERRED_LOG_H__
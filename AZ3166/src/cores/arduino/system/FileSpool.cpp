@@ -0,0 +1,406 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#include "mbed.h"
+#include "CheckSumUtils.h"
+#include "FileSpool.h"
+
+#define SEGMENT_MAGIC       0x4C505353  // "SSPL"
+#define RECORD_MAGIC        0x5352      // "RS"
+#define SCAN_CHUNK_SIZE     64
+// create_segment found a segment open() did not see, the files must be scanned again
+#define SEGMENT_FOUND       1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+} SEGMENT_HEADER;
+
+typedef struct
+{
+    uint16_t magic;
+    uint16_t length;
+    uint16_t length_check;  // ~length, so a torn header is not taken for a length
+    uint16_t crc;           // CRC-16 of the data
+} RECORD_HEADER;
+
+static bool read_header(FILE *file, RECORD_HEADER *header)
+{
+    return (fread(header, sizeof(RECORD_HEADER), 1, file) == 1
+        && header->magic == RECORD_MAGIC
+        && header->length == (uint16_t)~header->length_check
+        && header->length > 0);
+}
+
+/**
+ * Check the record at the current position of file and move past it.
+ */
+static bool skip_record(FILE *file)
+{
+    RECORD_HEADER header;
+    if (!read_header(file, &header))
+    {
+        return false;
+    }
+
+    CRC16_Context context;
+    CRC16_Init(&context);
+    uint8_t chunk[SCAN_CHUNK_SIZE];
+    int left = header.length;
+    while (left > 0)
+    {
+        int size = left < SCAN_CHUNK_SIZE ? left : SCAN_CHUNK_SIZE;
+        if (fread(chunk, 1, size, file) != (size_t)size)
+        {
+            return false;
+        }
+        CRC16_Update(&context, chunk, size);
+        left -= size;
+    }
+
+    uint16_t crc;
+    CRC16_Final(&context, &crc);
+    return (crc == header.crc);
+}
+
+FileSpool::FileSpool(const char *path, int max_size)
+{
+    _path_length = strlen(path);
+    // Room for the ".0" / ".1" suffix
+    _path = (char *)malloc(_path_length + 3);
+    if (_path != NULL)
+    {
+        memcpy(_path, path, _path_length + 1);
+    }
+    _segment_size = max_size / 2;
+    _opened = false;
+    memset(_segments, 0, sizeof(_segments));
+    _next_seq = 1;
+    _read_segment = -1;
+    _read_offset = sizeof(SEGMENT_HEADER);
+    _write_segment = -1;
+}
+
+FileSpool::~FileSpool(void)
+{
+    free(_path);
+}
+
+const char* FileSpool::segment_path(int index)
+{
+    _path[_path_length] = '.';
+    _path[_path_length + 1] = '0' + index;
+    _path[_path_length + 2] = 0;
+    return _path;
+}
+
+/**
+ * Find the valid records of a segment file, it is considered missing if its
+ * header is not complete.
+ */
+void FileSpool::load_segment(int index)
+{
+    SEGMENT *segment = &_segments[index];
+    segment->seq = 0;
+    segment->end = sizeof(SEGMENT_HEADER);
+
+    FILE *file = fopen(segment_path(index), "rb");
+    if (file == NULL)
+    {
+        return;
+    }
+
+    SEGMENT_HEADER header;
+    if (fread(&header, sizeof(header), 1, file) == 1 && header.magic == SEGMENT_MAGIC && header.seq != 0)
+    {
+        segment->seq = header.seq;
+        // Stop at the first record that is torn or was never completed
+        while (skip_record(file))
+        {
+            segment->end = ftell(file);
+        }
+    }
+    fclose(file);
+}
+
+void FileSpool::open(void)
+{
+    if (_opened || _path == NULL)
+    {
+        return;
+    }
+    _opened = true;
+
+    load_segment(0);
+    load_segment(1);
+
+    _read_segment = -1;
+    _write_segment = -1;
+    if (_segments[0].seq != 0 && _segments[1].seq != 0)
+    {
+        _read_segment = (_segments[0].seq < _segments[1].seq) ? 0 : 1;
+        _write_segment = 1 - _read_segment;
+    }
+    else if (_segments[0].seq != 0 || _segments[1].seq != 0)
+    {
+        _read_segment = (_segments[0].seq != 0) ? 0 : 1;
+        _write_segment = _read_segment;
+    }
+    _next_seq = ((_segments[0].seq > _segments[1].seq) ? _segments[0].seq : _segments[1].seq) + 1;
+    _read_offset = sizeof(SEGMENT_HEADER);
+
+    release_consumed();
+}
+
+int FileSpool::create_segment(int index)
+{
+    SEGMENT_HEADER header = { SEGMENT_MAGIC, _next_seq };
+
+    // The file system may not have been mounted yet when open() scanned,
+    // a segment with records from before must never be truncated
+    FILE *file = fopen(segment_path(index), "rb");
+    if (file != NULL)
+    {
+        bool found = (fread(&header, sizeof(header), 1, file) == 1 && header.magic == SEGMENT_MAGIC && header.seq != 0);
+        fclose(file);
+        if (found)
+        {
+            return SEGMENT_FOUND;
+        }
+        header.magic = SEGMENT_MAGIC;
+        header.seq = _next_seq;
+    }
+
+    file = fopen(segment_path(index), "wb");
+    if (file == NULL)
+    {
+        return FILE_SPOOL_ERROR_IO;
+    }
+    bool written = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if (fclose(file) != 0 || !written)
+    {
+        return FILE_SPOOL_ERROR_IO;
+    }
+
+    _segments[index].seq = _next_seq++;
+    _segments[index].end = sizeof(SEGMENT_HEADER);
+    return 0;
+}
+
+/**
+ * Make room for need more bytes in the write segment, starting the other
+ * segment when it is full.
+ */
+int FileSpool::prepare_write(uint32_t need)
+{
+    if (_write_segment >= 0 && _segments[_write_segment].end + need <= _segment_size)
+    {
+        return 0;
+    }
+
+    // Start the other segment, unless it still holds records to read
+    int next = (_write_segment < 0) ? 0 : 1 - _write_segment;
+    if (_segments[next].seq != 0)
+    {
+        return FILE_SPOOL_ERROR_FULL;
+    }
+    int result = create_segment(next);
+    if (result == 0)
+    {
+        if (_read_segment < 0)
+        {
+            _read_segment = next;
+            _read_offset = sizeof(SEGMENT_HEADER);
+        }
+        _write_segment = next;
+    }
+    return result;
+}
+
+/**
+ * Delete the segments whose records have all been popped, the whole file is
+ * dropped instead of rewriting a read position.
+ */
+void FileSpool::release_consumed(void)
+{
+    while (_read_segment >= 0 && _read_offset >= _segments[_read_segment].end)
+    {
+        int consumed = _read_segment;
+        if (consumed == _write_segment)
+        {
+            _read_segment = -1;
+            _write_segment = -1;
+        }
+        else
+        {
+            _read_segment = _write_segment;
+        }
+        _read_offset = sizeof(SEGMENT_HEADER);
+
+        remove(segment_path(consumed));
+        _segments[consumed].seq = 0;
+        _segments[consumed].end = sizeof(SEGMENT_HEADER);
+    }
+}
+
+int FileSpool::append(const void *data, int size)
+{
+    if (data == NULL || size <= 0 || size > FILE_SPOOL_MAX_RECORD)
+    {
+        return FILE_SPOOL_ERROR_PARAMETER;
+    }
+    uint32_t need = sizeof(RECORD_HEADER) + size;
+
+    _mutex.lock();
+    open();
+
+    int result = 0;
+    if (_path == NULL)
+    {
+        result = FILE_SPOOL_ERROR_IO;
+    }
+    else if (sizeof(SEGMENT_HEADER) + need > _segment_size)
+    {
+        result = FILE_SPOOL_ERROR_FULL;
+    }
+    else
+    {
+        result = prepare_write(need);
+        if (result == SEGMENT_FOUND)
+        {
+            // Pick up the records left from before, the read position starts over
+            _opened = false;
+            open();
+            result = prepare_write(need);
+            if (result == SEGMENT_FOUND)
+            {
+                result = FILE_SPOOL_ERROR_IO;
+            }
+        }
+    }
+
+    if (result == 0)
+    {
+        RECORD_HEADER header;
+        CRC16_Context context;
+        CRC16_Init(&context);
+        CRC16_Update(&context, data, size);
+        CRC16_Final(&context, &header.crc);
+        header.magic = RECORD_MAGIC;
+        header.length = size;
+        header.length_check = ~header.length;
+
+        // Write after the last valid record, over whatever a power loss left there
+        SEGMENT *segment = &_segments[_write_segment];
+        FILE *file = fopen(segment_path(_write_segment), "r+b");
+        if (file == NULL)
+        {
+            result = FILE_SPOOL_ERROR_IO;
+        }
+        else
+        {
+            bool written = (fseek(file, segment->end, SEEK_SET) == 0
+                && fwrite(&header, sizeof(header), 1, file) == 1
+                && fwrite(data, 1, size, file) == (size_t)size);
+            if (fclose(file) != 0 || !written)
+            {
+                result = FILE_SPOOL_ERROR_IO;
+            }
+            else
+            {
+                segment->end += need;
+            }
+        }
+    }
+
+    _mutex.unlock();
+    return result;
+}
+
+/**
+ * Get the length of the record at the read position, the file is left
+ * closed. Must be called with the mutex held and the spool not empty.
+ */
+int FileSpool::read_length(void)
+{
+    FILE *file = fopen(segment_path(_read_segment), "rb");
+    if (file == NULL)
+    {
+        return FILE_SPOOL_ERROR_IO;
+    }
+    RECORD_HEADER header;
+    bool valid = (fseek(file, _read_offset, SEEK_SET) == 0 && read_header(file, &header));
+    fclose(file);
+    return valid ? header.length : FILE_SPOOL_ERROR_IO;
+}
+
+int FileSpool::peek(void *buffer, int size)
+{
+    _mutex.lock();
+    open();
+
+    int result = 0;
+    if (_read_segment >= 0)
+    {
+        FILE *file = fopen(segment_path(_read_segment), "rb");
+        if (file == NULL)
+        {
+            result = FILE_SPOOL_ERROR_IO;
+        }
+        else
+        {
+            RECORD_HEADER header;
+            if (fseek(file, _read_offset, SEEK_SET) != 0 || !read_header(file, &header))
+            {
+                result = FILE_SPOOL_ERROR_IO;
+            }
+            else if (buffer == NULL || size < header.length)
+            {
+                result = header.length;
+            }
+            else if (fread(buffer, 1, header.length, file) != header.length)
+            {
+                result = FILE_SPOOL_ERROR_IO;
+            }
+            else
+            {
+                result = header.length;
+            }
+            fclose(file);
+        }
+    }
+
+    _mutex.unlock();
+    return result;
+}
+
+int FileSpool::pop(void)
+{
+    _mutex.lock();
+    open();
+
+    int result = 0;
+    if (_read_segment >= 0)
+    {
+        result = read_length();
+        if (result > 0)
+        {
+            _read_offset += sizeof(RECORD_HEADER) + result;
+            release_consumed();
+            result = 0;
+        }
+    }
+
+    _mutex.unlock();
+    return result;
+}
+
+bool FileSpool::empty(void)
+{
+    _mutex.lock();
+    open();
+    bool result = (_read_segment < 0);
+    _mutex.unlock();
+    return result;
+}
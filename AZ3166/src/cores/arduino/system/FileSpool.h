@@ -0,0 +1,96 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __FILE_SPOOL_H__
+#define __FILE_SPOOL_H__
+
+#include "mbed.h"
+
+// Default bound of the spool on the file system, in bytes
+#ifndef FILE_SPOOL_MAX_SIZE
+#define FILE_SPOOL_MAX_SIZE         (32 * 1024)
+#endif
+
+// Longest record, the length is stored on 16 bits
+#define FILE_SPOOL_MAX_RECORD       0xFFFF
+
+#define FILE_SPOOL_ERROR_PARAMETER  -1
+#define FILE_SPOOL_ERROR_FULL       -2
+#define FILE_SPOOL_ERROR_IO         -3
+
+/** Append-only queue of records kept in files, so data survives a reboot.
+ *
+ * The file system (e.g. FATFileSystem on SFlashBlockDevice) must be mounted
+ * by the application. Records go to two segment files, "<path>.0" and
+ * "<path>.1": appends fill the newest one and a segment is deleted once all
+ * its records have been popped, so nothing is ever rewritten in place. Each
+ * record carries a length and a CRC, a record torn by a power loss ends the
+ * segment and is written over by the next append.
+ *
+ * The read position is only kept in RAM, after a reboot the records not yet
+ * popped from the oldest segment are delivered again (at least once). The
+ * files are first scanned on first use, a segment missed because the file
+ * system was mounted later is found again before the next append.
+ */
+class FileSpool
+{
+public:
+    /**
+     * @param path      Base path of the segment files, e.g. "/fs/telemetry".
+     * @param max_size  Most bytes the segments can take together.
+     */
+    FileSpool(const char *path, int max_size = FILE_SPOOL_MAX_SIZE);
+    virtual ~FileSpool(void);
+
+    /**
+     * Add a record after the newest one.
+     * @return 0 on success, FILE_SPOOL_ERROR_FULL if it doesn't fit or
+     *         another negative error code.
+     */
+    int append(const void *data, int size);
+
+    /**
+     * Read the oldest record without removing it. The record is copied only
+     * when buffer is big enough, so the call can be made with a NULL buffer
+     * first to get the size.
+     * @return The size of the record, 0 if the spool is empty or a negative
+     *         error code.
+     */
+    int peek(void *buffer, int size);
+
+    /**
+     * Remove the oldest record.
+     * @return 0 on success or a negative error code.
+     */
+    int pop(void);
+
+    bool empty(void);
+
+private:
+    typedef struct
+    {
+        uint32_t seq;       // 0 when the segment doesn't exist
+        uint32_t end;       // offset after the last valid record
+    } SEGMENT;
+
+    void open(void);
+    void load_segment(int index);
+    int create_segment(int index);
+    int prepare_write(uint32_t need);
+    void release_consumed(void);
+    int read_length(void);
+    const char* segment_path(int index);
+
+    char *_path;
+    int _path_length;
+    uint32_t _segment_size;
+    bool _opened;
+    SEGMENT _segments[2];
+    uint32_t _next_seq;
+    int _read_segment;      // -1 when the spool is empty
+    uint32_t _read_offset;
+    int _write_segment;     // -1 when no segment exists
+    Mutex _mutex;
+};
+
+#endif  // __FILE_SPOOL_H__
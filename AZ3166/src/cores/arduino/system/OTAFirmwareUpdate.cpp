@@ -35,6 +35,8 @@ int OTADownloadFirmware(const char *url, uint16_t * crc16Checksum, const char* s
     CRC16_Init(&contexCRC16);
 
     HTTPClient client = ssl_ca_pem ? HTTPClient(ssl_ca_pem, HTTP_GET, url, getFwCallback) : HTTPClient(HTTP_GET, url, getFwCallback);
+    // Only the status is used
+    client.set_header_filter(NULL, 0);
     const Http_Response *response = client.send(NULL, 0);
     if (response->status_code != 200)
     {
@@ -2,6 +2,7 @@
 // Licensed under the MIT license. 
 
 #include "Arduino.h"
+#include "xprintf.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,33 +16,17 @@ void serial_log(const char* msg)
     }
 }
 
+static size_t serial_sink(void *context, const char *data, size_t len)
+{
+    return Serial.write((const uint8_t*)data, len);
+}
+
 void serial_xlog(const char *format, ...)
 {
     va_list arg;
     va_start(arg, format);
-    char temp[64];
-    char* buffer = temp;
-    size_t len = vsnprintf(temp, sizeof(temp), format, arg);
+    xvprintf(serial_sink, NULL, format, arg);
     va_end(arg);
-    if (len > sizeof(temp) - 1)
-    {
-        buffer = new char[len + 1];
-        if (!buffer)
-        {
-            return;
-        }
-
-        va_start(arg, format);
-        vsnprintf(buffer, len + 1, format, arg);
-        va_end(arg);
-    }
-
-    Serial.print(buffer);
-    
-    if (buffer != temp)
-    {
-        delete[] buffer;
-    }
 }
 
 #ifdef __cplusplus
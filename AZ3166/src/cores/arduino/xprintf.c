@@ -0,0 +1,617 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+/*
+ * Streaming printf. Literal text and %s/%c arguments are copied straight to
+ * the sink (through a small chunk buffer), only numeric conversions go
+ * through snprintf one at a time so their output matches vsnprintf exactly,
+ * including %f.
+ *
+ * The same walk over the format either pulls arguments from a va_list, or
+ * records them (xvcapture), or replays recorded ones (xaprintf).
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include "xprintf.h"
+
+#define XPRINTF_CHUNK_SIZE  64
+#define XPRINTF_SPEC_SIZE   32
+
+typedef struct
+{
+    XPRINTF_SINK sink;
+    void *context;
+    size_t used;
+    size_t produced;
+    size_t accepted;
+    char buf[XPRINTF_CHUNK_SIZE];
+} XPRINTF_STATE;
+
+typedef enum
+{
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_INTMAX,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_PTR
+} ARG_TYPE;
+
+typedef struct
+{
+    va_list ap;                 // used when args is NULL
+    const XPRINTF_ARG *args;    // recorded arguments to replay
+    int count;
+    int next;
+    XPRINTF_ARG *capture;       // where to record arguments, if not NULL
+    int capture_max;
+    char *strings;
+    size_t strings_size;
+    size_t strings_used;
+} XPRINTF_SOURCE;
+
+static void flush_chunk(XPRINTF_STATE *state)
+{
+    if (state->used > 0)
+    {
+        state->accepted += state->sink(state->context, state->buf, state->used);
+        state->used = 0;
+    }
+}
+
+static void emit(XPRINTF_STATE *state, const char *data, size_t len)
+{
+    if (state->sink == NULL)
+    {
+        return;
+    }
+    state->produced += len;
+    if (len >= XPRINTF_CHUNK_SIZE)
+    {
+        // large pieces go to the sink without a copy
+        flush_chunk(state);
+        state->accepted += state->sink(state->context, data, len);
+        return;
+    }
+    if (state->used + len > XPRINTF_CHUNK_SIZE)
+    {
+        flush_chunk(state);
+    }
+    memcpy(state->buf + state->used, data, len);
+    state->used += len;
+}
+
+static void emit_fill(XPRINTF_STATE *state, char c, int count)
+{
+    if (state->sink == NULL)
+    {
+        return;
+    }
+    while (count-- > 0)
+    {
+        if (state->used == XPRINTF_CHUNK_SIZE)
+        {
+            flush_chunk(state);
+        }
+        state->buf[state->used++] = c;
+        state->produced++;
+    }
+}
+
+static void emit_padded(XPRINTF_STATE *state, const char *data, size_t len, int width, int left)
+{
+    int pad = width > (int)len ? width - (int)len : 0;
+    if (!left)
+    {
+        emit_fill(state, ' ', pad);
+    }
+    emit(state, data, len);
+    if (left)
+    {
+        emit_fill(state, ' ', pad);
+    }
+}
+
+static int append_uint(char *out, unsigned int value)
+{
+    char digits[10];
+    int n = 0;
+    int i;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    for (i = 0; i < n; i++)
+    {
+        out[i] = digits[n - 1 - i];
+    }
+    return n;
+}
+
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Pull the next argument from the va_list or the recorded array
+static int fetch(XPRINTF_SOURCE *src, ARG_TYPE type, XPRINTF_ARG *out)
+{
+    if (src->args != NULL)
+    {
+        if (src->next >= src->count)
+        {
+            return 0;
+        }
+        *out = src->args[src->next++];
+        return 1;
+    }
+
+    switch (type)
+    {
+    case ARG_INT:
+        out->i = va_arg(src->ap, int);
+        break;
+    case ARG_LONG:
+        out->i = va_arg(src->ap, long);
+        break;
+    case ARG_LLONG:
+        out->i = va_arg(src->ap, long long);
+        break;
+    case ARG_INTMAX:
+        out->i = va_arg(src->ap, intmax_t);
+        break;
+    case ARG_SIZE:
+        out->i = (long long)va_arg(src->ap, size_t);
+        break;
+    case ARG_PTRDIFF:
+        out->i = va_arg(src->ap, ptrdiff_t);
+        break;
+    case ARG_DOUBLE:
+        out->d = va_arg(src->ap, double);
+        break;
+    case ARG_LDOUBLE:
+        out->d = (double)va_arg(src->ap, long double);
+        break;
+    case ARG_PTR:
+        out->p = va_arg(src->ap, const void*);
+        break;
+    }
+
+    if (src->capture != NULL)
+    {
+        if (src->next >= src->capture_max)
+        {
+            return 0;
+        }
+        src->capture[src->next] = *out;
+    }
+    src->next++;
+    return 1;
+}
+
+// Keep a private copy of a %s argument while capturing, a cut copy ends
+// with XPRINTF_TRUNCATED so the output shows it is incomplete
+static void capture_string(XPRINTF_SOURCE *src, const char *s, size_t len)
+{
+    XPRINTF_ARG *slot = &src->capture[src->next - 1];
+    size_t room = src->strings_size - src->strings_used;
+    size_t mark = 0;
+
+    if (room < sizeof(XPRINTF_TRUNCATED))
+    {
+        slot->p = (len == 0) ? "" : XPRINTF_TRUNCATED;
+        return;
+    }
+    if (len > room - 1)
+    {
+        mark = sizeof(XPRINTF_TRUNCATED) - 1;
+        len = room - 1 - mark;
+    }
+    char *copy = src->strings + src->strings_used;
+    memcpy(copy, s, len);
+    memcpy(copy + len, XPRINTF_TRUNCATED, mark);
+    len += mark;
+    copy[len] = '\0';
+    src->strings_used += len + 1;
+    slot->p = copy;
+}
+
+static ARG_TYPE integer_type(const char *length, int length_len)
+{
+    if (length_len == 2 && length[0] == 'l')
+    {
+        return ARG_LLONG;
+    }
+    if (length_len == 1)
+    {
+        switch (length[0])
+        {
+        case 'l':
+            return ARG_LONG;
+        case 'j':
+            return ARG_INTMAX;
+        case 'z':
+            return ARG_SIZE;
+        case 't':
+            return ARG_PTRDIFF;
+        default:
+            break;
+        }
+    }
+    return ARG_INT;
+}
+
+static void store_count(void *ptr, const char *length, int length_len, size_t count)
+{
+    if (length_len == 2 && length[0] == 'h')
+    {
+        *(signed char*)ptr = (signed char)count;
+    }
+    else if (length_len == 2 && length[0] == 'l')
+    {
+        *(long long*)ptr = (long long)count;
+    }
+    else if (length_len == 1 && length[0] == 'h')
+    {
+        *(short*)ptr = (short)count;
+    }
+    else if (length_len == 1 && length[0] == 'l')
+    {
+        *(long*)ptr = (long)count;
+    }
+    else if (length_len == 1 && length[0] == 'j')
+    {
+        *(intmax_t*)ptr = (intmax_t)count;
+    }
+    else if (length_len == 1 && (length[0] == 'z' || length[0] == 't'))
+    {
+        *(ptrdiff_t*)ptr = (ptrdiff_t)count;
+    }
+    else
+    {
+        *(int*)ptr = (int)count;
+    }
+}
+
+// Format one numeric argument with snprintf using the given spec
+static int format_number(char *out, size_t size, const char *spec, ARG_TYPE type, XPRINTF_ARG value)
+{
+    switch (type)
+    {
+    case ARG_PTR:
+        return snprintf(out, size, spec, value.p);
+    case ARG_DOUBLE:
+        return snprintf(out, size, spec, value.d);
+    case ARG_LDOUBLE:
+        return snprintf(out, size, spec, (long double)value.d);
+    case ARG_LONG:
+        return snprintf(out, size, spec, (long)value.i);
+    case ARG_LLONG:
+        return snprintf(out, size, spec, value.i);
+    case ARG_INTMAX:
+        return snprintf(out, size, spec, (intmax_t)value.i);
+    case ARG_SIZE:
+        return snprintf(out, size, spec, (size_t)value.i);
+    case ARG_PTRDIFF:
+        return snprintf(out, size, spec, (ptrdiff_t)value.i);
+    default:
+        return snprintf(out, size, spec, (int)value.i);
+    }
+}
+
+static size_t xformat(XPRINTF_STATE *state, XPRINTF_SOURCE *src, const char *format)
+{
+    const char *p = format;
+
+    while (*p != '\0')
+    {
+        const char *literal = p;
+        while (*p != '\0' && *p != '%')
+        {
+            p++;
+        }
+        if (p > literal)
+        {
+            emit(state, literal, p - literal);
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        // %[flags][width][.precision][length]conversion
+        const char *spec_start = p++;
+        const char *flags = p;
+        int left = 0;
+        int zero = 0;
+        XPRINTF_ARG value;
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+        {
+            left |= (*p == '-');
+            zero |= (*p == '0');
+            p++;
+        }
+        int flags_len = p - flags;
+
+        int width = -1;
+        if (*p == '*')
+        {
+            if (fetch(src, ARG_INT, &value))
+            {
+                width = (int)value.i;
+                if (width < 0)
+                {
+                    left = 1;
+                    width = -width;
+                }
+            }
+            p++;
+        }
+        else if (is_digit(*p))
+        {
+            width = 0;
+            while (is_digit(*p))
+            {
+                width = width * 10 + (*p++ - '0');
+            }
+        }
+
+        int precision = -1;
+        if (*p == '.')
+        {
+            p++;
+            if (*p == '*')
+            {
+                precision = fetch(src, ARG_INT, &value) ? (int)value.i : -1;
+                p++;
+            }
+            else
+            {
+                precision = 0;
+                while (is_digit(*p))
+                {
+                    precision = precision * 10 + (*p++ - '0');
+                }
+            }
+        }
+
+        const char *length = p;
+        while (*p != '\0' && strchr("hlLjzt", *p) != NULL)
+        {
+            p++;
+        }
+        int length_len = p - length;
+
+        char conv = *p;
+        if (conv == '\0')
+        {
+            break;
+        }
+        p++;
+
+        switch (conv)
+        {
+        case '%':
+            emit(state, "%", 1);
+            break;
+
+        case 'c':
+        {
+            if (!fetch(src, ARG_INT, &value))
+            {
+                emit(state, spec_start, p - spec_start);
+                break;
+            }
+            char c = (char)value.i;
+            emit_padded(state, &c, 1, width, left);
+            break;
+        }
+
+        case 's':
+        {
+            if (!fetch(src, ARG_PTR, &value))
+            {
+                emit(state, spec_start, p - spec_start);
+                break;
+            }
+            const char *s = (const char*)value.p;
+            size_t len;
+            if (s == NULL)
+            {
+                s = "(null)";
+            }
+            if (precision >= 0)
+            {
+                const char *end = (const char*)memchr(s, '\0', precision);
+                len = (end != NULL) ? (size_t)(end - s) : (size_t)precision;
+            }
+            else
+            {
+                len = strlen(s);
+            }
+            if (src->capture != NULL && src->next <= src->capture_max)
+            {
+                capture_string(src, s, len);
+            }
+            emit_padded(state, s, len, width, left);
+            break;
+        }
+
+        case 'n':
+            // a recorded pointer would be stale by the time it is replayed
+            if (src->args == NULL)
+            {
+                void *ptr = va_arg(src->ap, void*);
+                if (src->capture == NULL)
+                {
+                    store_count(ptr, length, length_len, state->produced);
+                }
+            }
+            break;
+
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'p':
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        {
+            char spec[XPRINTF_SPEC_SIZE];
+            char out[XPRINTF_CONVERSION_MAX];
+            int spec_len = 0;
+            // widths that fit the output buffer are left to snprintf
+            int own_width = (width >= XPRINTF_CONVERSION_MAX);
+            ARG_TYPE type;
+
+            if (conv == 'p')
+            {
+                type = ARG_PTR;
+            }
+            else if (strchr("eEfFgGaA", conv) != NULL)
+            {
+                type = (length_len == 1 && length[0] == 'L') ? ARG_LDOUBLE : ARG_DOUBLE;
+            }
+            else
+            {
+                type = integer_type(length, length_len);
+            }
+            if (!fetch(src, type, &value))
+            {
+                emit(state, spec_start, p - spec_start);
+                break;
+            }
+            if (state->sink == NULL)
+            {
+                break;
+            }
+
+            spec[spec_len++] = '%';
+            if (flags_len > 5)
+            {
+                flags_len = 5;
+            }
+            memcpy(spec + spec_len, flags, flags_len);
+            spec_len += flags_len;
+            if (width >= 0 && !own_width)
+            {
+                spec_len += append_uint(spec + spec_len, width);
+            }
+            if (precision >= 0)
+            {
+                spec[spec_len++] = '.';
+                spec_len += append_uint(spec + spec_len, precision);
+            }
+            memcpy(spec + spec_len, length, length_len > 2 ? 2 : length_len);
+            spec_len += length_len > 2 ? 2 : length_len;
+            spec[spec_len++] = conv;
+            spec[spec_len] = '\0';
+
+            int len = format_number(out, sizeof(out), spec, type, value);
+            if (len < 0)
+            {
+                break;
+            }
+            if (len > (int)sizeof(out) - 1)
+            {
+                len = sizeof(out) - 1;
+            }
+
+            if (!own_width || left || !zero || (precision >= 0 && strchr("diouxX", conv) != NULL))
+            {
+                emit_padded(state, out, len, own_width ? width : -1, left);
+            }
+            else
+            {
+                // zero padding goes after the sign and any 0x prefix
+                int prefix = (out[0] == '-' || out[0] == '+' || out[0] == ' ') ? 1 : 0;
+                if (out[prefix] == '0' && (out[prefix + 1] == 'x' || out[prefix + 1] == 'X'))
+                {
+                    prefix += 2;
+                }
+                emit(state, out, prefix);
+                emit_fill(state, '0', width - len);
+                emit(state, out + prefix, len - prefix);
+            }
+            break;
+        }
+
+        default:
+            // unknown conversion, print it as written
+            emit(state, spec_start, p - spec_start);
+            break;
+        }
+    }
+
+    if (state->sink != NULL)
+    {
+        flush_chunk(state);
+    }
+    return state->accepted;
+}
+
+static void init_state(XPRINTF_STATE *state, XPRINTF_SINK sink, void *context)
+{
+    state->sink = sink;
+    state->context = context;
+    state->used = 0;
+    state->produced = 0;
+    state->accepted = 0;
+}
+
+size_t xvprintf(XPRINTF_SINK sink, void *context, const char *format, va_list arg)
+{
+    XPRINTF_STATE state;
+    XPRINTF_SOURCE src;
+    size_t len;
+
+    if (sink == NULL || format == NULL)
+    {
+        return 0;
+    }
+    init_state(&state, sink, context);
+    memset(&src, 0, sizeof(src));
+    va_copy(src.ap, arg);
+    len = xformat(&state, &src, format);
+    va_end(src.ap);
+    return len;
+}
+
+int xvcapture(const char *format, va_list arg, XPRINTF_ARG *args, int max_args, char *strings, size_t strings_size)
+{
+    XPRINTF_STATE state;
+    XPRINTF_SOURCE src;
+
+    if (format == NULL || args == NULL)
+    {
+        return 0;
+    }
+    init_state(&state, NULL, NULL);
+    memset(&src, 0, sizeof(src));
+    va_copy(src.ap, arg);
+    src.capture = args;
+    src.capture_max = max_args;
+    src.strings = strings;
+    src.strings_size = (strings != NULL) ? strings_size : 0;
+    xformat(&state, &src, format);
+    va_end(src.ap);
+    return src.next < max_args ? src.next : max_args;
+}
+
+size_t xaprintf(XPRINTF_SINK sink, void *context, const char *format, const XPRINTF_ARG *args, int arg_count)
+{
+    XPRINTF_STATE state;
+    XPRINTF_SOURCE src;
+    static const XPRINTF_ARG no_args[1];
+
+    if (sink == NULL || format == NULL)
+    {
+        return 0;
+    }
+    init_state(&state, sink, context);
+    memset(&src, 0, sizeof(src));
+    src.args = (args != NULL) ? args : no_args;
+    src.count = (args != NULL) ? arg_count : 0;
+    return xformat(&state, &src, format);
+}
@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __XPRINTF_H__
+#define __XPRINTF_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Longest output of a single numeric conversion, not counting field width padding
+#define XPRINTF_CONVERSION_MAX  64
+
+/**
+ * Output sink for xvprintf.
+ * @param context   The context passed to xvprintf.
+ * @param data      Formatted output, not NUL terminated.
+ * @param len       Number of bytes in data.
+ * @return Number of bytes accepted.
+ */
+typedef size_t (*XPRINTF_SINK)(void *context, const char *data, size_t len);
+
+/**
+ * One argument captured by xvcapture, in the order the format consumes them
+ * (including '*' widths and precisions).
+ */
+typedef union
+{
+    long long i;
+    double d;
+    const void *p;
+} XPRINTF_ARG;
+
+/**
+ * Format like vsnprintf but stream the output to a sink in chunks instead of
+ * building the whole string. The format string is walked once, no heap is
+ * used and only a small stack buffer is needed whatever the output length.
+ * @return Number of bytes accepted by the sink.
+ */
+size_t xvprintf(XPRINTF_SINK sink, void *context, const char *format, va_list arg);
+
+// Ends a %s copy that did not fit in the strings area of xvcapture
+#define XPRINTF_TRUNCATED       "..."
+
+/**
+ * Copy the arguments of a format into args without formatting anything, so
+ * the output can be produced later by xaprintf. %s strings are copied into
+ * strings, ending with XPRINTF_TRUNCATED when it runs out, and %n is ignored.
+ * @return Number of entries stored in args.
+ */
+int xvcapture(const char *format, va_list arg, XPRINTF_ARG *args, int max_args, char *strings, size_t strings_size);
+
+/**
+ * Same as xvprintf but take the arguments from an array filled by xvcapture.
+ * Conversions past the end of args are printed as written.
+ */
+size_t xaprintf(XPRINTF_SINK sink, void *context, const char *format, const XPRINTF_ARG *args, int arg_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __XPRINTF_H__ */
@@ -11,6 +11,7 @@
 #include "azure_c_shared_utility/xlogging.h"
 #include "iothubtransportmqtt.h"
 #include "certs/certs.h"
+#include "JsonPath.h"
 
 typedef void (*CONNECTION_STATUS_CALLBACK)(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
 typedef void (*SEND_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result);
@@ -18,4 +19,6 @@ typedef void (*MESSAGE_CALLBACK)(const char* message, int length);
 typedef void (*DEVICE_TWIN_CALLBACK)(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payLoad, int length);
 typedef int  (*DEVICE_METHOD_CALLBACK)(const char *methodName, const unsigned char *payload, int length, unsigned char **response, int *responseLength);
 typedef void (*REPORT_CONFIRMATION_CALLBACK)(int status_code);
+typedef void (*SEND_EVENT_CALLBACK)(int trackingId, IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
+typedef void (*REPORT_STATE_CALLBACK)(int status_code, void *context);
 #endif // __AZURE_IOTHUB_H__
\ No newline at end of file
@@ -3,7 +3,9 @@
 #include "mbed.h"
 #include "DevKitMQTTClient.h"
 #include "DevkitDPSClient.h"
+#include "DeferredLog.h"
 #include "EEPROMInterface.h"
+#include "FileSpool.h"
 #include "SerialLog.h"
 #include "SystemTickCounter.h"
 #include "SystemTime.h"
@@ -11,6 +13,7 @@
 #include "SystemWiFi.h"
 #include "Telemetry.h"
 
+#include "parson.h"
 #include "iothub_client_version.h"
 #include "iothub_client_ll.h"
 #include "iothub_client_hsm_ll.h"
@@ -22,17 +25,52 @@
 #define MQTT_KEEPALIVE_INTERVAL_S 120
 #define SEND_EVENT_RETRY_COUNT 2
 #define EVENT_TIMEOUT_MS 10000
+#define EVENT_PENDING -1
 #define EVENT_CONFIRMED -2
 #define EVENT_FAILED -3
+#define WORK_INTERVAL_MS 10
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS 60000
+
+typedef enum
+{
+    MQTT_IDLE,          // no client
+    MQTT_CONNECTING,    // client created, waiting for IoT Hub to accept it
+    MQTT_CONNECTED,
+    MQTT_BACKOFF        // connection given up, the client is created again at reconnect_ms
+} MQTT_STATE;
+
+typedef struct
+{
+    bool used;
+    int trackingId;
+    SEND_EVENT_CALLBACK callback;
+    void *context;
+} PENDING_EVENT;
+
+typedef struct
+{
+    REPORT_STATE_CALLBACK callback;
+    void *context;
+} REPORT_WAITER;
+
+// A merged reported state handed to the IoT Hub client, waiting for its confirmation
+typedef struct REPORT_BATCH_TAG
+{
+    struct REPORT_BATCH_TAG *next;
+    int trackingId;
+    int waiterCount;
+    REPORT_WAITER waiters[MQTT_REPORT_MAX_WAITERS];
+} REPORT_BATCH;
 
 static int callbackCounter;
 static IOTHUB_CLIENT_LL_HANDLE iotHubClientHandle = NULL;
 static int receiveContext = 0;
 static int statusContext = 0;
 static int trackingId = 0;
-static int currentTrackingId = -1;
-static bool clientConnected = false;
-static bool resetClient = false;
+static MQTT_STATE mqttState = MQTT_IDLE;
+static int reconnectAttempts = 0;
+static uint64_t reconnect_ms;
 static CONNECTION_STATUS_CALLBACK _connection_status_callback = NULL;
 static SEND_CONFIRMATION_CALLBACK _send_confirmation_callback = NULL;
 static MESSAGE_CALLBACK _message_callback = NULL;
@@ -41,6 +79,27 @@ static DEVICE_METHOD_CALLBACK _device_method_callback = NULL;
 static REPORT_CONFIRMATION_CALLBACK _report_confirmation_callback = NULL;
 static bool enableDeviceTwin = false;
 static const char* trustedCerts = certificates;
+static char *connectionString = NULL;
+static IOTHUB_CLIENT_TRANSPORT_PROVIDER transportProvider = MQTT_Protocol;
+static FileSpool *eventSpool = NULL;
+static PENDING_EVENT pendingEvents[MQTT_SEND_WINDOW];
+static int pendingCount = 0;
+
+// The batch is '[' then the readings separated by ',', the ']' is added when sent.
+// A batch kept in the spool also has its reading count after the '\0'.
+#define BATCH_COUNT_SIZE 12
+static char *batchBuffer = NULL;
+static int batchLength = 0;
+static int batchCount = 0;
+static int batchReserved = 0;
+static uint64_t batch_start_ms;
+
+// Reported state not sent yet, the callers wait for the update it goes in
+static JSON_Value *reportedState = NULL;
+static REPORT_WAITER reportWaiters[MQTT_REPORT_MAX_WAITERS];
+static int reportWaiterCount = 0;
+static uint64_t report_start_ms;
+static REPORT_BATCH *reportBatches = NULL;
 
 static uint64_t iothub_check_ms;
 
@@ -53,76 +112,60 @@ extern void ota_callback(const unsigned char *payLoad, size_t size);
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Utilities
-static void CheckConnection()
+// Give up the connection, the client is created again after an exponential backoff
+static void ScheduleReconnect()
 {
-    if (resetClient)
+    int delay = RECONNECT_MIN_MS << (reconnectAttempts < 6 ? reconnectAttempts : 6);
+    if (delay > RECONNECT_MAX_MS)
     {
-        if (SystemWiFiRSSI() == 0)
-        {
-            LogInfo(">>>No Wi-Fi.");
-        }
-        else
-        {
-            LogInfo(">>>Re-connect.");
-            // Re-connect the IoT Hub
-            DevKitMQTTClient_Close();
-            resetClient = false;
-            DevKitMQTTClient_Init(enableDeviceTwin);
-        }
+        delay = RECONNECT_MAX_MS;
     }
+    // Up to half more, so devices that lost the hub together don't all come back together
+    delay += rand() % (delay / 2 + 1);
+    reconnectAttempts++;
+
+    reconnect_ms = SystemTickCounterRead() + delay;
+    mqttState = MQTT_BACKOFF;
+    LogInfo(">>>Re-connect in %d ms.", delay);
 }
 
-static void AZIoTLog(LOG_CATEGORY log_category, const char *file, const char *func, const int line, unsigned int options, const char *format, ...)
+// Re-connect once the backoff is over, return true if the client can be used
+static bool CheckConnection()
 {
-    va_list arg;
-    char temp[64];
-    char *buffer = temp;
-
-    va_start(arg, format);
-    size_t len = vsnprintf(temp, sizeof(temp), format, arg);
-    va_end(arg);
-
-    if (len > sizeof(temp) - 1)
+    if (mqttState == MQTT_BACKOFF && SystemWiFiRSSI() != 0 && SystemTickCounterRead() >= reconnect_ms)
     {
-        buffer = (char *)malloc(len + 1);
-        if (!buffer)
+        LogInfo(">>>Re-connect.");
+        // Re-connect the IoT Hub
+        DevKitMQTTClient_Close();
+        if (!DevKitMQTTClient_Init(enableDeviceTwin) && mqttState != MQTT_BACKOFF)
         {
-            return;
+            ScheduleReconnect();
         }
-
-        va_start(arg, format);
-        vsnprintf(buffer, len + 1, format, arg);
-        va_end(arg);
     }
+    return (iotHubClientHandle != NULL && mqttState != MQTT_BACKOFF && SystemWiFiRSSI() != 0);
+}
 
-    time_t t = time(NULL);
-    struct tm *tm_info = gmtime(&t);
-    char ct[26];
-    strftime(ct, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-
+static void AZIoTLog(LOG_CATEGORY log_category, const char *file, const char *func, const int line, unsigned int options, const char *format, ...)
+{
+    // Recorded only, the log thread started by DevKitMQTTClient_Init() formats it
+    DEFERRED_LOG_LEVEL level;
     switch (log_category)
     {
     case AZ_LOG_INFO:
-        serial_xlog("%s INFO:  ", ct);
+        level = DEFERRED_LOG_INFO;
         break;
     case AZ_LOG_ERROR:
-        serial_xlog("%s ERROR: %s (ln %d): ", ct, xlogging_get_filename(file), line);
+        level = DEFERRED_LOG_ERROR;
         break;
     default:
+        level = DEFERRED_LOG_RAW;
         break;
     }
 
-    serial_log(buffer);
-
-    if (options & LOG_LINE)
-    {
-        serial_log("\r\n");
-    }
-
-    if (buffer != temp)
-    {
-        free(buffer);
-    }
+    va_list arg;
+    va_start(arg, format);
+    deferred_vlog(level, xlogging_get_filename(file), line, (options & LOG_LINE) ? DEFERRED_LOG_LINE : 0, format, arg);
+    va_end(arg);
 }
 
 static char *GetHostNameFromConnectionString(char *connectionString)
@@ -168,6 +211,19 @@ static char *GetHostNameFromConnectionString(char *connectionString)
     return NULL;
 }
 
+// Find the slot of a message in flight, or a free slot when used is false
+static PENDING_EVENT *FindPendingEvent(bool used, int id)
+{
+    for (int i = 0; i < MQTT_SEND_WINDOW; i++)
+    {
+        if (pendingEvents[i].used == used && (!used || pendingEvents[i].trackingId == id))
+        {
+            return &pendingEvents[i];
+        }
+    }
+    return NULL;
+}
+
 static void FreeEventInstance(EVENT_INSTANCE *event)
 {
     if (event != NULL)
@@ -184,7 +240,11 @@ static void FreeEventInstance(EVENT_INSTANCE *event)
 // Event handlers
 static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void *userContextCallback)
 {
-    clientConnected = false;
+    // Unless told otherwise below, the client retries by itself
+    if (mqttState == MQTT_CONNECTED)
+    {
+        mqttState = MQTT_CONNECTING;
+    }
 
     switch (reason)
     {
@@ -194,8 +254,8 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOT
             // turn off Azure led
             DigitalOut LedAzure(LED_AZURE);
             LedAzure = 0;
-            resetClient = true;
             LogInfo(">>>Connection status: timeout");
+            ScheduleReconnect();
         }
         break;
     case IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED:
@@ -203,6 +263,14 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOT
     case IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL:
         break;
     case IOTHUB_CLIENT_CONNECTION_RETRY_EXPIRED:
+        if (result == IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED)
+        {
+            // The client stopped retrying
+            DigitalOut LedAzure(LED_AZURE);
+            LedAzure = 0;
+            LogInfo(">>>Connection status: retry expired");
+            ScheduleReconnect();
+        }
         break;
     case IOTHUB_CLIENT_CONNECTION_NO_NETWORK:
         if (result == IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED)
@@ -210,8 +278,8 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOT
             // Turn off Azure led
             DigitalOut LedAzure(LED_AZURE);
             LedAzure = 0;
-            resetClient = true;
             LogInfo(">>>Connection status: disconnected");
+            ScheduleReconnect();
         }
         break;
     case IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR:
@@ -222,7 +290,8 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOT
             // Turn on Azure led
             DigitalOut LedAzure(LED_AZURE);
             LedAzure = 1;
-            clientConnected = true;
+            mqttState = MQTT_CONNECTED;
+            reconnectAttempts = 0;
             LogInfo(">>>Connection status: connected");
 
             LogTrace("Create", "IoT hub established");
@@ -239,23 +308,25 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result, IOT
 static void SendConfirmationCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *userContextCallback)
 {
     EVENT_INSTANCE *event = (EVENT_INSTANCE *)userContextCallback;
-    LogInfo(">>>Confirmation[%d] received for message tracking id = %d with result = %s", callbackCounter++, event->trackingId, MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+    int id = event->trackingId;
+    LogInfo(">>>Confirmation[%d] received for message tracking id = %d with result = %s", callbackCounter++, id, MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONFIRMATION_RESULT, result));
+
+    // Free the message
+    FreeEventInstance(event);
 
-    if (currentTrackingId == event->trackingId)
+    PENDING_EVENT *pending = FindPendingEvent(true, id);
+    if (pending != NULL)
     {
-        if (result == IOTHUB_CLIENT_CONFIRMATION_OK)
-        {
-            currentTrackingId = EVENT_CONFIRMED;
-        }
-        else
+        SEND_EVENT_CALLBACK callback = pending->callback;
+        void *context = pending->context;
+        pending->used = false;
+        pendingCount--;
+        if (callback)
         {
-            currentTrackingId = EVENT_FAILED;
+            callback(id, result, context);
         }
     }
 
-    // Free the message
-    FreeEventInstance(event);
-
     if (_send_confirmation_callback)
     {
         _send_confirmation_callback(result);
@@ -322,23 +393,31 @@ static int DeviceMethodCallback(const char *methodName, const unsigned char *pay
 
 static void ReportConfirmationCallback(int statusCode, void *userContextCallback)
 {
-    EVENT_INSTANCE *event = (EVENT_INSTANCE *)userContextCallback;
-    LogInfo(">>>Confirmation[%d] received for state tracking id = %d with state code = %d", callbackCounter++, event->trackingId, statusCode);
+    REPORT_BATCH *batch = (REPORT_BATCH *)userContextCallback;
+    LogInfo(">>>Confirmation[%d] received for state tracking id = %d with state code = %d", callbackCounter++, batch->trackingId, statusCode);
 
-    if (statusCode == 204)
+    if (statusCode != 204)
     {
-        if (currentTrackingId == event->trackingId)
+        LogError("Report confirmation failed with state code %d", statusCode);
+    }
+
+    for (REPORT_BATCH **link = &reportBatches; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == batch)
         {
-            currentTrackingId = EVENT_CONFIRMED;
+            *link = batch->next;
+            break;
         }
     }
-    else
+    // Every state merged in this update gets the same answer
+    for (int i = 0; i < batch->waiterCount; i++)
     {
-        LogError("Report confirmation failed with state code %d", statusCode);
+        if (batch->waiters[i].callback)
+        {
+            batch->waiters[i].callback(statusCode, batch->waiters[i].context);
+        }
     }
-
-    // Free the state
-    FreeEventInstance(event);
+    free(batch);
 
     if (_report_confirmation_callback)
     {
@@ -346,59 +425,248 @@ static void ReportConfirmationCallback(int statusCode, void *userContextCallback
     }
 }
 
-static bool SendEventOnce(EVENT_INSTANCE *event)
+// Hand a message to the IoT Hub client and keep track of it until it's confirmed
+static int SubmitEvent(EVENT_INSTANCE *event, SEND_EVENT_CALLBACK callback, void *context)
 {
-    if (event == NULL)
+    PENDING_EVENT *pending = FindPendingEvent(false, 0);
+    if (pending == NULL)
     {
-        return false;
+        LogError("Too many messages in flight");
+        FreeEventInstance(event);
+        return -1;
     }
 
-    if (iotHubClientHandle == NULL || SystemWiFiRSSI() == 0)
+    event->trackingId = trackingId++;
+    pending->used = true;
+    pending->trackingId = event->trackingId;
+    pending->callback = callback;
+    pending->context = context;
+    pendingCount++;
+
+    if (IoTHubDeviceClient_LL_SendEventAsync(iotHubClientHandle, event->messageHandle, SendConfirmationCallback, event) != IOTHUB_CLIENT_OK)
     {
+        LogError("IoTHubClient_LL_SendEventAsync..........FAILED!");
+        pending->used = false;
+        pendingCount--;
         FreeEventInstance(event);
-        return false;
+        return -1;
     }
+    LogInfo(">>>IoTHubClient_LL_SendEventAsync accepted message for transmission to IoT Hub.");
+    return pending->trackingId;
+}
 
-    event->trackingId = trackingId++;
-    currentTrackingId = event->trackingId;
+static void WaitEventCallback(int trackingId, IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
+{
+    *(volatile int *)context = (result == IOTHUB_CLIENT_CONFIRMATION_OK) ? EVENT_CONFIRMED : EVENT_FAILED;
+}
 
-    CheckConnection();
-    if (resetClient)
+// Send a message and wait for its confirmation, the messages sent
+// asynchronously keep going meanwhile
+static bool SendMessageOnce(EVENT_INSTANCE *event)
+{
+    uint64_t start_ms = SystemTickCounterRead();
+    while (pendingCount >= MQTT_SEND_WINDOW)
+    {
+        // Wait for room in the window
+        IoTHubClient_LL_DoWork(iotHubClientHandle);
+        if (mqttState == MQTT_BACKOFF || (int)(SystemTickCounterRead() - start_ms) >= EVENT_TIMEOUT_MS)
+        {
+            FreeEventInstance(event);
+            return false;
+        }
+        ThreadAPI_Sleep(WORK_INTERVAL_MS);
+    }
+
+    volatile int state = EVENT_PENDING;
+    int id = SubmitEvent(event, WaitEventCallback, (void *)&state);
+    if (id < 0)
     {
-        // Disconnected
         return false;
     }
 
-    uint64_t start_ms = SystemTickCounterRead();
-    if (event->type == MESSAGE)
+    while (true)
     {
-        if (IoTHubDeviceClient_LL_SendEventAsync(iotHubClientHandle, event->messageHandle, SendConfirmationCallback, event) != IOTHUB_CLIENT_OK)
+        IoTHubClient_LL_DoWork(iotHubClientHandle);
+
+        if (state != EVENT_PENDING)
         {
-            LogError("IoTHubClient_LL_SendEventAsync..........FAILED!");
-            FreeEventInstance(event);
+            return (state == EVENT_CONFIRMED);
+        }
+
+        // Check timeout
+        int diff = (int)(SystemTickCounterRead() - start_ms);
+        if (diff >= EVENT_TIMEOUT_MS)
+        {
+            // Time out, reset the client
+            LogError("Waiting for send confirmation, time is up %d", diff);
+            ScheduleReconnect();
+        }
+
+        if (mqttState == MQTT_BACKOFF)
+        {
+            // The confirmation may still come when the client is closed, state is gone by then
+            PENDING_EVENT *pending = FindPendingEvent(true, id);
+            if (pending != NULL)
+            {
+                pending->callback = NULL;
+            }
             return false;
         }
-        LogInfo(">>>IoTHubClient_LL_SendEventAsync accepted message for transmission to IoT Hub.");
+        ThreadAPI_Sleep(WORK_INTERVAL_MS);
     }
-    else if (event->type == STATE)
+}
+
+// Merge the properties of patch into target, objects are merged member by member
+// and any other value replaces what target had
+static void MergeState(JSON_Object *target, const JSON_Object *patch)
+{
+    size_t count = json_object_get_count(patch);
+    for (size_t i = 0; i < count; i++)
     {
-        if (IoTHubClient_LL_SendReportedState(iotHubClientHandle, (const unsigned char *)event->stateString, strlen(event->stateString), ReportConfirmationCallback, event) != IOTHUB_CLIENT_OK)
+        const char *name = json_object_get_name(patch, i);
+        JSON_Value *value = json_object_get_value_at(patch, i);
+        JSON_Object *child = json_value_get_object(value);
+        JSON_Object *current = json_object_get_object(target, name);
+        if (child != NULL && current != NULL)
         {
-            LogError("IoTHubClient_LL_SendReportedState..........FAILED!");
-            FreeEventInstance(event);
+            MergeState(current, child);
+        }
+        else
+        {
+            json_object_set_value(target, name, json_value_deep_copy(value));
+        }
+    }
+}
+
+// True when patch has an object for a property target has as null. The twin deletes the
+// whole property for the null, merged into the object it would only get a partial update
+static bool ReplacesNull(const JSON_Object *target, const JSON_Object *patch)
+{
+    size_t count = json_object_get_count(patch);
+    for (size_t i = 0; i < count; i++)
+    {
+        JSON_Object *child = json_value_get_object(json_object_get_value_at(patch, i));
+        if (child == NULL)
+        {
+            continue;
+        }
+        JSON_Value *current = json_object_get_value(target, json_object_get_name(patch, i));
+        if (json_value_get_type(current) == JSONNull)
+        {
+            return true;
+        }
+        JSON_Object *object = json_value_get_object(current);
+        if (object != NULL && ReplacesNull(object, child))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool AddReportedState(const char *stateString, REPORT_STATE_CALLBACK callback, void *context)
+{
+    JSON_Value *patch = json_parse_string(stateString);
+    if (json_value_get_type(patch) != JSONObject)
+    {
+        LogError("The reported state is not a JSON object");
+        json_value_free(patch);
+        return false;
+    }
+    if (callback != NULL && reportWaiterCount == MQTT_REPORT_MAX_WAITERS && !DevKitMQTTClient_FlushReportedState())
+    {
+        json_value_free(patch);
+        return false;
+    }
+    if (reportedState != NULL && ReplacesNull(json_value_get_object(reportedState), json_value_get_object(patch))
+        && !DevKitMQTTClient_FlushReportedState())
+    {
+        LogError("The pending deletion can't be sent before the new reported state");
+        json_value_free(patch);
+        return false;
+    }
+
+    if (reportedState == NULL)
+    {
+        reportedState = json_value_init_object();
+        if (reportedState == NULL)
+        {
+            LogError("Failed to allocate the reported state");
+            json_value_free(patch);
             return false;
         }
-        LogInfo(">>>IoTHubClient_LL_SendReportedState accepted state for transmission to IoT Hub.");
+        report_start_ms = SystemTickCounterRead();
+    }
+    MergeState(json_value_get_object(reportedState), json_value_get_object(patch));
+    json_value_free(patch);
+
+    if (callback != NULL)
+    {
+        reportWaiters[reportWaiterCount].callback = callback;
+        reportWaiters[reportWaiterCount].context = context;
+        reportWaiterCount++;
     }
+    return true;
+}
 
+// Forget a caller that stopped waiting, whether its state is sent yet or not
+static void RemoveReportWaiter(void *context)
+{
+    for (int i = 0; i < reportWaiterCount; i++)
+    {
+        if (reportWaiters[i].context == context)
+        {
+            reportWaiters[i].callback = NULL;
+        }
+    }
+    for (REPORT_BATCH *batch = reportBatches; batch != NULL; batch = batch->next)
+    {
+        for (int i = 0; i < batch->waiterCount; i++)
+        {
+            if (batch->waiters[i].context == context)
+            {
+                batch->waiters[i].callback = NULL;
+            }
+        }
+    }
+}
+
+static void FlushReportedStateIfDue()
+{
+    if (reportedState != NULL && (int)(SystemTickCounterRead() - report_start_ms) >= MQTT_REPORT_DELAY_MS)
+    {
+        DevKitMQTTClient_FlushReportedState();
+    }
+}
+
+static void WaitReportCallback(int statusCode, void *context)
+{
+    *(volatile int *)context = (statusCode == 204) ? EVENT_CONFIRMED : EVENT_FAILED;
+}
+
+// Report the state along with the merged ones not sent yet and wait for the confirmation
+static bool ReportStateOnce(const char *stateString)
+{
+    volatile int state = EVENT_PENDING;
+    if (!AddReportedState(stateString, WaitReportCallback, (void *)&state))
+    {
+        return false;
+    }
+    if (!DevKitMQTTClient_FlushReportedState())
+    {
+        // The state stays merged for the next update
+        RemoveReportWaiter((void *)&state);
+        return false;
+    }
+
+    uint64_t start_ms = SystemTickCounterRead();
     while (true)
     {
         IoTHubClient_LL_DoWork(iotHubClientHandle);
 
-        if (currentTrackingId == EVENT_CONFIRMED)
+        if (state != EVENT_PENDING)
         {
-            // IoT Hub got this event
-            return true;
+            return (state == EVENT_CONFIRMED);
         }
 
         // Check timeout
@@ -406,24 +674,108 @@ static bool SendEventOnce(EVENT_INSTANCE *event)
         if (diff >= EVENT_TIMEOUT_MS)
         {
             // Time out, reset the client
-            LogError("Waiting for send confirmation, time is up %d", diff);
-            resetClient = true;
+            LogError("Waiting for report confirmation, time is up %d", diff);
+            ScheduleReconnect();
         }
 
-        if (resetClient)
+        if (mqttState == MQTT_BACKOFF)
         {
-            // resetClient also can be set as true in the IoTHubClient_LL_DoWork
-            // Disconnected, re-send the message
-            break;
+            RemoveReportWaiter((void *)&state);
+            return false;
         }
-        else
+        ThreadAPI_Sleep(WORK_INTERVAL_MS);
+    }
+}
+
+static bool SendEventOnce(EVENT_INSTANCE *event)
+{
+    if (event == NULL)
+    {
+        return false;
+    }
+
+    if (!CheckConnection())
+    {
+        // Disconnected
+        FreeEventInstance(event);
+        return false;
+    }
+
+    if (event->type == MESSAGE)
+    {
+        return SendMessageOnce(event);
+    }
+
+    bool result = ReportStateOnce(event->stateString);
+    FreeEventInstance(event);
+    return result;
+}
+
+// A batch is one JSON array, tagged with the number of readings in it
+static EVENT_INSTANCE *GenerateBatchEvent(const char *text, const char *count)
+{
+    EVENT_INSTANCE *event = DevKitMQTTClient_Event_Generate(text, MESSAGE);
+    if (event != NULL)
+    {
+        IoTHubMessage_SetContentTypeSystemProperty(event->messageHandle, "application/json");
+        IoTHubMessage_SetContentEncodingSystemProperty(event->messageHandle, "utf-8");
+        DevKitMQTTClient_Event_AddProp(event, MQTT_BATCH_COUNT_PROPERTY, count);
+    }
+    return event;
+}
+
+// Send the events kept in the spool, oldest first
+static bool ReplaySpool()
+{
+    while (!eventSpool->empty())
+    {
+        int size = eventSpool->peek(NULL, 0);
+        if (size <= 0)
+        {
+            return false;
+        }
+        char *text = (char *)malloc(size + 1);
+        if (text == NULL)
         {
-            // Sleep a while
-            ThreadAPI_Sleep(100);
+            LogError("Failed to malloc for spooled event");
+            return false;
+        }
+        bool sent = false;
+        if (eventSpool->peek(text, size) == size)
+        {
+            text[size] = '\0';
+            // Only a batch has something after its '\0', its reading count
+            int length = strlen(text);
+            EVENT_INSTANCE *event = (length < size) ? GenerateBatchEvent(text, &text[length + 1]) : DevKitMQTTClient_Event_Generate(text, MESSAGE);
+            sent = SendEventOnce(event);
+        }
+        free(text);
+        if (!sent)
+        {
+            return false;
         }
+        eventSpool->pop();
     }
+    return true;
+}
 
-    return false;
+static void FlushBatchIfDue()
+{
+    if (batchCount > 0 && (int)(SystemTickCounterRead() - batch_start_ms) >= MQTT_BATCH_DELAY_MS)
+    {
+        DevKitMQTTClient_FlushBatch();
+    }
+}
+
+static bool SpoolEvent(const char *text, int size)
+{
+    if (eventSpool->append(text, size) != 0)
+    {
+        LogError("Failed to keep the event in the spool");
+        return false;
+    }
+    LogInfo(">>>Event kept in the spool.");
+    return true;
 }
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // MQTT APIs
@@ -471,7 +823,9 @@ bool DevKitMQTTClient_Init(bool hasDeviceTwin, bool traceOn, const char * modelI
     }
     enableDeviceTwin = hasDeviceTwin;
     callbackCounter = 0;
+    mqttState = MQTT_CONNECTING;
 
+    deferred_log_start();
     xlogging_set_log_function(AZIoTLog);
 
     srand((unsigned int)time(NULL));
@@ -499,25 +853,32 @@ bool DevKitMQTTClient_Init(bool hasDeviceTwin, bool traceOn, const char * modelI
             return false;
         }
 
-        // Load connection from EEPROM
-        EEPROMInterface eeprom;
         uint8_t connString[AZ_IOT_HUB_MAX_LEN + 1] = {'\0'};
-        int ret = eeprom.read(connString, AZ_IOT_HUB_MAX_LEN, 0x00, AZ_IOT_HUB_ZONE_IDX);
-        if (ret < 0)
+        if (connectionString != NULL)
         {
-            LogError("Unable to get the azure iot connection string from EEPROM. Please set the value in configuration mode.");
-            return false;
+            strcpy((char *)connString, connectionString);
         }
-        else if (ret == 0)
+        else
         {
-            LogError("The connection string is empty.\r\nPlease set the value in configuration mode.");
-            return false;
+            // Load connection from EEPROM
+            EEPROMInterface eeprom;
+            int ret = eeprom.read(connString, AZ_IOT_HUB_MAX_LEN, 0x00, AZ_IOT_HUB_ZONE_IDX);
+            if (ret < 0)
+            {
+                LogError("Unable to get the azure iot connection string from EEPROM. Please set the value in configuration mode.");
+                return false;
+            }
+            else if (ret == 0)
+            {
+                LogError("The connection string is empty.\r\nPlease set the value in configuration mode.");
+                return false;
+            }
         }
 
         iothub_hostname = GetHostNameFromConnectionString((char *)connString);
 
         // Create the IoTHub client
-        if ((iotHubClientHandle = IoTHubClient_LL_CreateFromConnectionString((char *)connString, MQTT_Protocol)) == NULL)
+        if ((iotHubClientHandle = IoTHubClient_LL_CreateFromConnectionString((char *)connString, transportProvider)) == NULL)
         {
             LogTrace("Create", "IoT hub establish failed");
             return false;
@@ -598,16 +959,15 @@ bool DevKitMQTTClient_Init(bool hasDeviceTwin, bool traceOn, const char * modelI
     iothub_check_ms = SystemTickCounterRead();
 
     // Waiting for the confirmation
-    resetClient = false;
     uint64_t start_ms = SystemTickCounterRead();
     while (true)
     {
         IoTHubClient_LL_DoWork(iotHubClientHandle);
-        if (clientConnected)
+        if (mqttState == MQTT_CONNECTED)
         {
             break;
         }
-        if (resetClient)
+        if (mqttState == MQTT_BACKOFF)
         {
             return false;
         }
@@ -615,7 +975,7 @@ bool DevKitMQTTClient_Init(bool hasDeviceTwin, bool traceOn, const char * modelI
         if (diff >= CONNECT_TIMEOUT_MS)
         {
             // Time out, reset the client
-            resetClient = true;
+            ScheduleReconnect();
             return false;
         }
         ThreadAPI_Sleep(500);
@@ -646,6 +1006,35 @@ bool DevKitMQTTClient_SetOption(const char* optionName, const void* value)
         return true;
     }
 
+    if (strcmp(optionName, OPTION_CONNECTION_STRING) == 0)
+    {
+        if (strlen((const char *)value) > AZ_IOT_HUB_MAX_LEN)
+        {
+            return false;
+        }
+        if (connectionString != NULL)
+        {
+            free(connectionString);
+        }
+        connectionString = (*(const char *)value != '\0') ? strdup((const char *)value) : NULL;
+        return true;
+    }
+
+    if (strcmp(optionName, OPTION_TRANSPORT) == 0)
+    {
+        transportProvider = *(const IOTHUB_CLIENT_TRANSPORT_PROVIDER *)value;
+        return true;
+    }
+
+    if (strcmp(optionName, OPTION_SPOOL_PATH) == 0)
+    {
+        if (eventSpool == NULL)
+        {
+            eventSpool = new FileSpool((const char *)value);
+        }
+        return true;
+    }
+
     if (iotHubClientHandle != NULL)
     {
         if (IoTHubClient_LL_SetOption(iotHubClientHandle, optionName, value) == IOTHUB_CLIENT_OK)
@@ -666,6 +1055,11 @@ bool DevKitMQTTClient_SendEvent(const char *text)
     {
         return false;
     }
+    if (eventSpool != NULL && !ReplaySpool())
+    {
+        // Still offline, queue behind the older events
+        return SpoolEvent(text, strlen(text));
+    }
     for (int i = 0; i < SEND_EVENT_RETRY_COUNT; i++)
     {
         if (SendEventOnce(DevKitMQTTClient_Event_Generate(text, MESSAGE)))
@@ -673,13 +1067,200 @@ bool DevKitMQTTClient_SendEvent(const char *text)
             return true;
         }
     }
+    if (eventSpool != NULL)
+    {
+        return SpoolEvent(text, strlen(text));
+    }
     return false;
 }
 
+int DevKitMQTTClient_SendEventAsync(const char *text, SEND_EVENT_CALLBACK callback, void *context)
+{
+    if (text == NULL)
+    {
+        return -1;
+    }
+    return DevKitMQTTClient_SendEventInstanceAsync(DevKitMQTTClient_Event_Generate(text, MESSAGE), callback, context);
+}
+
+int DevKitMQTTClient_SendEventInstanceAsync(EVENT_INSTANCE *event, SEND_EVENT_CALLBACK callback, void *context)
+{
+    if (event == NULL)
+    {
+        return -1;
+    }
+    if (event->type != MESSAGE || !CheckConnection())
+    {
+        FreeEventInstance(event);
+        return -1;
+    }
+    return SubmitEvent(event, callback, context);
+}
+
+bool DevKitMQTTClient_BatchEvent(const char *text)
+{
+    if (text == NULL)
+    {
+        return false;
+    }
+    int length = strlen(text);
+    if (length + 3 > MQTT_BATCH_MAX_SIZE)
+    {
+        // Doesn't fit in a batch
+        return DevKitMQTTClient_SendEventAsync(text, NULL, NULL) >= 0;
+    }
+
+    char *reading = DevKitMQTTClient_BatchReserve(length);
+    if (reading == NULL)
+    {
+        return false;
+    }
+    memcpy(reading, text, length);
+    return DevKitMQTTClient_BatchCommit(length);
+}
+
+char* DevKitMQTTClient_BatchReserve(int size)
+{
+    // Room for the separator, the ']' and the '\0' added when sent
+    if (size <= 0 || size + 3 > MQTT_BATCH_MAX_SIZE)
+    {
+        return NULL;
+    }
+    if (batchBuffer == NULL)
+    {
+        batchBuffer = (char *)malloc(MQTT_BATCH_MAX_SIZE + BATCH_COUNT_SIZE);
+        if (batchBuffer == NULL)
+        {
+            LogError("Failed to malloc for the batch");
+            return NULL;
+        }
+    }
+    if (batchCount > 0 && batchLength + 1 + size + 2 > MQTT_BATCH_MAX_SIZE && !DevKitMQTTClient_FlushBatch())
+    {
+        return NULL;
+    }
+
+    batchBuffer[batchLength] = (batchCount == 0) ? '[' : ',';
+    batchReserved = size;
+    return &batchBuffer[batchLength + 1];
+}
+
+bool DevKitMQTTClient_BatchCommit(int length)
+{
+    if (length <= 0 || length > batchReserved)
+    {
+        return false;
+    }
+    batchReserved = 0;
+
+    if (batchCount == 0)
+    {
+        batch_start_ms = SystemTickCounterRead();
+    }
+    batchLength += 1 + length;
+    batchCount++;
+
+    FlushBatchIfDue();
+    return true;
+}
+
+bool DevKitMQTTClient_FlushBatch(void)
+{
+    if (batchCount == 0)
+    {
+        return true;
+    }
+
+    batchBuffer[batchLength] = ']';
+    batchBuffer[batchLength + 1] = '\0';
+    char *count = &batchBuffer[batchLength + 2];
+    int countLength = snprintf(count, BATCH_COUNT_SIZE, "%d", batchCount);
+    EVENT_INSTANCE *event = GenerateBatchEvent(batchBuffer, count);
+    bool sent = (event != NULL && DevKitMQTTClient_SendEventInstanceAsync(event, NULL, NULL) >= 0);
+
+    // The closed batch goes to the spool with its count, so new readings start a fresh one
+    // and the replay sends it as a batch again
+    if (!sent && (eventSpool == NULL || !SpoolEvent(batchBuffer, batchLength + 2 + countLength)))
+    {
+        // Keep the readings for the next try
+        return false;
+    }
+    batchLength = 0;
+    batchCount = 0;
+    return true;
+}
+
+bool DevKitMQTTClient_ReportStateAsync(const char *stateString, REPORT_STATE_CALLBACK callback, void *context)
+{
+    if (stateString == NULL || !AddReportedState(stateString, callback, context))
+    {
+        return false;
+    }
+    if (json_serialization_size(reportedState) >= MQTT_REPORT_MAX_SIZE)
+    {
+        // Kept merged if it can't go now
+        DevKitMQTTClient_FlushReportedState();
+    }
+    return true;
+}
+
+bool DevKitMQTTClient_FlushReportedState(void)
+{
+    if (reportedState == NULL)
+    {
+        return true;
+    }
+    if (!CheckConnection())
+    {
+        return false;
+    }
+
+    REPORT_BATCH *batch = (REPORT_BATCH *)malloc(sizeof(REPORT_BATCH));
+    char *stateString = json_serialize_to_string(reportedState);
+    if (batch == NULL || stateString == NULL)
+    {
+        LogError("Failed to malloc for the reported state");
+        free(batch);
+        json_free_serialized_string(stateString);
+        return false;
+    }
+    batch->trackingId = trackingId++;
+    batch->waiterCount = reportWaiterCount;
+    memcpy(batch->waiters, reportWaiters, reportWaiterCount * sizeof(REPORT_WAITER));
+
+    // The IoT Hub client keeps its own copy of the state
+    IOTHUB_CLIENT_RESULT result = IoTHubClient_LL_SendReportedState(iotHubClientHandle, (const unsigned char *)stateString, strlen(stateString), ReportConfirmationCallback, batch);
+    json_free_serialized_string(stateString);
+    if (result != IOTHUB_CLIENT_OK)
+    {
+        LogError("IoTHubClient_LL_SendReportedState..........FAILED!");
+        free(batch);
+        return false;
+    }
+    LogInfo(">>>IoTHubClient_LL_SendReportedState accepted state for transmission to IoT Hub.");
+
+    batch->next = reportBatches;
+    reportBatches = batch;
+    json_value_free(reportedState);
+    reportedState = NULL;
+    reportWaiterCount = 0;
+    return true;
+}
+
+int DevKitMQTTClient_DoWork(void)
+{
+    if (CheckConnection())
+    {
+        FlushBatchIfDue();
+        FlushReportedStateIfDue();
+        IoTHubClient_LL_DoWork(iotHubClientHandle);
+    }
+    return pendingCount;
+}
+
 bool DevKitMQTTClient_ReceiveEvent()
 {
-    CheckConnection();
-    if (resetClient)
+    if (!CheckConnection())
     {
         // Disconnected
         return false;
@@ -695,16 +1276,15 @@ bool DevKitMQTTClient_ReceiveEvent()
             return true;
         }
 
-        if (resetClient || SystemWiFiRSSI() == 0)
+        if (mqttState == MQTT_BACKOFF || SystemWiFiRSSI() == 0)
         {
             // Disconnected
             return false;
         }
 
-        ThreadAPI_Sleep(500);
+        ThreadAPI_Sleep(WORK_INTERVAL_MS);
     }
-    // Timeout
-    resetClient = true;
+    // Nothing came, a quiet connection is still a good one
     return false;
 }
 
@@ -736,7 +1316,7 @@ bool DevKitMQTTClient_SendEventInstance(EVENT_INSTANCE *event)
 
 void DevKitMQTTClient_Check(bool hasDelay)
 {
-    if (iotHubClientHandle == NULL || SystemWiFiRSSI() == 0)
+    if (mqttState == MQTT_IDLE || SystemWiFiRSSI() == 0)
     {
         return;
     }
@@ -744,8 +1324,7 @@ void DevKitMQTTClient_Check(bool hasDelay)
     int diff = hasDelay ? ((int)(SystemTickCounterRead() - iothub_check_ms)) : CHECK_INTERVAL_MS;
     if (diff >= CHECK_INTERVAL_MS)
     {
-        CheckConnection();
-        if (resetClient)
+        if (!CheckConnection())
         {
             // Disconnected
             return;
@@ -754,12 +1333,21 @@ void DevKitMQTTClient_Check(bool hasDelay)
         for (int i = 0; i < 5; i++)
         {
             IoTHubClient_LL_DoWork(iotHubClientHandle);
-            if (resetClient || SystemWiFiRSSI() == 0)
+            if (mqttState == MQTT_BACKOFF || SystemWiFiRSSI() == 0)
             {
                 // Disconnected
                 break;
             }
         }
+        if (eventSpool != NULL && mqttState != MQTT_BACKOFF)
+        {
+            ReplaySpool();
+        }
+        if (mqttState != MQTT_BACKOFF)
+        {
+            FlushBatchIfDue();
+            FlushReportedStateIfDue();
+        }
         iothub_check_ms = SystemTickCounterRead();
     }
 }
@@ -770,6 +1358,7 @@ void DevKitMQTTClient_Close(void)
     {
         IoTHubClient_LL_Destroy(iotHubClientHandle);
         iotHubClientHandle = NULL;
+        mqttState = MQTT_IDLE;
 
         if (!is_iothub_from_dps && iothub_hostname)
         {
@@ -811,7 +1400,9 @@ void DevKitMQTTClient_SetReportConfirmationCallback(REPORT_CONFIRMATION_CALLBACK
 
 void DevKitMQTTClient_Reset(void)
 {
-    resetClient = true;
+    // Re-connect right away
+    mqttState = MQTT_BACKOFF;
+    reconnect_ms = SystemTickCounterRead();
     CheckConnection();
 }
 
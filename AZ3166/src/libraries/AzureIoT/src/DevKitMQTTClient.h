@@ -13,6 +13,45 @@ extern "C"
 
 #define OPTION_MINI_SOLUTION_NAME "MiniSolution"
 #define OPTION_MODEL_ID "model_id"
+// Path of the files the events are kept in when they can't be sent, the file system must be mounted
+#define OPTION_SPOOL_PATH "SpoolPath"
+// Connection string the client is created with instead of the one in EEPROM, an empty string goes back to EEPROM
+#define OPTION_CONNECTION_STRING "ConnectionString"
+// Pointer to the IOTHUB_CLIENT_TRANSPORT_PROVIDER the client is created with, MQTT_Protocol when not set
+#define OPTION_TRANSPORT "Transport"
+
+// Most messages sent with DevKitMQTTClient_SendEventAsync that can wait for their confirmation at once
+#ifndef MQTT_SEND_WINDOW
+#define MQTT_SEND_WINDOW 4
+#endif
+
+// Largest message the readings of DevKitMQTTClient_BatchEvent are gathered in
+#ifndef MQTT_BATCH_MAX_SIZE
+#define MQTT_BATCH_MAX_SIZE 1024
+#endif
+
+// Longest time a reading waits in the batch before it's sent
+#ifndef MQTT_BATCH_DELAY_MS
+#define MQTT_BATCH_DELAY_MS 5000
+#endif
+
+// Message property holding the number of readings in a batch
+#define MQTT_BATCH_COUNT_PROPERTY "batchCount"
+
+// Longest time a state given to DevKitMQTTClient_ReportStateAsync waits to be merged with others
+#ifndef MQTT_REPORT_DELAY_MS
+#define MQTT_REPORT_DELAY_MS 1000
+#endif
+
+// Size of the merged reported state that makes it sent right away
+#ifndef MQTT_REPORT_MAX_SIZE
+#define MQTT_REPORT_MAX_SIZE 1024
+#endif
+
+// Most callers waiting for the confirmation of the merged reported state
+#ifndef MQTT_REPORT_MAX_WAITERS
+#define MQTT_REPORT_MAX_WAITERS 8
+#endif
 
 enum EVENT_TYPE
 {
@@ -71,13 +110,83 @@ bool DevKitMQTTClient_SetOption(const char* optionName, const void* value);
 
 /**
 * @brief    Asynchronous call to send the message specified by @p text.
+*           When OPTION_SPOOL_PATH is set, a message that can't be sent is kept in the spool
+*           and sent again, in order, once the connection is back.
 *
 * @param    text                The text message.
 *
-* @return   Return true if send successfully, or false if fails.
+* @return   Return true if send (or spooled) successfully, or false if fails.
 */
 bool DevKitMQTTClient_SendEvent(const char *text);
 
+/**
+* @brief    Queue the message specified by @p text without waiting for IoT Hub to confirm it.
+*           Several messages can be in flight, up to MQTT_SEND_WINDOW; they are sent and
+*           confirmed while DevKitMQTTClient_DoWork is called.
+*
+* @param    text                The text message.
+* @param    callback            Called with the tracking id once the message is confirmed or dropped, can be NULL.
+* @param    context             Passed to the callback.
+*
+* @return   Return the tracking id of the message, or -1 if it could not be queued
+*           (not connected or MQTT_SEND_WINDOW messages already in flight).
+*/
+int DevKitMQTTClient_SendEventAsync(const char *text, SEND_EVENT_CALLBACK callback, void *context);
+
+/**
+* @brief    Same as DevKitMQTTClient_SendEventAsync for a message event, the event is freed by the client.
+*/
+int DevKitMQTTClient_SendEventInstanceAsync(EVENT_INSTANCE *event, SEND_EVENT_CALLBACK callback, void *context);
+
+/**
+* @brief    Add the JSON value specified by @p text to the current batch. The batch is sent as one
+*           message holding a JSON array (content type application/json, property
+*           MQTT_BATCH_COUNT_PROPERTY set to the number of readings) when the next reading doesn't
+*           fit in MQTT_BATCH_MAX_SIZE, when MQTT_BATCH_DELAY_MS is over or on DevKitMQTTClient_FlushBatch.
+*           A reading too big for a batch is sent on its own. When OPTION_SPOOL_PATH is set, a batch
+*           that can't be sent is kept in the spool, sent later with the same properties, and a new
+*           batch is started.
+*
+* @param    text                The JSON value, e.g. an object with the reading.
+*
+* @return   Return true if the reading is batched or sent, or false if fails.
+*/
+bool DevKitMQTTClient_BatchEvent(const char *text);
+
+/**
+* @brief    Get room to write a reading of up to @p size bytes straight into the batch, instead of
+*           building it in another buffer first. Call DevKitMQTTClient_BatchCommit once written.
+*
+* @param    size                The most bytes the reading can take.
+*
+* @return   Return where to write the reading, or NULL if there is no room.
+*/
+char* DevKitMQTTClient_BatchReserve(int size);
+
+/**
+* @brief    Add the reading written at the place returned by DevKitMQTTClient_BatchReserve to the batch.
+*
+* @param    length              The number of bytes written, not more than the reserved size.
+*
+* @return   Return true if the reading is batched, or false if fails.
+*/
+bool DevKitMQTTClient_BatchCommit(int length);
+
+/**
+* @brief    Send the readings in the batch now, without waiting for the confirmation.
+*           When OPTION_SPOOL_PATH is set, a batch that can't be sent is kept in the spool.
+*
+* @return   Return true if the batch is empty, queued for sending or spooled, or false if fails.
+*/
+bool DevKitMQTTClient_FlushBatch(void);
+
+/**
+* @brief    Send and receive pending data with IoT hub once, without waiting.
+*
+* @return   Return the number of messages still waiting for their confirmation.
+*/
+int DevKitMQTTClient_DoWork(void);
+
 /**
 * @brief    Synchronous call to report the state specified by @p stateString.
 *
@@ -87,6 +196,29 @@ bool DevKitMQTTClient_SendEvent(const char *text);
 */
 bool DevKitMQTTClient_ReportState(const char *stateString);
 
+/**
+* @brief    Merge the reported state specified by @p stateString with the states not sent yet,
+*           a property given again replaces the earlier value. The merged state is sent as one
+*           update when MQTT_REPORT_DELAY_MS is over, when it grows to MQTT_REPORT_MAX_SIZE or on
+*           DevKitMQTTClient_FlushReportedState, and every caller is told of its confirmation.
+*           An object given for a property still pending as null (deleted) can't be merged, the
+*           deletion is sent first and false comes back when that fails.
+*
+* @param    stateString         The JSON object of reported state, copied.
+* @param    callback            Called with the status code of the update holding the state, can be NULL.
+* @param    context             Passed to the callback.
+*
+* @return   Return true if the state is merged, or false if fails.
+*/
+bool DevKitMQTTClient_ReportStateAsync(const char *stateString, REPORT_STATE_CALLBACK callback, void *context);
+
+/**
+* @brief    Send the merged reported state now, without waiting for the confirmation.
+*
+* @return   Return true if there is nothing to send or the state is queued for sending, or false if fails.
+*/
+bool DevKitMQTTClient_FlushReportedState(void);
+
 /**
 * @brief    Synchronous call to report the event specified by @p event.
 *
@@ -132,11 +264,13 @@ void DevKitMQTTClient_SetMessageCallback(MESSAGE_CALLBACK message_callback);
 
 /**
 * @brief    Sets up the device twin callback to be invoked when IoT Hub update device twin of the device.
+*           The payload is not '\0' terminated, JsonPath_Extract reads properties from it in place.
 */
 void DevKitMQTTClient_SetDeviceTwinCallback(DEVICE_TWIN_CALLBACK device_twin_callback);
 
 /**
 * @brief    Sets up the device method callback to be invoked when IoT Hub call method on the device.
+*           The payload is not '\0' terminated, JsonPath_Extract reads properties from it in place.
 */
 void DevKitMQTTClient_SetDeviceMethodCallback(DEVICE_METHOD_CALLBACK device_method_callback);
 
@@ -1,5 +1,5 @@
 #include "DevKitOTAUtils.h"
-#include "parson.h"
+#include "JsonPath.h"
 #include "DevKitMQTTClient.h"
 #include "ctype.h"
 #include "CheckSumUtils.h"
@@ -74,61 +74,59 @@ bool IoTHubClient_ReportOTAStatus(MAP_HANDLE OTAStatusMap)
     return result;
 }
 
-void ota_callback(const unsigned char *payLoad, size_t size)
+// Copy the string value of field to a new buffer
+static char* field_strdup(const JSON_PATH_FIELD *field)
 {
-    char *deviceTwinPayLoad = (char *)malloc(size + 1);
-    if (deviceTwinPayLoad != NULL)
+    int length = JsonPath_GetString(field, NULL, 0);
+    if (length < 0)
+    {
+        return NULL;
+    }
+    char *value = (char *)malloc(length + 1);
+    if (value != NULL)
     {
-        memcpy(deviceTwinPayLoad, payLoad, size);
-        deviceTwinPayLoad[size] = '\0';
+        JsonPath_GetString(field, value, length + 1);
     }
-    else
+    return value;
+}
+
+void ota_callback(const unsigned char *payLoad, size_t size)
+{
+    // A full twin has the properties under "desired", an update has them at the top
+    JSON_PATH_FIELD twinFields[] = { { "" }, { "desired" }, { "desired.firmware" }, { "firmware" } };
+    if (JsonPath_Extract(payLoad, size, twinFields, 4) < 0 || twinFields[0].value[0] != '{')
     {
+        LogError("Parse the device twin failed");
         return;
     }
-    
-    JSON_Value *root_value;
-    root_value = json_parse_string(deviceTwinPayLoad);
-    if (json_value_get_type(root_value) != JSONObject)
+
+    const JSON_PATH_FIELD *firmware = (twinFields[1].value != NULL) ? &twinFields[2] : &twinFields[3];
+    if (firmware->value == NULL || firmware->value[0] != '{')
     {
-        if (root_value != NULL)
-        {
-            json_value_free(root_value);
-        }
-        LogError("Parse %s failed", deviceTwinPayLoad);
-        free(deviceTwinPayLoad);
         return;
     }
-    
-    JSON_Object *root_object = json_value_get_object(root_value);
-    JSON_Object *desired_object = json_object_get_object(root_object, "desired");
-    desired_object = desired_object == NULL ? root_object : desired_object;
-    if (desired_object != NULL)
+
+    JSON_PATH_FIELD fwFields[] = { { "fwVersion" }, { "fwPackageURI" }, { "fwPackageCheckValue" }, { "fwSize" } };
+    JsonPath_Extract(firmware->value, firmware->length, fwFields, 4);
+
+    if (latestFwInfo)
+    {
+        fw_info_free(latestFwInfo);
+        latestFwInfo = NULL;
+    }
+    latestFwInfo = (FW_INFO*)malloc(sizeof(FW_INFO));
+    if (latestFwInfo)
     {
-        JSON_Object* firmwareVal = json_object_get_object(desired_object, "firmware");
-        if (firmwareVal != NULL)
+        latestFwInfo->fwVersion = field_strdup(&fwFields[0]);
+        latestFwInfo->fwPackageURI = field_strdup(&fwFields[1]);
+        latestFwInfo->fwPackageCheckValue = field_strdup(&fwFields[2]);
+        double fwSize = 0;
+        JsonPath_GetNumber(&fwFields[3], &fwSize);
+        latestFwInfo->fwSize = fwSize;
+        if (latestFwInfo->fwVersion == NULL || latestFwInfo->fwPackageURI == NULL)
         {
-            if (latestFwInfo)
-            {
-                fw_info_free(latestFwInfo);
-                latestFwInfo = NULL;
-            }
-            latestFwInfo = (FW_INFO*)malloc(sizeof(FW_INFO));
-            if (latestFwInfo)
-            {
-                latestFwInfo->fwVersion = strdup(json_object_get_string(firmwareVal, "fwVersion"));
-                latestFwInfo->fwPackageURI = strdup(json_object_get_string(firmwareVal, "fwPackageURI"));
-                latestFwInfo->fwPackageCheckValue = strdup(json_object_get_string(firmwareVal, "fwPackageCheckValue"));
-                latestFwInfo->fwSize = json_object_get_number(firmwareVal, "fwSize");
-                if (latestFwInfo->fwVersion == NULL || latestFwInfo->fwPackageURI == NULL)
-                {
-                    fw_info_free(latestFwInfo);
-                    latestFwInfo = NULL;
-                }
-            }
+            fw_info_free(latestFwInfo);
+            latestFwInfo = NULL;
         }
     }
-    
-    json_value_free(root_value);
-    free(deviceTwinPayLoad);
 }
\ No newline at end of file
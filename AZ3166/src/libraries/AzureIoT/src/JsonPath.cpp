@@ -0,0 +1,477 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "JsonPath.h"
+
+#define NUMBER_MAX_LENGTH 32
+
+typedef struct
+{
+    const unsigned char *pos;
+    const unsigned char *end;
+    JSON_PATH_FIELD *fields;
+    int count;
+    int found;
+    int depth;
+    // Member names from the top down to the current value, NULL for an array item
+    const unsigned char *keys[JSON_PATH_MAX_DEPTH];
+    int keyLengths[JSON_PATH_MAX_DEPTH];
+} JSON_PARSER;
+
+static bool parse_value(JSON_PARSER *parser);
+
+static void skip_space(JSON_PARSER *parser)
+{
+    while (parser->pos < parser->end
+        && (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\r' || *parser->pos == '\n'))
+    {
+        parser->pos++;
+    }
+}
+
+static bool all_found(const JSON_PARSER *parser)
+{
+    return (parser->count > 0 && parser->found == parser->count);
+}
+
+// Move past the string starting at the current position, which is a '"'
+static bool skip_string(JSON_PARSER *parser)
+{
+    const unsigned char *p = parser->pos + 1;
+    while (p < parser->end)
+    {
+        if (*p == '"')
+        {
+            parser->pos = p + 1;
+            return true;
+        }
+        if (*p < 0x20)
+        {
+            return false;
+        }
+        if (*p == '\\')
+        {
+            // The escaped char, the digits of \uXXXX are plain chars
+            p++;
+        }
+        p++;
+    }
+    return false;
+}
+
+// Move past a number, true, false or null
+static bool skip_literal(JSON_PARSER *parser)
+{
+    const unsigned char *start = parser->pos;
+    while (parser->pos < parser->end && (isalnum(*parser->pos) || *parser->pos == '-' || *parser->pos == '+' || *parser->pos == '.'))
+    {
+        parser->pos++;
+    }
+
+    int length = parser->pos - start;
+    if (length == 0)
+    {
+        return false;
+    }
+    if (*start == '-' || isdigit(*start))
+    {
+        return true;
+    }
+    return ((length == 4 && memcmp(start, "true", 4) == 0)
+        || (length == 5 && memcmp(start, "false", 5) == 0)
+        || (length == 4 && memcmp(start, "null", 4) == 0));
+}
+
+static bool match_path(const JSON_PARSER *parser, const char *path)
+{
+    for (int i = 0; i < parser->depth; i++)
+    {
+        if (parser->keys[i] == NULL)
+        {
+            return false;
+        }
+        if (i > 0)
+        {
+            if (*path != '.')
+            {
+                return false;
+            }
+            path++;
+        }
+        if (strncmp(path, (const char *)parser->keys[i], parser->keyLengths[i]) != 0)
+        {
+            return false;
+        }
+        path += parser->keyLengths[i];
+    }
+    return (*path == '\0');
+}
+
+static bool parse_object(JSON_PARSER *parser)
+{
+    parser->pos++;
+    skip_space(parser);
+    if (parser->pos < parser->end && *parser->pos == '}')
+    {
+        parser->pos++;
+        return true;
+    }
+    if (parser->depth == JSON_PATH_MAX_DEPTH)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        skip_space(parser);
+        if (parser->pos >= parser->end || *parser->pos != '"')
+        {
+            return false;
+        }
+        const unsigned char *key = parser->pos + 1;
+        if (!skip_string(parser))
+        {
+            return false;
+        }
+        parser->keys[parser->depth] = key;
+        parser->keyLengths[parser->depth] = parser->pos - 1 - key;
+
+        skip_space(parser);
+        if (parser->pos >= parser->end || *parser->pos != ':')
+        {
+            return false;
+        }
+        parser->pos++;
+
+        parser->depth++;
+        bool valid = parse_value(parser);
+        parser->depth--;
+        if (!valid)
+        {
+            return false;
+        }
+        if (all_found(parser))
+        {
+            // The rest is not read
+            return true;
+        }
+
+        skip_space(parser);
+        if (parser->pos >= parser->end)
+        {
+            return false;
+        }
+        if (*parser->pos == '}')
+        {
+            parser->pos++;
+            return true;
+        }
+        if (*parser->pos != ',')
+        {
+            return false;
+        }
+        parser->pos++;
+    }
+}
+
+static bool parse_array(JSON_PARSER *parser)
+{
+    parser->pos++;
+    skip_space(parser);
+    if (parser->pos < parser->end && *parser->pos == ']')
+    {
+        parser->pos++;
+        return true;
+    }
+    if (parser->depth == JSON_PATH_MAX_DEPTH)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        parser->keys[parser->depth] = NULL;
+        parser->depth++;
+        bool valid = parse_value(parser);
+        parser->depth--;
+        if (!valid)
+        {
+            return false;
+        }
+        if (all_found(parser))
+        {
+            return true;
+        }
+
+        skip_space(parser);
+        if (parser->pos >= parser->end)
+        {
+            return false;
+        }
+        if (*parser->pos == ']')
+        {
+            parser->pos++;
+            return true;
+        }
+        if (*parser->pos != ',')
+        {
+            return false;
+        }
+        parser->pos++;
+    }
+}
+
+static bool parse_value(JSON_PARSER *parser)
+{
+    skip_space(parser);
+    if (parser->pos >= parser->end)
+    {
+        return false;
+    }
+
+    const unsigned char *start = parser->pos;
+    bool valid;
+    switch (*start)
+    {
+    case '{':
+        valid = parse_object(parser);
+        break;
+    case '[':
+        valid = parse_array(parser);
+        break;
+    case '"':
+        valid = skip_string(parser);
+        break;
+    default:
+        valid = skip_literal(parser);
+        break;
+    }
+    if (!valid)
+    {
+        return false;
+    }
+
+    // A container left before its end holds every path, it can't be one of them
+    for (int i = 0; i < parser->count; i++)
+    {
+        JSON_PATH_FIELD *field = &parser->fields[i];
+        if (field->value == NULL && field->path != NULL && match_path(parser, field->path))
+        {
+            field->value = start;
+            field->length = parser->pos - start;
+            parser->found++;
+        }
+    }
+    return true;
+}
+
+static bool read_hex4(const unsigned char *p, const unsigned char *end, unsigned int *code)
+{
+    if (end - p < 4)
+    {
+        return false;
+    }
+    *code = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int c = p[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+        {
+            digit = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            digit = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            digit = c - 'A' + 10;
+        }
+        else
+        {
+            return false;
+        }
+        *code = (*code << 4) | digit;
+    }
+    return true;
+}
+
+// Write the UTF-8 bytes of code when out is not NULL, return how many there are
+static int put_utf8(char *out, unsigned int code)
+{
+    char bytes[4];
+    int count;
+    if (code < 0x80)
+    {
+        bytes[0] = code;
+        count = 1;
+    }
+    else if (code < 0x800)
+    {
+        bytes[0] = 0xC0 | (code >> 6);
+        bytes[1] = 0x80 | (code & 0x3F);
+        count = 2;
+    }
+    else if (code < 0x10000)
+    {
+        bytes[0] = 0xE0 | (code >> 12);
+        bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[2] = 0x80 | (code & 0x3F);
+        count = 3;
+    }
+    else
+    {
+        bytes[0] = 0xF0 | (code >> 18);
+        bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+        bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[3] = 0x80 | (code & 0x3F);
+        count = 4;
+    }
+    if (out != NULL)
+    {
+        memcpy(out, bytes, count);
+    }
+    return count;
+}
+
+// Decode the string between p and end to out when it is not NULL, return the length or -1
+static int decode_string(const unsigned char *p, const unsigned char *end, char *out)
+{
+    int length = 0;
+    while (p < end)
+    {
+        unsigned int c = *p++;
+        if (c == '\\')
+        {
+            if (p >= end)
+            {
+                return -1;
+            }
+            c = *p++;
+            switch (c)
+            {
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+            {
+                if (!read_hex4(p, end, &c))
+                {
+                    return -1;
+                }
+                p += 4;
+                // A surrogate pair is one char
+                unsigned int low;
+                if (c >= 0xD800 && c < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                    && read_hex4(p + 2, end, &low) && low >= 0xDC00 && low < 0xE000)
+                {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                length += put_utf8(out == NULL ? NULL : out + length, c);
+                continue;
+            }
+            default:
+                // '"', '\\' and '/' stand for themselves
+                break;
+            }
+        }
+        if (out != NULL)
+        {
+            out[length] = c;
+        }
+        length++;
+    }
+    return length;
+}
+
+int JsonPath_Extract(const unsigned char *json, size_t size, JSON_PATH_FIELD *fields, int count)
+{
+    if (json == NULL || count < 0 || (fields == NULL && count > 0))
+    {
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        fields[i].value = NULL;
+        fields[i].length = 0;
+    }
+
+    JSON_PARSER parser;
+    parser.pos = json;
+    parser.end = json + size;
+    parser.fields = fields;
+    parser.count = count;
+    parser.found = 0;
+    parser.depth = 0;
+    if (!parse_value(&parser))
+    {
+        return -1;
+    }
+    if (!all_found(&parser))
+    {
+        skip_space(&parser);
+        if (parser.pos != parser.end)
+        {
+            return -1;
+        }
+    }
+    return parser.found;
+}
+
+int JsonPath_GetString(const JSON_PATH_FIELD *field, char *buffer, int size)
+{
+    if (field == NULL || field->value == NULL || field->length < 2 || field->value[0] != '"')
+    {
+        return -1;
+    }
+    const unsigned char *start = field->value + 1;
+    const unsigned char *end = field->value + field->length - 1;
+    int length = decode_string(start, end, NULL);
+    if (length >= 0 && buffer != NULL && size > length)
+    {
+        decode_string(start, end, buffer);
+        buffer[length] = '\0';
+    }
+    return length;
+}
+
+bool JsonPath_GetNumber(const JSON_PATH_FIELD *field, double *value)
+{
+    if (field == NULL || field->value == NULL || value == NULL || field->length <= 0 || field->length >= NUMBER_MAX_LENGTH)
+    {
+        return false;
+    }
+    char number[NUMBER_MAX_LENGTH];
+    memcpy(number, field->value, field->length);
+    number[field->length] = '\0';
+    if (number[0] != '-' && !isdigit((unsigned char)number[0]))
+    {
+        return false;
+    }
+
+    char *end;
+    double result = strtod(number, &end);
+    if (*end != '\0')
+    {
+        return false;
+    }
+    *value = result;
+    return true;
+}
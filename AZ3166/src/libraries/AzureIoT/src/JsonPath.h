@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license.
+
+#ifndef __JSON_PATH_H__
+#define __JSON_PATH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Deepest nesting of objects and arrays a payload can have
+#ifndef JSON_PATH_MAX_DEPTH
+#define JSON_PATH_MAX_DEPTH 16
+#endif
+
+typedef struct
+{
+    const char *path;               // Member names separated by '.', e.g. "desired.firmware.fwVersion"
+    const unsigned char *value;     // Set to the value in the payload (quotes included for a string), NULL if not found
+    int length;                     // Set to the length of the value
+} JSON_PATH_FIELD;
+
+/**
+* @brief    Find the values of the given paths in a JSON payload, such as the one given to a device
+*           twin or direct method callback. The payload is read in place: it doesn't need to end with
+*           '\0', nothing is allocated and the parsing stops once every path is found. The values
+*           point into the payload and stay valid as long as it does.
+*
+* @param    json                The JSON payload.
+* @param    size                The length of the payload.
+* @param    fields              The paths to look for, their value and length are set.
+* @param    count               The number of fields.
+*
+* @return   Return the number of paths found, or -1 if the payload is not valid JSON.
+*/
+int JsonPath_Extract(const unsigned char *json, size_t size, JSON_PATH_FIELD *fields, int count);
+
+/**
+* @brief    Get the string value of @p field without the quotes and with the escapes decoded. The
+*           string is copied only when @p buffer is big enough, so the call can be made with a NULL
+*           buffer first to get the length.
+*
+* @param    field               A field set by JsonPath_Extract.
+* @param    buffer              Where to copy the string and its ending '\0', can be NULL.
+* @param    size                The size of the buffer.
+*
+* @return   Return the length of the string without the '\0', or -1 if the value is not a string.
+*/
+int JsonPath_GetString(const JSON_PATH_FIELD *field, char *buffer, int size);
+
+/**
+* @brief    Get the number value of @p field.
+*
+* @return   Return true if the value is a number, or false if not.
+*/
+bool JsonPath_GetNumber(const JSON_PATH_FIELD *field, double *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JSON_PATH_H__ */
@@ -29,6 +29,19 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+// Deliver the payload of a PUBLISH too big for the packet buffer to the handler in pieces
+// (see Message::offset), otherwise such a message is dropped
+#if !defined(MQTTCLIENT_STREAMING)
+    #define MQTTCLIENT_STREAMING 0
+#endif
+// Topic levels a subscription takes on average, the topic tree has this many nodes per message handler
+#if !defined(MQTTCLIENT_TOPIC_LEVELS)
+    #define MQTTCLIENT_TOPIC_LEVELS 4
+#endif
+// QoS1 and QoS2 publishes which can wait for their acks at the same time (see Client::publishAsync)
+#if !defined(MQTTCLIENT_INFLIGHT_MESSAGES)
+    #define MQTTCLIENT_INFLIGHT_MESSAGES 4
+#endif
 
 namespace MQTT
 {
@@ -45,6 +58,8 @@ namespace MQTT
         unsigned short id;
         void *payload;
         size_t payloadlen;
+        size_t offset;      // where payload starts in the whole payload, not 0 for the next pieces of a streamed message
+        size_t totallen;    // length of the whole payload, more than payloadlen for a streamed message
     };
 
 
@@ -82,7 +97,8 @@ namespace MQTT
     * @brief blocking, non-threaded MQTT client API
     *
     * This version of the API blocks on all method calls, until they are complete.  This means that only one
-    * MQTT request can be in process at any one time.
+    * MQTT request can be in process at any one time.  The exception is publishAsync, which lets up to
+    * MQTTCLIENT_INFLIGHT_MESSAGES publishes wait for their acks while yield is called.
     * @param Network a network class which supports send, receive
     * @param Timer a timer class with the methods:
     */
@@ -92,6 +108,7 @@ namespace MQTT
     public:
 
         typedef void (*messageHandler)(MessageData&);
+        typedef void (*publishHandler)(unsigned short id, int rc, void* context);
 
         /** Construct the client
         *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
@@ -150,6 +167,19 @@ namespace MQTT
         */
         int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+        /** MQTT Publish - send an MQTT publish packet without waiting for the acks.  The acks are read by yield
+        *  (or any other call), a QoS1 or QoS2 publish takes an in-flight slot until then and is sent again
+        *  with the DUP flag on reconnect.
+        *  @param topic - the topic to publish to, must stay valid until the handler is called
+        *  @param message - the message to send, its payload must stay valid until the handler is called.
+        *      message.id is set to the packet id used
+        *  @param handler - called with the packet id and SUCCESS when the publish is complete, or FAILURE when
+        *      it is dropped by a reconnect with a clean session.  Not called for QoS0
+        *  @param context - passed to the handler
+        *  @return success code - FAILURE if all the in-flight slots are taken, see inflightMessageCount
+        */
+        int publishAsync(const char* topicName, Message& message, publishHandler handler, void* context = 0);
+
         /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
         *  @param topicFilter - a topic pattern which can include wildcards
         *  @param qos - the MQTT QoS to subscribe at
@@ -185,24 +215,39 @@ namespace MQTT
             return isconnected;
         }
 
+        /** How many QoS1 and QoS2 publishes are waiting for their acks?
+        *  @return count - MQTTCLIENT_INFLIGHT_MESSAGES when no more can be sent
+        */
+        int inflightMessageCount()
+        {
+            return inflightCount;
+        }
+
     private:
 
         int cycle(Timer& timer);
         int waitfor(int packet_type, Timer& timer);
         int keepalive();
-        int publish(int len, Timer& timer, enum QoS qos);
+        int sendPublish(const char* topicName, Message& message, Timer& timer);
 
         int decodePacket(int* value, int timeout);
         int readPacket(Timer& timer);
-        int sendPacket(int length, Timer& timer);
+        int readPublishHeader(MQTTHeader header, int rem_len, Timer& timer);
+        int skipBytes(int length, Timer& timer);
+        int sendBytes(unsigned char* buf, int length, Timer& timer);
+        int sendPacket(int length, Timer& timer, unsigned char* payload = 0, int payloadlen = 0);
         int deliverMessage(MQTTString& topicName, Message& message);
-        bool isTopicMatched(char* topicFilter, MQTTString& topicName);
+        void deliverPublish(MQTTString& topicName, Message& message);
+        bool addTopicFilter(const char* topicFilter, int handler);
+        int deliverToMatches(int first, const char* level, const char* topicEnd, MessageData& md);
+        int deliverToHandlers(int handler, MessageData& md);
 
         Network& ipstack;
         unsigned long command_timeout_ms;
 
         unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
         unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+        int payloadLeft;    // bytes of the PUBLISH in readbuf still on the network
 
         Timer last_sent, last_received;
         unsigned int keepAliveInterval;
@@ -215,21 +260,51 @@ namespace MQTT
         {
             const char* topicFilter;
             FP<void, MessageData&> fp;
+            short next;         // next handler of the same topic filter, -1 for none
         } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
 
+        // The topic filters subscribed to, as a tree with one node per topic level.  A received topic
+        // is matched by following its levels down the tree, instead of trying every filter.
+        struct TopicNode
+        {
+            const char* level;      // points into the topic filter, not '\0' terminated
+            unsigned short levellen;
+            short child;            // first node of the next level, -1 for none
+            short sibling;          // next node of the same level, -1 for none
+            short handler;          // first handler of the filter ending here, -1 for none
+        } topicNodes[MAX_MESSAGE_HANDLERS * MQTTCLIENT_TOPIC_LEVELS];
+        short topicRoot;            // first node of the first level
+        int topicNodeCount;
+
         FP<void, MessageData&> defaultMessageHandler;
 
         bool isconnected;
+        int inflightCount;
 
     #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-        unsigned char pubbuf[MAX_MQTT_PACKET_SIZE];  // store the last publish for sending on reconnect
+        // The QoS1 and QoS2 publishes sent and not yet acknowledged, found by packet id
+        struct InflightMessage
+        {
+            Message message;        // message.id is 0 for a free slot
+            const char* topicName;
+            bool pubrel;            // PUBREC received, the PUBREL is sent on reconnect instead of the publish
+            Timer timer;            // the ack is due before it expires
+            publishHandler handler;
+            void* context;
+        } inflight[MQTTCLIENT_INFLIGHT_MESSAGES];
+        unsigned char pubbuf[MAX_MQTT_PACKET_SIZE];  // store a publish given up on by publish for sending on reconnect
+        int pubbufSlot;             // the in-flight slot of the publish in pubbuf, -1 for none
         int inflightLen;
-        unsigned short inflightMsgid;
-        enum QoS inflightQoS;
+
+        int findInflight(unsigned short id);
+        int startPublish(const char* topicName, Message& message, publishHandler handler, void* context, Timer& timer);
+        void completeInflight(unsigned short id, int rc);
+        void keepInflight(int i);
+        int resumeInflight(Timer& timer);
+        static void waitHandler(unsigned short id, int rc, void* context);
     #endif
 
     #if MQTTCLIENT_QOS2
-        bool pubrel;
         #if !defined(MAX_INCOMING_QOS2_MESSAGES)
             #define MAX_INCOMING_QOS2_MESSAGES 10
         #endif
@@ -248,18 +323,23 @@ MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network,
     last_sent = Timer();
     last_received = Timer();
     ping_outstanding = false;
+    payloadLeft = 0;
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         messageHandlers[i].topicFilter = 0;
+    topicRoot = -1;
+    topicNodeCount = 0;
     this->command_timeout_ms = command_timeout_ms;
     isconnected = false;
+    inflightCount = 0;
     
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    inflightMsgid = 0;
-    inflightQoS = QOS0;
+    for (int i = 0; i < MQTTCLIENT_INFLIGHT_MESSAGES; ++i)
+        inflight[i].message.id = 0;
+    pubbufSlot = -1;
+    inflightLen = 0;
 #endif
 
 #if MQTTCLIENT_QOS2
-    pubrel = false;
     for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
         incomingQoS2messages[i] = 0;
 #endif
@@ -293,26 +373,31 @@ bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
 #endif
 
 template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+int MQTT::Client<Network, Timer, a, b>::sendBytes(unsigned char* buf, int length, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
 
     while (sent < length && !timer.expired())
     {
-        rc = ipstack.write(&sendbuf[sent], length, timer.left_ms());
+        rc = ipstack.write(&buf[sent], length - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
     }
-    if (sent == length)
-    {
-        if (this->keepAliveInterval > 0)
-            last_sent.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet
-        rc = SUCCESS;
-    }
-    else
-        rc = FAILURE;
+    return (sent == length) ? SUCCESS : FAILURE;
+}
+
+
+// The packet is in sendbuf, except the payload of a publish too big for it which is sent from where it is
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer, unsigned char* payload, int payloadlen)
+{
+    int rc = sendBytes(sendbuf, length, timer);
+    if (rc == SUCCESS && payloadlen > 0)
+        rc = sendBytes(payload, payloadlen, timer);
+    if (rc == SUCCESS && this->keepAliveInterval > 0)
+        last_sent.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet
         
 #if defined(MQTT_DEBUG)
     char printbuf[50];
@@ -357,14 +442,15 @@ exit:
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
  * @return the MQTT packet type, or -1 if none
  */
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::readPacket(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
     int len = 0;
     int rem_len = 0;
 
+    payloadLeft = 0;
     /* 1. read the header byte.  This has the packet type in it */
     if (ipstack.read(readbuf, 1, timer.left_ms()) != 1)
         goto exit;
@@ -372,13 +458,28 @@ int MQTT::Client<Network, Timer, a, b>::readPacket(Timer& timer)
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    header.byte = readbuf[0];
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
-        goto exit;
+    if (MQTTPacket_len(rem_len) > MAX_MQTT_PACKET_SIZE)
+    {
+        /* 3. too big for the buffer, only the payload of a publish can be left on the network */
+        if (header.bits.type != PUBLISH)
+        {
+            skipBytes(rem_len, timer);
+            goto exit;
+        }
+        if ((len = readPublishHeader(header, rem_len, timer)) < 0)
+            goto exit;
+    }
+    else
+    {
+        len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+
+        /* 3. read the rest of the buffer using a callback to supply the rest of the data */
+        if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
+            goto exit;
+    }
 
-    header.byte = readbuf[0];
     rc = header.bits.type;
     if (this->keepAliveInterval > 0)
         last_received.countdown(this->keepAliveInterval); // record the fact that we have successfully received a packet
@@ -392,62 +493,164 @@ exit:
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
+/**
+ * Read the topic and packet id of a publish too big for readbuf.  They are put in readbuf as a publish
+ * with no payload, and the length of the payload still on the network is kept in payloadLeft.
+ * @return the length of the packet in readbuf, or -1 if it can't be read
+ */
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPublishHeader(MQTTHeader header, int rem_len, Timer& timer)
+{
+    unsigned char topiclen[2];
+    if (rem_len < 2 || ipstack.read(topiclen, 2, timer.left_ms()) != 2)
+        return FAILURE;
+
+    int varlen = 2 + ((topiclen[0] << 8) | topiclen[1]) + (header.bits.qos > 0 ? 2 : 0);
+    if (varlen > rem_len)
+        return FAILURE;
+    int len = 1 + MQTTPacket_encode(readbuf + 1, varlen);
+    if (len + varlen >= MAX_MQTT_PACKET_SIZE)
+    {
+        // no room left for the payload, not even the topic fits
+        skipBytes(rem_len - 2, timer);
+        return FAILURE;
+    }
+
+    readbuf[len] = topiclen[0];
+    readbuf[len + 1] = topiclen[1];
+    if (varlen > 2 && ipstack.read(readbuf + len + 2, varlen - 2, timer.left_ms()) != varlen - 2)
+        return FAILURE;
+    payloadLeft = rem_len - varlen;
+    return len + varlen;
+}
+
+
+// read and drop data which can't be used, so the next packet is read from its start
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::skipBytes(int length, Timer& timer)
 {
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
+    while (length > 0)
+    {
+        int rc = ipstack.read(readbuf, (length < MAX_MQTT_PACKET_SIZE) ? length : MAX_MQTT_PACKET_SIZE, timer.left_ms());
+        if (rc <= 0)
+            return FAILURE;
+        length -= rc;
+    }
+    return SUCCESS;
+}
 
-    while (*curf && curn < curn_end)
+
+// Add the nodes of a topic filter to the topic tree, the filter must stay valid
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+bool MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::addTopicFilter(const char* topicFilter, int handler)
+{
+    short* link = &topicRoot;
+    const char* level = topicFilter;
+    while (true)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
+        const char* end = strchr(level, '/');
+        int len = (end != 0) ? end - level : strlen(level);
+
+        int node = *link;
+        while (node >= 0 && !(topicNodes[node].levellen == len && strncmp(topicNodes[node].level, level, len) == 0))
+            node = topicNodes[node].sibling;
+        if (node < 0)
+        {
+            if (topicNodeCount == MAX_MESSAGE_HANDLERS * MQTTCLIENT_TOPIC_LEVELS)
+                return false;
+            node = topicNodeCount++;
+            topicNodes[node].level = level;
+            topicNodes[node].levellen = len;
+            topicNodes[node].child = -1;
+            topicNodes[node].sibling = *link;
+            topicNodes[node].handler = -1;
+            *link = node;
         }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
 
-    return (curn == curn_end) && (*curf == '\0');
+        if (end == 0)
+        {
+            messageHandlers[handler].next = topicNodes[node].handler;
+            topicNodes[node].handler = handler;
+            return true;
+        }
+        link = &topicNodes[node].child;
+        level = end + 1;
+    }
 }
 
 
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::deliverToHandlers(int handler, MessageData& md)
+{
+    int rc = FAILURE;
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+    for (; handler >= 0; handler = messageHandlers[handler].next)
+    {
+        if (messageHandlers[handler].fp.attached())
+        {
+            messageHandlers[handler].fp(md);
+            rc = SUCCESS;
+        }
+    }
+    return rc;
+}
+
+
+// Deliver to the filters below the node first matching the topic from level on.  The recursion
+// goes no deeper than the filters do, and only branches at + and exact levels side by side.
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::deliverToMatches(int first, const char* level, const char* topicEnd, MessageData& md)
 {
     int rc = FAILURE;
+    const char* next = level;
+    while (next < topicEnd && *next != '/')
+        next++;
+    int len = next - level;
 
-    // we have to find the right message handler - indexed by topic
-    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    for (int node = first; node >= 0; node = topicNodes[node].sibling)
     {
-        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName)))
+        TopicNode& n = topicNodes[node];
+        if (n.levellen == 1 && n.level[0] == '#')
+        {
+            // matches this level and all the ones after
+            if (deliverToHandlers(n.handler, md) == SUCCESS)
+                rc = SUCCESS;
+        }
+        else if ((n.levellen == 1 && n.level[0] == '+') || (n.levellen == len && memcmp(n.level, level, len) == 0))
         {
-            if (messageHandlers[i].fp.attached())
+            if (next < topicEnd)
             {
-                MessageData md(topicName, message);
-                messageHandlers[i].fp(md);
+                if (deliverToMatches(n.child, next + 1, topicEnd, md) == SUCCESS)
+                    rc = SUCCESS;
+                continue;
+            }
+            if (deliverToHandlers(n.handler, md) == SUCCESS)
                 rc = SUCCESS;
+            // "a/#" matches "a" as well
+            for (int child = n.child; child >= 0; child = topicNodes[child].sibling)
+            {
+                if (topicNodes[child].levellen == 1 && topicNodes[child].level[0] == '#'
+                        && deliverToHandlers(topicNodes[child].handler, md) == SUCCESS)
+                    rc = SUCCESS;
             }
         }
     }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+{
+    MessageData md(topicName, message);
+
+    // we have to find the right message handlers - the topic tree is indexed by topic level
+    const char* topic = (topicName.cstring != 0) ? topicName.cstring : topicName.lenstring.data;
+    int topiclen = (topicName.cstring != 0) ? strlen(topicName.cstring) : topicName.lenstring.len;
+    int rc = deliverToMatches(topicRoot, topic, topic + topiclen, md);
 
     if (rc == FAILURE && defaultMessageHandler.attached())
     {
-        MessageData md(topicName, message);
         defaultMessageHandler(md);
         rc = SUCCESS;
     }
@@ -456,6 +659,38 @@ int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTSt
 }
 
 
+// Deliver a received publish.  The payload still on the network is read straight into readbuf after the topic
+// and delivered a piece at a time, what is not read here is skipped by cycle
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::deliverPublish(MQTTString& topicName, Message& message)
+{
+    message.offset = 0;
+    message.totallen = message.payloadlen + payloadLeft;
+    if (payloadLeft == 0)
+    {
+        deliverMessage(topicName, message);
+        return;
+    }
+
+#if MQTTCLIENT_STREAMING
+    Timer timer = Timer(command_timeout_ms);
+    unsigned char* piece = (unsigned char*)message.payload;
+    int piecelen = readbuf + MAX_MQTT_PACKET_SIZE - piece;
+    while (payloadLeft > 0)
+    {
+        int rc = ipstack.read(piece, (payloadLeft < piecelen) ? payloadLeft : piecelen, timer.left_ms());
+        if (rc <= 0)
+            break;
+        message.payload = piece;
+        message.payloadlen = rc;
+        deliverMessage(topicName, message);
+        message.offset += rc;
+        payloadLeft -= rc;
+    }
+#endif
+}
+
+
 
 template<class Network, class Timer, int a, int b>
 int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
@@ -491,9 +726,19 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
     switch (packet_type)
     {
         case CONNACK:
-        case PUBACK:
         case SUBACK:
             break;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+                completeInflight(mypacketid, SUCCESS);
+            break;
+        }
+#endif
         case PUBLISH:
             MQTTString topicName;
             Message msg;
@@ -503,16 +748,25 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 #if MQTTCLIENT_QOS2
             if (msg.qos != QOS2)
 #endif
-                deliverMessage(topicName, msg);
+                deliverPublish(topicName, msg);
 #if MQTTCLIENT_QOS2
             else if (isQoS2msgidFree(msg.id))
             {
                 if (useQoS2msgid(msg.id))
-                    deliverMessage(topicName, msg);
+                    deliverPublish(topicName, msg);
                 else
                     WARN("Maximum number of incoming QoS2 messages exceeded");
             }   
 #endif
+            if (payloadLeft > 0)
+            {
+                Timer skip_timer = Timer(command_timeout_ms);
+                if (skipBytes(payloadLeft, skip_timer) != SUCCESS)
+                {
+                    rc = FAILURE;
+                    goto exit;
+                }
+            }
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
             if (msg.qos != QOS0)
             {
@@ -537,18 +791,38 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
                 rc = FAILURE;
             else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, mypacketid)) <= 0)
                 rc = FAILURE;
-            else if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
-                rc = FAILURE; // there was a problem
+            else
+            {
+                int i = findInflight(mypacketid);
+                if (i != FAILURE)
+                {
+                    inflight[i].pubrel = true;  // the publish is not sent again from now on
+                    if (pubbufSlot == i)
+                        pubbufSlot = -1;
+                }
+                if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
+                    rc = FAILURE; // there was a problem
+            }
             if (rc == FAILURE)
                 goto exit; // there was a problem
             break;
-        case PUBCOMP:
-            break;
 #endif
         case PINGRESP:
             ping_outstanding = false;
             break;
     }
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    // an ack which doesn't come means the connection is broken, what is in flight is sent again on reconnect
+    for (int i = 0; isconnected && inflightCount > 0 && i < MQTTCLIENT_INFLIGHT_MESSAGES; ++i)
+    {
+        if (inflight[i].message.id != 0 && inflight[i].timer.expired())
+        {
+            isconnected = false;
+            rc = FAILURE;
+            goto exit;
+        }
+    }
+#endif
     keepalive();
 exit:
     if (rc == SUCCESS)
@@ -633,23 +907,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     else
         rc = FAILURE;
         
-#if MQTTCLIENT_QOS2
-    // resend an inflight publish
-    if (inflightMsgid >0 && inflightQoS == QOS2 && pubrel)
-    {
-        if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
-            rc = FAILURE;
-        else
-            rc = publish(len, connect_timer, inflightQoS);
-    }
-    else
-#endif
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (inflightMsgid > 0)
-    {
-        memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
-    }
+    // resend the inflight publishes, their acks are read later on
+    if (rc == SUCCESS)
+        rc = resumeInflight(connect_timer);
 #endif
 
 exit:
@@ -696,9 +957,12 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
             {
                 if (messageHandlers[i].topicFilter == 0)
                 {
-                    messageHandlers[i].topicFilter = topicFilter;
-                    messageHandlers[i].fp.attach(messageHandler);
-                    rc = 0;
+                    if (addTopicFilter(topicFilter, i))
+                    {
+                        messageHandlers[i].topicFilter = topicFilter;
+                        messageHandlers[i].fp.attach(messageHandler);
+                        rc = 0;
+                    }
                     break;
                 }
             }
@@ -747,91 +1011,235 @@ exit:
 
 
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::sendPublish(const char* topicName, Message& message, Timer& timer)
 {
-    int rc;
-    
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
-        goto exit; // there was a problem
+    MQTTString topicString = MQTTString_initializer;
+    int streamlen = 0;
+
+    topicString.cstring = (char*)topicName;
+    int len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, message.dup, message.qos, message.retained, message.id,
+              topicString, (unsigned char*)message.payload, message.payloadlen);
+    if (len == MQTTPACKET_BUFFER_TOO_SHORT)
+    {
+        // the payload is sent from where it is, after the header
+        len = MQTTSerialize_publishHeader(sendbuf, MAX_MQTT_PACKET_SIZE, message.dup, message.qos, message.retained, message.id,
+              topicString, message.payloadlen);
+        streamlen = message.payloadlen;
+    }
+    if (len <= 0)
+        return FAILURE;
+    return sendPacket(len, timer, (unsigned char*)message.payload, streamlen);
+}
+
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+// the in-flight slot of a packet id, a free slot for id 0
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::findInflight(unsigned short id)
+{
+    for (int i = 0; i < MQTTCLIENT_INFLIGHT_MESSAGES; ++i)
+    {
+        if (inflight[i].message.id == id)
+            return i;
+    }
+    return FAILURE;
+}
+
+
+// send a QoS1 or QoS2 publish and keep it in a free slot until it is acknowledged, return the slot
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::startPublish(const char* topicName, Message& message, publishHandler handler, void* context, Timer& timer)
+{
+    int i = findInflight(0);
+    if (i == FAILURE)
+        return FAILURE;
+
+    // the packet id must not be the one of a publish still in flight
+    do
+        message.id = packetid.getNext();
+    while (findInflight(message.id) != FAILURE);
+    message.dup = false;
+
+    if (sendPublish(topicName, message, timer) != SUCCESS)
+    {
+        isconnected = false;
+        return FAILURE;
+    }
+
+    InflightMessage& m = inflight[i];
+    m.message = message;
+    m.topicName = topicName;
+    m.pubrel = false;
+    m.timer.countdown_ms(command_timeout_ms);
+    m.handler = handler;
+    m.context = context;
+    ++inflightCount;
+    return i;
+}
+
 
-#if MQTTCLIENT_QOS1 
-    if (qos == QOS1)
+template<class Network, class Timer, int a, int b>
+void MQTT::Client<Network, Timer, a, b>::completeInflight(unsigned short id, int rc)
+{
+    int i = findInflight(id);
+    if (id == 0 || i == FAILURE)
+        return;
+
+    // the slot is free before the handler runs, so it can publish again
+    publishHandler handler = inflight[i].handler;
+    void* context = inflight[i].context;
+    inflight[i].message.id = 0;
+    --inflightCount;
+    if (pubbufSlot == i)
+        pubbufSlot = -1;
+    if (handler != 0)
+        handler(id, rc, context);
+}
+
+
+// A publish given up on by the blocking publish.  Its payload can't be used once publish returns, so the
+// packet is copied to pubbuf to be sent on reconnect, if pubbuf is free.  Otherwise it is dropped.
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepInflight(int i)
+{
+    InflightMessage& m = inflight[i];
+    MQTTString topicString = MQTTString_initializer;
+
+    m.handler = 0;
+    if (m.pubrel)
+        return;     // only the PUBREL is sent again
+    if (!cleansession && pubbufSlot == -1)
     {
-        if (waitfor(PUBACK, timer) == PUBACK)
+        topicString.cstring = (char*)m.topicName;
+        inflightLen = MQTTSerialize_publish(pubbuf, MAX_MQTT_PACKET_SIZE, 1, m.message.qos, m.message.retained, m.message.id,
+              topicString, (unsigned char*)m.message.payload, m.message.payloadlen);
+        if (inflightLen > 0)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            pubbufSlot = i;
+            return;
         }
-        else
-            rc = FAILURE;
     }
-#elif MQTTCLIENT_QOS2
-    else if (qos == QOS2)
+    completeInflight(m.message.id, FAILURE);
+}
+
+
+// send again what is in flight with the DUP flag set, a clean session drops it instead
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::resumeInflight(Timer& timer)
+{
+    int rc = SUCCESS;
+
+    for (int i = 0; i < MQTTCLIENT_INFLIGHT_MESSAGES && rc == SUCCESS; ++i)
     {
-        if (waitfor(PUBCOMP, timer) == PUBCOMP)
+        InflightMessage& m = inflight[i];
+        if (m.message.id == 0)
+            continue;
+        if (cleansession)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            completeInflight(m.message.id, FAILURE);
+            continue;
+        }
+
+        if (m.pubrel)
+        {
+            int len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, m.message.id);
+            rc = (len > 0) ? sendPacket(len, timer) : FAILURE;
+        }
+        else if (pubbufSlot == i)
+        {
+            memcpy(sendbuf, pubbuf, inflightLen);
+            rc = sendPacket(inflightLen, timer);
         }
         else
-            rc = FAILURE;
+        {
+            m.message.dup = true;
+            rc = sendPublish(m.topicName, m.message, timer);
+        }
+        m.timer.countdown_ms(command_timeout_ms);
     }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b>
+void MQTT::Client<Network, Timer, a, b>::waitHandler(unsigned short, int rc, void* context)
+{
+    *(int*)context = rc;
+}
 #endif
 
-exit:
-    if (rc != SUCCESS)
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishAsync(const char* topicName, Message& message, publishHandler handler, void* context)
+{
+    int rc = FAILURE;
+    Timer timer = Timer(command_timeout_ms);
+
+    if (!isconnected)
+        goto exit;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (message.qos == QOS1 || message.qos == QOS2)
+    {
+        if (startPublish(topicName, message, handler, context, timer) != FAILURE)
+            rc = SUCCESS;
+        goto exit;
+    }
+#endif
+
+    message.id = 0;
+    message.dup = false;
+    if ((rc = sendPublish(topicName, message, timer)) != SUCCESS)
         isconnected = false;
+
+exit:
     return rc;
 }
 
 
-
+// the blocking publish is a window of one: wait for a free slot, then for the acks of this publish
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
 {
     int rc = FAILURE;
     Timer timer = Timer(command_timeout_ms);
-    MQTTString topicString = MQTTString_initializer;
-    int len = 0;
+    Message message;
+    int slot = FAILURE;
+    int result = 1;     // until the handler sets it
 
     if (!isconnected)
         goto exit;
-        
-    topicString.cstring = (char*)topicName;
+
+    message.qos = qos;
+    message.retained = retained;
+    message.dup = false;
+    message.id = 0;
+    message.payload = payload;
+    message.payloadlen = payloadlen;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     if (qos == QOS1 || qos == QOS2)
-        id = packetid.getNext();
-#endif
+    {
+        while (inflightCount == MQTTCLIENT_INFLIGHT_MESSAGES && isconnected && !timer.expired())
+            cycle(timer);
+        if ((slot = startPublish(topicName, message, waitHandler, &result, timer)) == FAILURE)
+            goto exit;
+        id = message.id;
 
-    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
-              topicString, (unsigned char*)payload, payloadlen);
-    if (len <= 0)
+        while (result > 0 && isconnected && !timer.expired())
+            cycle(timer);
+        if (result > 0)
+            keepInflight(slot);
+        else
+            rc = result;
         goto exit;
-        
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (!cleansession)
-    {
-        memcpy(pubbuf, sendbuf, len);
-        inflightMsgid = id;
-        inflightLen = len;
-        inflightQoS = qos;
-#if MQTTCLIENT_QOS2
-        pubrel = false;
-#endif
     }
 #endif
-        
-    rc = publish(len, timer, qos);
+
+    rc = sendPublish(topicName, message, timer);
 exit:
+    if (rc != SUCCESS)
+        isconnected = false;
     return rc;
 }
 
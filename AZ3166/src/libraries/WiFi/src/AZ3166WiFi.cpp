@@ -18,6 +18,7 @@
 #include "AZ3166WiFi.h"
 #include "EEPROMInterface.h"
 #include "EMW10xxInterface.h"
+#include "http_connection_pool.h"
 #include "SystemTime.h"
 #include "SystemWiFi.h"
 #include "Telemetry.h"
@@ -134,6 +135,8 @@ int WiFiClass::disconnect()
 
     if (is_station_inited)
     {
+        // Pooled keep-alive connections can't outlive the network
+        HttpConnectionPool::clear();
         ((EMW10xxInterface*)WiFiInterface())->set_interface(Station);
         WiFiInterface()->disconnect();
         is_station_inited = false;
@@ -18,9 +18,9 @@
 #include "Arduino.h"
 #include "IPAddress.h"
 #include "TCPSocket.h"
-#include "Print.h"
+#include "Stream.h"
 
-class WiFiClient : public Print
+class WiFiClient : public Stream
 {
 public:
   WiFiClient(TCPSocket* socket);
@@ -29,11 +29,12 @@ public:
 
   virtual int connect(IPAddress ip, unsigned short port);
   virtual int connect(const char *host, unsigned short port);
-  virtual unsigned int write(unsigned char);
-  virtual unsigned int write(const unsigned char *buf, unsigned int size);
+  virtual size_t write(unsigned char);
+  virtual size_t write(const unsigned char *buf, size_t size);
+  using Print::write; // pull in write(str) and write(buf, size) from Print
   virtual int available();
   virtual int read();
-  virtual int read(unsigned char *buf, unsigned int size);
+  virtual int read(unsigned char *buf, size_t size);
   virtual void flush();
   virtual void stop();
   virtual int connected();
@@ -22,6 +22,7 @@
 WiFiUDP::WiFiUDP()
 {
     _pUdpSocket = new UDPSocket();
+    _address = NULL;
 
     _localPort = 0;
     is_initialized = false;
@@ -120,12 +121,12 @@ size_t WiFiUDP::write(unsigned char data)
 
 size_t WiFiUDP::write(const unsigned char *buffer, size_t size)
 {
-    if (!is_initialized)
+    if (!is_initialized || _address == NULL)
     {
         return 0;
     }
-    _pUdpSocket->sendto(*_address, (char*)buffer, size);
-    return size;
+    int ret = _pUdpSocket->sendto(*_address, (char*)buffer, size);
+    return ret > 0 ? ret : 0;
 }
 
 int WiFiUDP::read()
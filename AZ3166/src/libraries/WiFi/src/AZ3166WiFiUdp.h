@@ -16,10 +16,11 @@
 #define wifiudp_h
 
 #include "UDPSocket.h"
+#include "Print.h"
 
 #define UDP_TX_PACKET_MAX_SIZE 24
 
-class WiFiUDP
+class WiFiUDP : public Print
 {
 private:
   uint16_t _port; // local port to listen on
@@ -50,6 +51,7 @@ public:
   virtual size_t write(unsigned char);
   // Write size bytes from buffer into the packet
   virtual size_t write(const unsigned char *buffer, size_t size);
+  using Print::write; // pull in write(str) and write(buf, size) from Print
 
   // Read a single byte from the current packet
   virtual int read();
@@ -0,0 +1,316 @@
+#define FAKE_IOTHUB_CONNECTION_STRING "HostName=fake.azure-devices.net;DeviceId=devkit;SharedAccessKey=AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA="
+
+// An IoT Hub transport in place of MQTT: the messages it takes stay in flight until the test
+// completes them, and the connection status is what the test reports
+class FakeIoTHubTransport
+{
+public:
+  static bool online;
+  static int created;
+  static int inFlight;
+  static int results[4];
+
+  static void reset()
+  {
+    online = true;
+    created = 0;
+    inFlight = 0;
+    memset(results, 0, sizeof(results));
+  }
+
+  static bool connect()
+  {
+    IOTHUB_CLIENT_TRANSPORT_PROVIDER transport = provider;
+    if (WiFi.status() != WL_CONNECTED && WiFi.begin() != WL_CONNECTED)
+    {
+      return false;
+    }
+    DevKitMQTTClient_SetOption(OPTION_CONNECTION_STRING, FAKE_IOTHUB_CONNECTION_STRING);
+    DevKitMQTTClient_SetOption(OPTION_TRANSPORT, &transport);
+    return DevKitMQTTClient_Init();
+  }
+
+  static void close()
+  {
+    IOTHUB_CLIENT_TRANSPORT_PROVIDER transport = MQTT_Protocol;
+    DevKitMQTTClient_Close();
+    DevKitMQTTClient_SetOption(OPTION_TRANSPORT, &transport);
+    DevKitMQTTClient_SetOption(OPTION_CONNECTION_STRING, "");
+  }
+
+  static void status(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
+  {
+    callbacks.connection_status_cb(result, reason, callbackContext);
+  }
+
+  // Confirm up to count of the oldest messages in flight with result
+  static void complete(IOTHUB_CLIENT_CONFIRMATION_RESULT result, int count)
+  {
+    DLIST_ENTRY completed;
+    DList_InitializeListHead(&completed);
+    for (int i = 0; i < count && !DList_IsListEmpty(&published); i++)
+    {
+      DList_InsertTailList(&completed, DList_RemoveHeadList(&published));
+      inFlight--;
+    }
+    callbacks.send_complete_cb(&completed, result, callbackContext);
+  }
+
+  // Run the client until it creates its transport again, return how long that took or -1
+  static int waitReconnect()
+  {
+    int count = created;
+    uint64_t start_ms = SystemTickCounterRead();
+    while (created == count && (int)(SystemTickCounterRead() - start_ms) < 10000)
+    {
+      DevKitMQTTClient_DoWork();
+      delay(10);
+    }
+    return (created == count) ? -1 : (int)(SystemTickCounterRead() - start_ms);
+  }
+
+  static void sent(int, IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *)
+  {
+    results[result]++;
+  }
+
+private:
+  static TRANSPORT_CALLBACKS_INFO callbacks;
+  static void *callbackContext;
+  static PDLIST_ENTRY waitingToSend;
+  static DLIST_ENTRY published;
+  static STRING_HANDLE hostname;
+  static bool reported;
+
+  static const TRANSPORT_PROVIDER *provider()
+  {
+    static TRANSPORT_PROVIDER table;
+    table.IoTHubTransport_SendMessageDisposition = sendMessageDisposition;
+    table.IoTHubTransport_Subscribe_DeviceMethod = subscribe;
+    table.IoTHubTransport_Unsubscribe_DeviceMethod = unsubscribe;
+    table.IoTHubTransport_DeviceMethod_Response = deviceMethodResponse;
+    table.IoTHubTransport_Subscribe_DeviceTwin = subscribe;
+    table.IoTHubTransport_Unsubscribe_DeviceTwin = unsubscribe;
+    table.IoTHubTransport_ProcessItem = processItem;
+    table.IoTHubTransport_GetHostname = getHostname;
+    table.IoTHubTransport_SetOption = setOption;
+    table.IoTHubTransport_Create = create;
+    table.IoTHubTransport_Destroy = destroy;
+    table.IoTHubTransport_Register = registerDevice;
+    table.IoTHubTransport_Unregister = unsubscribe;
+    table.IoTHubTransport_Subscribe = subscribe;
+    table.IoTHubTransport_Unsubscribe = unsubscribe;
+    table.IoTHubTransport_DoWork = doWork;
+    table.IoTHubTransport_SetRetryPolicy = setRetryPolicy;
+    table.IoTHubTransport_GetSendStatus = getSendStatus;
+    table.IoTHubTransport_Subscribe_InputQueue = subscribe;
+    table.IoTHubTransport_Unsubscribe_InputQueue = unsubscribe;
+    table.IoTHubTransport_SetCallbackContext = setCallbackContext;
+    table.IoTHubTransport_GetTwinAsync = getTwinAsync;
+    table.IoTHubTransport_GetSupportedPlatformInfo = getSupportedPlatformInfo;
+    return &table;
+  }
+
+  static TRANSPORT_LL_HANDLE create(const IOTHUBTRANSPORT_CONFIG *config, TRANSPORT_CALLBACKS_INFO *cb_info, void *ctx)
+  {
+    created++;
+    callbacks = *cb_info;
+    callbackContext = ctx;
+    waitingToSend = config->waitingToSend;
+    DList_InitializeListHead(&published);
+    inFlight = 0;
+    hostname = STRING_construct("fake.azure-devices.net");
+    reported = false;
+    return (TRANSPORT_LL_HANDLE)&published;
+  }
+
+  static void destroy(TRANSPORT_LL_HANDLE)
+  {
+    // Like MQTT, what was published and not acknowledged is dropped
+    complete(IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY, inFlight);
+    STRING_delete(hostname);
+    hostname = NULL;
+  }
+
+  static void doWork(TRANSPORT_LL_HANDLE)
+  {
+    if (!reported)
+    {
+      reported = true;
+      if (online)
+      {
+        status(IOTHUB_CLIENT_CONNECTION_AUTHENTICATED, IOTHUB_CLIENT_CONNECTION_OK);
+      }
+      else
+      {
+        status(IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED, IOTHUB_CLIENT_CONNECTION_NO_NETWORK);
+      }
+    }
+    while (online && !DList_IsListEmpty(waitingToSend))
+    {
+      DList_InsertTailList(&published, DList_RemoveHeadList(waitingToSend));
+      inFlight++;
+    }
+  }
+
+  static IOTHUB_DEVICE_HANDLE registerDevice(TRANSPORT_LL_HANDLE handle, const IOTHUB_DEVICE_CONFIG *, PDLIST_ENTRY waiting)
+  {
+    waitingToSend = waiting;
+    return (IOTHUB_DEVICE_HANDLE)handle;
+  }
+
+  static STRING_HANDLE getHostname(TRANSPORT_LL_HANDLE)
+  {
+    return hostname;
+  }
+
+  static IOTHUB_CLIENT_RESULT setOption(TRANSPORT_LL_HANDLE, const char *, const void *)
+  {
+    return IOTHUB_CLIENT_OK;
+  }
+
+  static int subscribe(IOTHUB_DEVICE_HANDLE)
+  {
+    return 0;
+  }
+
+  static void unsubscribe(IOTHUB_DEVICE_HANDLE)
+  {
+  }
+
+  static int setRetryPolicy(TRANSPORT_LL_HANDLE, IOTHUB_CLIENT_RETRY_POLICY, size_t)
+  {
+    return 0;
+  }
+
+  static IOTHUB_CLIENT_RESULT getSendStatus(IOTHUB_DEVICE_HANDLE, IOTHUB_CLIENT_STATUS *status)
+  {
+    *status = (inFlight > 0 || !DList_IsListEmpty(waitingToSend)) ? IOTHUB_CLIENT_SEND_STATUS_BUSY : IOTHUB_CLIENT_SEND_STATUS_IDLE;
+    return IOTHUB_CLIENT_OK;
+  }
+
+  static IOTHUB_CLIENT_RESULT getTwinAsync(IOTHUB_DEVICE_HANDLE, IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK, void *)
+  {
+    return IOTHUB_CLIENT_ERROR;
+  }
+
+  static IOTHUB_CLIENT_RESULT sendMessageDisposition(MESSAGE_CALLBACK_INFO *, IOTHUBMESSAGE_DISPOSITION_RESULT)
+  {
+    return IOTHUB_CLIENT_OK;
+  }
+
+  static IOTHUB_PROCESS_ITEM_RESULT processItem(TRANSPORT_LL_HANDLE, IOTHUB_IDENTITY_TYPE, IOTHUB_IDENTITY_INFO *)
+  {
+    return IOTHUB_PROCESS_ERROR;
+  }
+
+  static int deviceMethodResponse(IOTHUB_DEVICE_HANDLE, METHOD_HANDLE, const unsigned char *, size_t, int)
+  {
+    return 0;
+  }
+
+  static int setCallbackContext(TRANSPORT_LL_HANDLE, void *ctx)
+  {
+    callbackContext = ctx;
+    return 0;
+  }
+
+  static int getSupportedPlatformInfo(TRANSPORT_LL_HANDLE, PLATFORM_INFO_OPTION *info)
+  {
+    *info = PLATFORM_INFO_OPTION_DEFAULT;
+    return 0;
+  }
+};
+
+bool FakeIoTHubTransport::online;
+int FakeIoTHubTransport::created;
+int FakeIoTHubTransport::inFlight;
+int FakeIoTHubTransport::results[4];
+TRANSPORT_CALLBACKS_INFO FakeIoTHubTransport::callbacks;
+void *FakeIoTHubTransport::callbackContext;
+PDLIST_ENTRY FakeIoTHubTransport::waitingToSend;
+DLIST_ENTRY FakeIoTHubTransport::published;
+STRING_HANDLE FakeIoTHubTransport::hostname;
+bool FakeIoTHubTransport::reported;
+
+test(iothub_client_send_window)
+{
+  FakeIoTHubTransport::reset();
+  assertTrue(FakeIoTHubTransport::connect());
+  assertEqual(FakeIoTHubTransport::created, 1);
+
+  for (int i = 0; i < MQTT_SEND_WINDOW; i++)
+  {
+    assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), i);
+  }
+  // The window is full until a confirmation comes
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), -1);
+  assertEqual(DevKitMQTTClient_DoWork(), MQTT_SEND_WINDOW);
+  assertEqual(FakeIoTHubTransport::inFlight, MQTT_SEND_WINDOW);
+
+  FakeIoTHubTransport::complete(IOTHUB_CLIENT_CONFIRMATION_OK, 2);
+  assertEqual(FakeIoTHubTransport::results[IOTHUB_CLIENT_CONFIRMATION_OK], 2);
+  assertEqual(DevKitMQTTClient_DoWork(), MQTT_SEND_WINDOW - 2);
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), MQTT_SEND_WINDOW);
+
+  // Closing drops the messages in flight and the one not taken by the transport yet
+  DevKitMQTTClient_Close();
+  assertEqual(FakeIoTHubTransport::results[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY], MQTT_SEND_WINDOW - 1);
+  assertEqual(DevKitMQTTClient_DoWork(), 0);
+
+  // A closed client stays closed
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), -1);
+  assertEqual(FakeIoTHubTransport::created, 1);
+  FakeIoTHubTransport::close();
+
+  delay(LOOP_DELAY);
+}
+
+test(iothub_client_reconnect)
+{
+  FakeIoTHubTransport::reset();
+  assertTrue(FakeIoTHubTransport::connect());
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), 0);
+  assertEqual(DevKitMQTTClient_DoWork(), 1);
+
+  // The network is gone, the client is given up and created again after 1 s and up to half more,
+  // measured from a bit after it was scheduled
+  FakeIoTHubTransport::online = false;
+  FakeIoTHubTransport::status(IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED, IOTHUB_CLIENT_CONNECTION_NO_NETWORK);
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), -1);
+  int delay_ms = FakeIoTHubTransport::waitReconnect();
+  assertTrue(delay_ms >= 950 && delay_ms < 1600);
+  assertEqual(FakeIoTHubTransport::created, 2);
+
+  // The message in flight went with the old client
+  assertEqual(FakeIoTHubTransport::results[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY], 1);
+  assertEqual(DevKitMQTTClient_DoWork(), 0);
+
+  // The new client found no network either, the next try waits twice as long
+  FakeIoTHubTransport::online = true;
+  delay_ms = FakeIoTHubTransport::waitReconnect();
+  assertTrue(delay_ms >= 1950 && delay_ms < 3100);
+  assertEqual(FakeIoTHubTransport::created, 3);
+  assertEqual(DevKitMQTTClient_SendEventAsync("{\"reading\":1}", FakeIoTHubTransport::sent, NULL), 0);
+
+  // A quiet connection is kept
+  assertFalse(DevKitMQTTClient_ReceiveEvent());
+  assertEqual(FakeIoTHubTransport::created, 3);
+
+  // The transport retries a communication error by itself, the client keeps working with it
+  FakeIoTHubTransport::status(IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED, IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR);
+  assertEqual(DevKitMQTTClient_DoWork(), 1);
+  FakeIoTHubTransport::complete(IOTHUB_CLIENT_CONFIRMATION_OK, 1);
+  assertEqual(DevKitMQTTClient_DoWork(), 0);
+  FakeIoTHubTransport::status(IOTHUB_CLIENT_CONNECTION_AUTHENTICATED, IOTHUB_CLIENT_CONNECTION_OK);
+  assertEqual(FakeIoTHubTransport::created, 3);
+
+  // Once connected the backoff starts over
+  FakeIoTHubTransport::status(IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED, IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN);
+  delay_ms = FakeIoTHubTransport::waitReconnect();
+  assertTrue(delay_ms >= 950 && delay_ms < 1600);
+  assertEqual(FakeIoTHubTransport::created, 4);
+  FakeIoTHubTransport::close();
+
+  delay(LOOP_DELAY);
+}
@@ -0,0 +1,220 @@
+#define SPOOL_TEST_PATH     "/fs/spooltest"
+#define SPOOL_TEST_SEGMENT0 SPOOL_TEST_PATH ".0"
+#define SPOOL_TEST_SEGMENT1 SPOOL_TEST_PATH ".1"
+
+// 64 bytes a segment: an 8 byte header and three records of 8 data bytes
+#define SPOOL_TEST_SMALL    128
+
+SFlashBlockDevice spoolBlockDevice;
+FATFileSystem spoolFileSystem("fs");
+static bool spoolMounted = false;
+
+static bool spoolReset()
+{
+  if (!spoolMounted)
+  {
+    if (spoolFileSystem.mount(&spoolBlockDevice) != 0 || fatfs_get_info().total_space == 0)
+    {
+      spoolFileSystem.unmount();
+      if (FATFileSystem::format(&spoolBlockDevice) != 0 || spoolFileSystem.mount(&spoolBlockDevice) != 0)
+      {
+        return false;
+      }
+    }
+    spoolMounted = true;
+  }
+  remove(SPOOL_TEST_SEGMENT0);
+  remove(SPOOL_TEST_SEGMENT1);
+  return true;
+}
+
+static bool spoolFileExists(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  fclose(file);
+  return true;
+}
+
+static long spoolFileSize(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+// Compare the oldest record with text and pop it when it matches
+static bool spoolPopText(FileSpool &spool, const char *text)
+{
+  char record[32];
+  int size = strlen(text);
+  if (spool.peek(record, sizeof(record)) != size || memcmp(record, text, size) != 0)
+  {
+    return false;
+  }
+  return spool.pop() == 0;
+}
+
+test(file_spool_order)
+{
+  char record[8];
+
+  assertTrue(spoolReset());
+  FileSpool spool(SPOOL_TEST_PATH);
+  assertTrue(spool.empty());
+  assertEqual(spool.peek(record, sizeof(record)), 0);
+  assertEqual(spool.append(NULL, 4), FILE_SPOOL_ERROR_PARAMETER);
+  assertEqual(spool.append("one", 0), FILE_SPOOL_ERROR_PARAMETER);
+
+  assertEqual(spool.append("one", 3), 0);
+  assertEqual(spool.append("two", 3), 0);
+  assertEqual(spool.append("three", 5), 0);
+  assertFalse(spool.empty());
+
+  // The size comes back when the buffer is NULL or too small, nothing is removed
+  assertEqual(spool.peek(NULL, 0), 3);
+  assertEqual(spool.peek(record, 2), 3);
+  assertTrue(spoolPopText(spool, "one"));
+  assertTrue(spoolPopText(spool, "two"));
+  assertTrue(spoolPopText(spool, "three"));
+  assertTrue(spool.empty());
+
+  // The segment is deleted once all its records are popped
+  assertFalse(spoolFileExists(SPOOL_TEST_SEGMENT0));
+
+  delay(LOOP_DELAY);
+}
+
+test(file_spool_rollover)
+{
+  assertTrue(spoolReset());
+  FileSpool spool(SPOOL_TEST_PATH, SPOOL_TEST_SMALL);
+
+  assertEqual(spool.append("record-1", 8), 0);
+  assertEqual(spool.append("record-2", 8), 0);
+  assertEqual(spool.append("record-3", 8), 0);
+  assertFalse(spoolFileExists(SPOOL_TEST_SEGMENT1));
+  assertEqual(spool.append("record-4", 8), 0);
+  assertEqual(spool.append("record-5", 8), 0);
+  assertTrue(spoolFileExists(SPOOL_TEST_SEGMENT1));
+
+  assertTrue(spoolPopText(spool, "record-1"));
+  assertTrue(spoolPopText(spool, "record-2"));
+  assertTrue(spoolPopText(spool, "record-3"));
+  assertFalse(spoolFileExists(SPOOL_TEST_SEGMENT0));
+
+  // The second segment fills up, then the freed first one is used again
+  assertEqual(spool.append("record-6", 8), 0);
+  assertEqual(spool.append("record-7", 8), 0);
+  assertTrue(spoolFileExists(SPOOL_TEST_SEGMENT0));
+
+  assertTrue(spoolPopText(spool, "record-4"));
+  assertTrue(spoolPopText(spool, "record-5"));
+  assertTrue(spoolPopText(spool, "record-6"));
+  assertTrue(spoolPopText(spool, "record-7"));
+  assertTrue(spool.empty());
+  assertFalse(spoolFileExists(SPOOL_TEST_SEGMENT0));
+  assertFalse(spoolFileExists(SPOOL_TEST_SEGMENT1));
+
+  delay(LOOP_DELAY);
+}
+
+test(file_spool_full)
+{
+  uint8_t big[64];
+
+  assertTrue(spoolReset());
+  FileSpool spool(SPOOL_TEST_PATH, SPOOL_TEST_SMALL);
+  memset(big, 0x5A, sizeof(big));
+
+  // Larger than a segment, it can never fit
+  assertEqual(spool.append(big, 60), FILE_SPOOL_ERROR_FULL);
+
+  for (int i = 0; i < 6; i++)
+  {
+    assertEqual(spool.append("reading!", 8), 0);
+  }
+  assertEqual(spool.append("reading!", 8), FILE_SPOOL_ERROR_FULL);
+  assertEqual(spool.append("r", 1), FILE_SPOOL_ERROR_FULL);
+
+  // Emptying the oldest segment makes room again
+  assertTrue(spoolPopText(spool, "reading!"));
+  assertEqual(spool.append("reading!", 8), FILE_SPOOL_ERROR_FULL);
+  assertTrue(spoolPopText(spool, "reading!"));
+  assertTrue(spoolPopText(spool, "reading!"));
+  assertEqual(spool.append("reading!", 8), 0);
+
+  for (int i = 0; i < 4; i++)
+  {
+    assertTrue(spoolPopText(spool, "reading!"));
+  }
+  assertTrue(spool.empty());
+
+  delay(LOOP_DELAY);
+}
+
+test(file_spool_torn_record)
+{
+  assertTrue(spoolReset());
+  {
+    FileSpool spool(SPOOL_TEST_PATH);
+    assertEqual(spool.append("first", 5), 0);
+    assertEqual(spool.append("second", 6), 0);
+  }
+  long end = spoolFileSize(SPOOL_TEST_SEGMENT0);
+
+  // A power loss in the middle of an append: a complete header, then only 4 of its 10 bytes
+  FILE *file = fopen(SPOOL_TEST_SEGMENT0, "ab");
+  assertTrue(file != NULL);
+  uint16_t header[4] = { 0x5352, 10, (uint16_t)~10, 0 };
+  fwrite(header, sizeof(header), 1, file);
+  fwrite("torn", 1, 4, file);
+  fclose(file);
+  assertEqual(spoolFileSize(SPOOL_TEST_SEGMENT0), end + 12);
+
+  // Reopening finds the two complete records and stops at the torn one
+  FileSpool spool(SPOOL_TEST_PATH);
+  assertTrue(spoolPopText(spool, "first"));
+  assertEqual(spool.append("third", 5), 0);
+  assertEqual(spoolFileSize(SPOOL_TEST_SEGMENT0), end + 13);
+  assertTrue(spoolPopText(spool, "second"));
+  assertTrue(spoolPopText(spool, "third"));
+  assertTrue(spool.empty());
+
+  delay(LOOP_DELAY);
+}
+
+test(file_spool_late_mount)
+{
+  assertTrue(spoolReset());
+  {
+    FileSpool spool(SPOOL_TEST_PATH);
+    assertEqual(spool.append("before", 6), 0);
+  }
+
+  // Opened while the file system is not mounted, nothing can be found yet
+  spoolFileSystem.unmount();
+  spoolMounted = false;
+  FileSpool spool(SPOOL_TEST_PATH);
+  assertTrue(spool.empty());
+  assertEqual(spoolFileSystem.mount(&spoolBlockDevice), 0);
+  spoolMounted = true;
+  assertTrue(spoolFileExists(SPOOL_TEST_SEGMENT0));
+
+  // The segment from before is picked up by the append, not truncated
+  assertEqual(spool.append("after", 5), 0);
+  assertTrue(spoolPopText(spool, "before"));
+  assertTrue(spoolPopText(spool, "after"));
+  assertTrue(spool.empty());
+
+  delay(LOOP_DELAY);
+}
@@ -0,0 +1,178 @@
+static int jsonPathExtract(const char *json, JSON_PATH_FIELD *fields, int count)
+{
+  return JsonPath_Extract((const unsigned char *)json, strlen(json), fields, count);
+}
+
+test(json_path_extract)
+{
+  const char *json = "{ \"desired\": { \"firmware\": { \"fwVersion\": \"1.2.0\", \"fwSize\": 1024 }, \"list\": [1, {\"a\": 2}] }, \"$version\": 7 }";
+  JSON_PATH_FIELD fields[] = {
+    { "desired.firmware.fwVersion" },
+    { "desired.firmware.fwSize" },
+    { "$version" },
+    { "desired.missing" },
+    { "desired.list" }
+  };
+  char text[16];
+  double number;
+
+  assertEqual(jsonPathExtract(json, fields, 5), 4);
+  assertEqual(fields[0].length, 7);
+  assertEqual(memcmp(fields[0].value, "\"1.2.0\"", 7), 0);
+  assertEqual(JsonPath_GetString(&fields[0], text, sizeof(text)), 5);
+  assertEqual(strcmp(text, "1.2.0"), 0);
+  assertTrue(JsonPath_GetNumber(&fields[1], &number));
+  assertEqual((int)number, 1024);
+  assertTrue(JsonPath_GetNumber(&fields[2], &number));
+  assertEqual((int)number, 7);
+  assertTrue(fields[3].value == NULL);
+  assertEqual(memcmp(fields[4].value, "[1, {\"a\": 2}]", fields[4].length), 0);
+
+  // Wrong kinds of value
+  assertEqual(JsonPath_GetString(&fields[1], text, sizeof(text)), -1);
+  assertFalse(JsonPath_GetNumber(&fields[0], &number));
+  assertEqual(JsonPath_GetString(&fields[3], text, sizeof(text)), -1);
+
+  delay(LOOP_DELAY);
+}
+
+test(json_path_escapes)
+{
+  const char *json = "{\"s\": \"a\\\"b\\\\c\\/d\\n\\t\\u0041\\u00e9\\u20ac\"}";
+  JSON_PATH_FIELD field = { "s" };
+  char text[32];
+
+  assertEqual(jsonPathExtract(json, &field, 1), 1);
+  // a " b \ c / d LF TAB A, then 2 bytes for U+00E9 and 3 for U+20AC
+  assertEqual(JsonPath_GetString(&field, NULL, 0), 15);
+  // No room for the '\0', only the length comes back
+  text[0] = 'x';
+  assertEqual(JsonPath_GetString(&field, text, 15), 15);
+  assertEqual(text[0], 'x');
+  assertEqual(JsonPath_GetString(&field, text, sizeof(text)), 15);
+  assertEqual(memcmp(text, "a\"b\\c/d\n\tA\xC3\xA9\xE2\x82\xAC", 16), 0);
+
+  delay(LOOP_DELAY);
+}
+
+test(json_path_surrogates)
+{
+  JSON_PATH_FIELD field = { "s" };
+  char text[16];
+
+  // U+1F600 as a surrogate pair is one 4 byte char
+  assertEqual(jsonPathExtract("{\"s\": \"\\ud83d\\ude00!\"}", &field, 1), 1);
+  assertEqual(JsonPath_GetString(&field, text, sizeof(text)), 5);
+  assertEqual(memcmp(text, "\xF0\x9F\x98\x80!", 6), 0);
+
+  // A lone high surrogate is kept as a 3 byte char
+  assertEqual(jsonPathExtract("{\"s\": \"\\ud83dx\"}", &field, 1), 1);
+  assertEqual(JsonPath_GetString(&field, text, sizeof(text)), 4);
+  assertEqual(memcmp(text, "\xED\xA0\xBDx", 5), 0);
+
+  // Bad hex digits
+  assertEqual(jsonPathExtract("{\"s\": \"\\u12G4\"}", &field, 1), 1);
+  assertEqual(JsonPath_GetString(&field, text, sizeof(text)), -1);
+  assertEqual(jsonPathExtract("{\"s\": \"\\u12\"}", &field, 1), 1);
+  assertEqual(JsonPath_GetString(&field, text, sizeof(text)), -1);
+
+  delay(LOOP_DELAY);
+}
+
+test(json_path_depth)
+{
+  char json[2 * JSON_PATH_MAX_DEPTH + 8];
+  JSON_PATH_FIELD field = { "x" };
+
+  // As deep as allowed
+  int length = 0;
+  for (int i = 0; i < JSON_PATH_MAX_DEPTH; i++)
+  {
+    json[length++] = '[';
+  }
+  json[length++] = '1';
+  for (int i = 0; i < JSON_PATH_MAX_DEPTH; i++)
+  {
+    json[length++] = ']';
+  }
+  assertEqual(JsonPath_Extract((const unsigned char *)json, length, &field, 1), 0);
+
+  // One level more is rejected
+  length = 0;
+  for (int i = 0; i <= JSON_PATH_MAX_DEPTH; i++)
+  {
+    json[length++] = '[';
+  }
+  json[length++] = '1';
+  for (int i = 0; i <= JSON_PATH_MAX_DEPTH; i++)
+  {
+    json[length++] = ']';
+  }
+  assertEqual(JsonPath_Extract((const unsigned char *)json, length, &field, 1), -1);
+
+  // Paths don't go through arrays
+  JSON_PATH_FIELD inArray = { "a.b" };
+  assertEqual(jsonPathExtract("{\"a\": [{\"b\": 1}]}", &inArray, 1), 0);
+
+  delay(LOOP_DELAY);
+}
+
+test(json_path_early_stop)
+{
+  JSON_PATH_FIELD fields[] = {
+    { "a" },
+    { "b.c" }
+  };
+
+  // Nothing after the last path found is read, nor needs to be valid
+  const char *json = "{\"a\": true, \"b\": {\"c\": null}, \"d\": @@@";
+  assertEqual(jsonPathExtract(json, fields, 2), 2);
+  assertEqual(memcmp(fields[0].value, "true", fields[0].length), 0);
+  assertEqual(memcmp(fields[1].value, "null", fields[1].length), 0);
+
+  // The payload is bounded by its size, not a '\0'
+  const char *padded = "{\"a\": 12}garbage";
+  assertEqual(JsonPath_Extract((const unsigned char *)padded, 9, fields, 1), 1);
+  assertEqual(fields[0].length, 2);
+
+  // With a path missing the whole payload is checked
+  JSON_PATH_FIELD missing[] = {
+    { "a" },
+    { "z" }
+  };
+  assertEqual(jsonPathExtract(json, missing, 2), -1);
+
+  delay(LOOP_DELAY);
+}
+
+test(json_path_malformed)
+{
+  // Never found, so every payload is read to its end
+  JSON_PATH_FIELD field = { "z" };
+  const char *bad[] = {
+    "",
+    "   ",
+    "{",
+    "{\"a\"}",
+    "{\"a\": }",
+    "{\"a\": 1,}",
+    "{\"a\": 1 \"b\": 2}",
+    "{a: 1}",
+    "[1, 2",
+    "{\"a\": \"open}",
+    "{\"a\": \"ctrl\x01\"}",
+    "{\"a\": tru}",
+    "{\"a\": nul}",
+    "{\"a\": 1} 2"
+  };
+
+  for (unsigned int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+  {
+    assertEqual(jsonPathExtract(bad[i], &field, 1), -1);
+  }
+  assertEqual(JsonPath_Extract(NULL, 0, &field, 1), -1);
+  assertEqual(JsonPath_Extract((const unsigned char *)"{}", 2, NULL, 1), -1);
+  assertEqual(jsonPathExtract("{}", &field, 1), 0);
+
+  delay(LOOP_DELAY);
+}
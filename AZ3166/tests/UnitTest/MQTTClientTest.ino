@@ -0,0 +1,494 @@
+#define MQTT_TEST_PACKET_SIZE   256
+#define MQTT_TEST_STREAM_SIZE   65536
+#define MQTT_TEST_INPUT_SIZE    256
+#define MQTT_TEST_OUTPUT_SIZE   256
+#define MQTT_TEST_SEGMENTS      16
+
+// Bytes of the generated payloads, so a 64 KB message needs no buffer
+static unsigned char mqttPattern(int offset)
+{
+  return (unsigned char)(offset * 7 + offset / 251);
+}
+
+// The broker end of the connection: what the client reads is queued with
+// feed() or feedPattern(), what it writes is kept in output. Writes from the
+// watched memory are only counted, they must come in order.
+class FakeMQTTNetwork
+{
+public:
+  FakeMQTTNetwork()
+  {
+    inputLength = 0;
+    segmentCount = 0;
+    segment = 0;
+    segmentOffset = 0;
+    outputLength = 0;
+    maxWrite = 700;
+    watch(NULL, 0);
+  }
+
+  void feed(const unsigned char *data, int length)
+  {
+    restart();
+    if (length > 0 && inputLength + length <= MQTT_TEST_INPUT_SIZE && addSegment(inputLength, length))
+    {
+      memcpy(&input[inputLength], data, length);
+      inputLength += length;
+    }
+  }
+
+  void feedPattern(int length)
+  {
+    restart();
+    addSegment(-1, length);
+  }
+
+  void feedConnack()
+  {
+    unsigned char packet[8];
+    feed(packet, MQTTSerialize_connack(packet, sizeof(packet), 0, 0));
+  }
+
+  void feedSuback(unsigned short id)
+  {
+    unsigned char packet[8];
+    int qos = 1;
+    feed(packet, MQTTSerialize_suback(packet, sizeof(packet), id, 1, &qos));
+  }
+
+  void feedAck(unsigned char type, unsigned short id)
+  {
+    unsigned char packet[8];
+    feed(packet, MQTTSerialize_ack(packet, sizeof(packet), type, 0, id));
+  }
+
+  // A publish whose payload, if any, is fed separately
+  void feedPublishHeader(const char *topic, int qos, unsigned short id, int payloadLength)
+  {
+    unsigned char packet[64];
+    MQTTString topicString = MQTTString_initializer;
+    topicString.cstring = (char *)topic;
+    feed(packet, MQTTSerialize_publishHeader(packet, sizeof(packet), 0, qos, 0, id, topicString, payloadLength));
+  }
+
+  void watch(const unsigned char *start, int length)
+  {
+    watchStart = start;
+    watchLength = length;
+    watched = 0;
+  }
+
+  int read(unsigned char *buffer, int len, int)
+  {
+    int n = 0;
+    while (n < len && segment < segmentCount)
+    {
+      SEGMENT *current = &segments[segment];
+      int size = current->length - segmentOffset;
+      size = (size < len - n) ? size : len - n;
+      for (int i = 0; i < size; i++)
+      {
+        buffer[n + i] = (current->start < 0) ? mqttPattern(segmentOffset + i) : input[current->start + segmentOffset + i];
+      }
+      n += size;
+      segmentOffset += size;
+      if (segmentOffset == current->length)
+      {
+        segment++;
+        segmentOffset = 0;
+      }
+    }
+    return n;
+  }
+
+  int write(unsigned char *buffer, int len, int)
+  {
+    len = (len < maxWrite) ? len : maxWrite;
+    if (buffer >= watchStart && buffer < watchStart + watchLength)
+    {
+      if (buffer == watchStart + watched)
+      {
+        watched += len;
+      }
+    }
+    else if (outputLength + len <= MQTT_TEST_OUTPUT_SIZE)
+    {
+      memcpy(&output[outputLength], buffer, len);
+      outputLength += len;
+    }
+    return len;
+  }
+
+  unsigned char output[MQTT_TEST_OUTPUT_SIZE];
+  int outputLength;
+  int watched;        // bytes written from the watched memory, in order
+  int maxWrite;       // most bytes taken by one write
+
+private:
+  typedef struct
+  {
+    int start;        // offset in input, -1 for a generated payload
+    int length;
+  } SEGMENT;
+
+  // Once everything fed is read, the input is used from its start again
+  void restart()
+  {
+    if (segment == segmentCount)
+    {
+      inputLength = 0;
+      segmentCount = 0;
+      segment = 0;
+    }
+  }
+
+  bool addSegment(int start, int length)
+  {
+    if (segmentCount == MQTT_TEST_SEGMENTS)
+    {
+      return false;
+    }
+    segments[segmentCount].start = start;
+    segments[segmentCount].length = length;
+    segmentCount++;
+    return true;
+  }
+
+  unsigned char input[MQTT_TEST_INPUT_SIZE];
+  int inputLength;
+  SEGMENT segments[MQTT_TEST_SEGMENTS];
+  int segmentCount;
+  int segment;
+  int segmentOffset;
+  const unsigned char *watchStart;
+  int watchLength;
+};
+
+class MQTTTestClient : public MQTT::Client<FakeMQTTNetwork, Countdown, MQTT_TEST_PACKET_SIZE, 8>
+{
+public:
+  MQTTTestClient(FakeMQTTNetwork &network, unsigned int timeout_ms = 2000)
+    : MQTT::Client<FakeMQTTNetwork, Countdown, MQTT_TEST_PACKET_SIZE, 8>(network, timeout_ms), _network(network)
+  {
+  }
+
+  int connectSession(bool cleanSession)
+  {
+    MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+    options.cleansession = cleanSession;
+    _network.feedConnack();
+    return connect(options);
+  }
+
+private:
+  FakeMQTTNetwork &_network;
+};
+
+static int mqttStreamOffset;
+static int mqttStreamErrors;
+static int mqttStreamPieces;
+static int mqttStreamMessages;
+static char mqttStreamTopic[16];
+
+static void mqttStreamHandler(MQTT::MessageData &md)
+{
+  MQTT::Message &message = md.message;
+  if ((int)message.offset != mqttStreamOffset)
+  {
+    mqttStreamErrors++;
+  }
+  for (size_t i = 0; i < message.payloadlen; i++)
+  {
+    if (((unsigned char *)message.payload)[i] != mqttPattern(message.offset + i))
+    {
+      mqttStreamErrors++;
+      break;
+    }
+  }
+  mqttStreamOffset += message.payloadlen;
+  mqttStreamPieces++;
+  if (mqttStreamOffset == (int)message.totallen)
+  {
+    mqttStreamOffset = 0;
+    mqttStreamMessages++;
+    int length = md.topicName.lenstring.len < (int)sizeof(mqttStreamTopic) - 1 ? md.topicName.lenstring.len : sizeof(mqttStreamTopic) - 1;
+    memcpy(mqttStreamTopic, md.topicName.lenstring.data, length);
+    mqttStreamTopic[length] = '\0';
+  }
+}
+
+test(mqtt_client_streaming)
+{
+  FakeMQTTNetwork network;
+  MQTTTestClient client(network);
+  mqttStreamOffset = 0;
+  mqttStreamErrors = 0;
+  mqttStreamPieces = 0;
+  mqttStreamMessages = 0;
+
+  assertEqual(client.connectSession(true), 0);
+  network.feedSuback(1);
+  assertEqual(client.subscribe("dev/#", MQTT::QOS1, mqttStreamHandler), 0);
+
+  // Two 64 KB messages for a 256 byte packet buffer, then one that fits
+  network.feedPublishHeader("dev/big", 0, 0, MQTT_TEST_STREAM_SIZE);
+  network.feedPattern(MQTT_TEST_STREAM_SIZE);
+  network.feedPublishHeader("dev/big1", 1, 77, MQTT_TEST_STREAM_SIZE);
+  network.feedPattern(MQTT_TEST_STREAM_SIZE);
+  network.feedPublishHeader("dev/small", 0, 0, 5);
+  network.feedPattern(5);
+  network.feedAck(PUBACK, 2);
+
+  // A 64 KB publish goes out from the caller's memory, the flash serves as its payload
+  const unsigned char *payload = (const unsigned char *)FLASH_BASE;
+  int start = network.outputLength;
+  network.watch(payload, MQTT_TEST_STREAM_SIZE);
+  assertEqual(client.publish("dev/up", (void *)payload, MQTT_TEST_STREAM_SIZE, MQTT::QOS1), 0);
+  assertEqual(network.watched, MQTT_TEST_STREAM_SIZE);
+
+  unsigned char header[16];
+  MQTTString topic = MQTTString_initializer;
+  topic.cstring = (char *)"dev/up";
+  int headerLength = MQTTSerialize_publishHeader(header, sizeof(header), 0, 1, 0, 2, topic, MQTT_TEST_STREAM_SIZE);
+  assertEqual(memcmp(&network.output[start], header, headerLength), 0);
+
+  // Read while waiting for the PUBACK, a piece at a time
+  assertEqual(mqttStreamErrors, 0);
+  assertEqual(mqttStreamMessages, 3);
+  assertTrue(mqttStreamPieces > 2 * MQTT_TEST_STREAM_SIZE / MQTT_TEST_PACKET_SIZE);
+  assertEqual(strcmp(mqttStreamTopic, "dev/small"), 0);
+
+  // The QoS 1 message is acknowledged after its payload
+  assertEqual(network.outputLength, start + headerLength + 4);
+  assertEqual(memcmp(&network.output[start + headerLength], "\x40\x02\x00\x4d", 4), 0);
+
+  delay(LOOP_DELAY);
+}
+
+
+// The matching of the MQTT spec, one level at a time, for the topic tree to agree with
+static bool mqttTopicMatches(const char *filter, const char *topic)
+{
+  while (true)
+  {
+    const char *filterEnd = strchr(filter, '/');
+    const char *topicEnd = strchr(topic, '/');
+    int filterLength = (filterEnd != NULL) ? filterEnd - filter : strlen(filter);
+    int topicLength = (topicEnd != NULL) ? topicEnd - topic : strlen(topic);
+
+    if (filterLength == 1 && filter[0] == '#')
+    {
+      return true;
+    }
+    if (!(filterLength == 1 && filter[0] == '+') && (filterLength != topicLength || memcmp(filter, topic, filterLength) != 0))
+    {
+      return false;
+    }
+    if (filterEnd == NULL || topicEnd == NULL)
+    {
+      // "a/#" matches "a" too
+      return (topicEnd == NULL) && (filterEnd == NULL || strcmp(filterEnd, "/#") == 0);
+    }
+    filter = filterEnd + 1;
+    topic = topicEnd + 1;
+  }
+}
+
+// Each handler marks its bit in mqttHits
+static int mqttHits;
+static void mqttHit0(MQTT::MessageData &) { mqttHits |= 1 << 0; }
+static void mqttHit1(MQTT::MessageData &) { mqttHits |= 1 << 1; }
+static void mqttHit2(MQTT::MessageData &) { mqttHits |= 1 << 2; }
+static void mqttHit3(MQTT::MessageData &) { mqttHits |= 1 << 3; }
+static void mqttHit4(MQTT::MessageData &) { mqttHits |= 1 << 4; }
+static void mqttHit5(MQTT::MessageData &) { mqttHits |= 1 << 5; }
+static void mqttHit6(MQTT::MessageData &) { mqttHits |= 1 << 6; }
+static void mqttHit7(MQTT::MessageData &) { mqttHits |= 1 << 7; }
+
+static unsigned long mqttRandomState;
+
+static int mqttRandom(int range)
+{
+  mqttRandomState = mqttRandomState * 1103515245 + 12345;
+  return (mqttRandomState >> 16) % range;
+}
+
+// Up to levels levels of a, b, c or nothing, with '+' and a last '#' in a filter
+static void mqttRandomTopic(char *text, int levels, bool filter)
+{
+  int count = 1 + mqttRandom(levels);
+  int length = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (i > 0)
+    {
+      text[length++] = '/';
+    }
+    int word = mqttRandom(filter ? 6 : 4);
+    if (word < 3)
+    {
+      text[length++] = 'a' + word;
+    }
+    else if (word == 4)
+    {
+      text[length++] = '+';
+    }
+    else if (word == 5 && i == count - 1)
+    {
+      text[length++] = '#';
+    }
+  }
+  text[length] = '\0';
+}
+
+test(mqtt_client_topic_tree)
+{
+  MQTTTestClient::messageHandler handlers[8] = { mqttHit0, mqttHit1, mqttHit2, mqttHit3, mqttHit4, mqttHit5, mqttHit6, mqttHit7 };
+  char filters[8][12];
+  char topic[12];
+
+  // Cases the character matcher used to miss
+  assertTrue(mqttTopicMatches("a/#", "a"));
+  assertTrue(mqttTopicMatches("a/+/b", "a//b"));
+  assertFalse(mqttTopicMatches("a/+", "a"));
+
+  mqttRandomState = 1;
+  for (int round = 0; round < 20; round++)
+  {
+    FakeMQTTNetwork network;
+    MQTTTestClient client(network);
+    assertEqual(client.connectSession(true), 0);
+
+    // Filters may repeat, each of them is called
+    for (int i = 0; i < 8; i++)
+    {
+      mqttRandomTopic(filters[i], 4, true);
+      network.feedSuback(i + 1);
+      assertEqual(client.subscribe(filters[i], MQTT::QOS0, handlers[i]), 0);
+    }
+
+    for (int k = 0; k < 20; k++)
+    {
+      mqttRandomTopic(topic, 5, false);
+      int expected = 0;
+      for (int i = 0; i < 8; i++)
+      {
+        if (mqttTopicMatches(filters[i], topic))
+        {
+          expected |= 1 << i;
+        }
+      }
+
+      mqttHits = 0;
+      network.feedPublishHeader(topic, 0, 0, 1);
+      network.feedPattern(1);
+      client.yield(5);
+      assertEqual(mqttHits, expected);
+    }
+  }
+
+  delay(LOOP_DELAY);
+}
+
+// Bit id of mqttAcked or mqttFailed is set when publish id completes
+static int mqttAcked;
+static int mqttFailed;
+
+static void mqttPublishDone(unsigned short id, int rc, void *)
+{
+  if (rc == MQTT::SUCCESS)
+  {
+    mqttAcked |= 1 << id;
+  }
+  else
+  {
+    mqttFailed |= 1 << id;
+  }
+}
+
+// The packet ids of the publishes written from offset on, all of them sent again
+static int mqttResentIds(FakeMQTTNetwork &network, int offset)
+{
+  int ids = 0;
+  while (offset < network.outputLength)
+  {
+    unsigned char *packet = &network.output[offset];
+    int remaining;
+    int length = 1 + MQTTPacket_decodeBuf(packet + 1, &remaining) + remaining;
+    unsigned char dup, retained;
+    unsigned short id;
+    int qos, payloadLength;
+    unsigned char *payload;
+    MQTTString topic;
+    if ((packet[0] >> 4) == PUBLISH && MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topic, &payload, &payloadLength, packet, length) == 1)
+    {
+      ids |= dup ? 1 << id : 0;
+    }
+    offset += length;
+  }
+  return ids;
+}
+
+test(mqtt_client_window)
+{
+  FakeMQTTNetwork network;
+  MQTTTestClient client(network, 200);
+  MQTT::Message message;
+  message.qos = MQTT::QOS1;
+  message.retained = false;
+  message.payload = (void *)"reading";
+  message.payloadlen = 7;
+  mqttAcked = 0;
+  mqttFailed = 0;
+
+  assertEqual(client.connectSession(false), 0);
+  for (int i = 1; i <= 4; i++)
+  {
+    assertEqual(client.publishAsync("dev/up", message, mqttPublishDone), 0);
+    assertEqual(message.id, i);
+  }
+  assertEqual(client.inflightMessageCount(), 4);
+  assertEqual(client.publishAsync("dev/up", message, mqttPublishDone), MQTT::FAILURE);
+
+  // Acks in any order free their slots
+  network.feedAck(PUBACK, 3);
+  network.feedAck(PUBACK, 1);
+  client.yield(5);
+  assertEqual(mqttAcked, (1 << 1) | (1 << 3));
+  assertEqual(client.inflightMessageCount(), 2);
+
+  // After a lost connection the rest go again with DUP set and their ids
+  client.disconnect();
+  int offset = network.outputLength;
+  assertEqual(client.connectSession(false), 0);
+  assertEqual(mqttResentIds(network, offset), (1 << 2) | (1 << 4));
+  assertEqual(client.publishAsync("dev/up", message, mqttPublishDone), 0);
+  assertEqual(message.id, 5);
+  network.feedAck(PUBACK, 2);
+  network.feedAck(PUBACK, 4);
+  network.feedAck(PUBACK, 5);
+  client.yield(5);
+  assertEqual(mqttAcked, 0x3E);
+  assertEqual(client.inflightMessageCount(), 0);
+
+  // A blocking publish with no ack gives up, its packet is sent again from pubbuf
+  assertEqual(client.publish("dev/up", message.payload, message.payloadlen, MQTT::QOS1), MQTT::FAILURE);
+  assertFalse(client.isConnected());
+  offset = network.outputLength;
+  assertEqual(client.connectSession(false), 0);
+  assertEqual(mqttResentIds(network, offset), 1 << 6);
+  network.feedAck(PUBACK, 6);
+  client.yield(5);
+  assertEqual(client.inflightMessageCount(), 0);
+
+  // A clean session drops what is in flight
+  assertEqual(client.publishAsync("dev/up", message, mqttPublishDone), 0);
+  client.disconnect();
+  offset = network.outputLength;
+  assertEqual(client.connectSession(true), 0);
+  assertEqual(mqttResentIds(network, offset), 0);
+  assertEqual(mqttFailed, 1 << 7);
+  assertEqual(client.inflightMessageCount(), 0);
+
+  delay(LOOP_DELAY);
+}
@@ -0,0 +1,63 @@
+test(ring_buffer_wrap)
+{
+  RingBuffer ring(100);
+  uint8_t data[96];
+  uint8_t out[96];
+
+  assertEqual(ring.capacity(), 100);
+  for (int i = 0; i < 96; i++)
+  {
+    data[i] = i;
+  }
+
+  // Push the indices past the end so the next put wraps around
+  assertEqual(ring.put(data, 96), 96);
+  assertEqual(ring.get(out, 96), 96);
+  assertEqual(ring.put(data, 96), 96);
+  assertEqual(ring.use(), 96);
+  assertEqual(ring.available(), 4);
+  assertEqual(ring.get(out, 96), 96);
+  assertEqual(memcmp(data, out, 96), 0);
+
+  assertEqual(ring.putc(0x5A), 0x5A);
+  assertEqual(ring.getc(), 0x5A);
+  assertEqual(ring.getc(), -1);
+
+  // Exactly the requested size fits
+  assertEqual(ring.put(data, 96), 96);
+  assertEqual(ring.put(data, 8), 4);
+  assertEqual(ring.putc(0x5A), -1);
+  assertEqual(ring.use(), 100);
+  assertEqual(ring.available(), 0);
+  assertEqual(ring.get(out, 96), 96);
+  assertEqual(memcmp(data, out, 96), 0);
+  assertEqual(ring.get(out, 8), 4);
+  assertEqual(memcmp(data, out, 4), 0);
+
+  delay(LOOP_DELAY);
+}
+
+test(ring_buffer_span)
+{
+  RingBuffer ring(64);
+  uint8_t *wspan;
+  const uint8_t *rspan;
+
+  assertEqual(ring.reserve(&wspan), 64);
+  memset(wspan, 0xA5, 40);
+  ring.commit(40);
+  assertEqual(ring.peekSpan(&rspan), 40);
+  assertEqual(rspan[39], 0xA5);
+  ring.consume(40);
+
+  // Only the bytes up to the end of the storage are contiguous
+  assertEqual(ring.reserve(&wspan), 24);
+  ring.commit(24);
+  assertEqual(ring.reserve(&wspan), 40);
+  assertEqual(ring.peekSpan(&rspan), 24);
+
+  ring.clear();
+  assertEqual(ring.use(), 0);
+
+  delay(LOOP_DELAY);
+}
@@ -7,6 +7,18 @@
 #include "AZ3166WiFi.h"
 #include "SystemWiFi.h"
 #include "PinNames.h"
+#include "RingBuffer.h"
+#include "FileSpool.h"
+#include "FATFileSystem.h"
+#include "SFlashBlockDevice.h"
+#include "fatfs_exfuns.h"
+#include "JsonPath.h"
+#include "DevKitMQTTClient.h"
+#include "SystemTickCounter.h"
+#include "internal/iothubtransport.h"
+// The MQTT tests read large messages in pieces
+#define MQTTCLIENT_STREAMING 1
+#include "MQTTClient.h"
 #include "config.h"
 
 void setup() {